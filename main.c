@@ -23,11 +23,27 @@
  */
 
 #include "mml_compiler.h"
+#include "mml_binary.h"
+#include "mml_output.h"
+#include "mml_optimize.h"
+#include "mml_z80.h"
+#include "mml_iter.h"
+#include "mml_player.h"
+#include "mml_trace.h"
+#include "mml_vgm.h"
+#include "mml_render.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <limits.h>
 #include <libgen.h>
 #include <ctype.h>
@@ -37,13 +53,34 @@
 #define CH_BUF_SIZE	32768
 #define LINE_BUF_SIZE	400
 
-/* MMLコンパイル結果オブジェクトファイル構造 */
-#define CH1_ADDR_OFFSET		0
-#define CH2_ADDR_OFFSET		2
-#define CH3_ADDR_OFFSET		4
-#define CH1_START_OFFSET	8	/* オリジナルZ80版コンパイラ準拠 */
+/* ストリーミング時に E, F チャンネル出力を一時ファイルに書き出す閾値 */
+#define SPILL_THRESHOLD	4096
+#define COPY_BUF_SIZE	4096
 
-#define PSG_NCH 3
+#ifndef IOV_MAX
+#define IOV_MAX		1024
+#endif
+
+/* インクルードのネスト上限 (循環インクルード検出用) */
+#define INCLUDE_MAX_DEPTH	16
+
+/* -m z80 で割り込み処理を呼び出す回数の既定値 */
+#define Z80_DEFAULT_TICKS	3600
+
+/* -m render のサンプリング周波数の既定値と範囲 */
+#define RENDER_DEFAULT_RATE	44100
+#define RENDER_MIN_RATE		8000
+#define RENDER_MAX_RATE		192000
+
+/* -m render -c の PCM キャッシュの上限 (KB) */
+#define RENDER_MAX_CACHE	(1024 * 1024)
+
+/* -m play で 1 度に書き出すサンプル数の既定値と上限 */
+#define PLAY_DEFAULT_BLOCK	512
+#define PLAY_MAX_BLOCK		65536
+
+/* ドライバモデルで演奏する割り込み回数の上限の既定値 (モデル上の 1 時間) */
+#define MODEL_DEFAULT_TICKS	(MML_PLAYER_HZ * 60 * 60)
 
 static const uint16_t ch_offset[PSG_NCH] = {
     CH1_ADDR_OFFSET, CH2_ADDR_OFFSET, CH3_ADDR_OFFSET
@@ -53,18 +90,106 @@ static const char *progname;
 
 typedef struct psgch {
     MML_Compiler mmlcp;
-    uint8_t *buf;
     uint16_t offset;
+    bool shared;            /* 他のチャンネルのデータを共有 (出力しない) */
     char last_line[LINE_BUF_SIZE];
+    char jump_line[LINE_BUF_SIZE];  /* 'J' のある行 (終了時のエラー表示用) */
 } psgch_t;
 
+/*
+ * インクルード断片のコンパイル結果キャッシュ
+ *  同じ断片を同じチャンネル状態で再度インクルードした場合は
+ *  再コンパイルせずに出力バイト列と終了時の状態を再利用する
+ */
+typedef struct fragment {
+    struct fragment *next;
+    char *path;
+    /* キャッシュのキー: 断片開始時の状態 */
+    MML_ChannelState entry[PSG_NCH];
+    bool x_entry;
+    /* キャッシュの値: 出力バイト列と断片終了時の状態 */
+    MML_ChannelState exit[PSG_NCH];
+    bool x_exit;
+    uint8_t *obj[PSG_NCH];
+    size_t obj_len[PSG_NCH];
+    MML_SrcPos *map[PSG_NCH];   /* 断片先頭からのオフセットでのソースマップ */
+    size_t nmap[PSG_NCH];
+    bool has_line[PSG_NCH];
+    char last_line[PSG_NCH][LINE_BUF_SIZE];
+} fragment_t;
+
+/* MMLファイル単位コンパイル処理の共通状態 */
+typedef struct mmlsrc {
+    psgch_t psgch[PSG_NCH];
+    const char *fname;      /* 指定 MML ファイル名 */
+    bool x_disabled;
+    bool abort;
+    int depth;              /* インクルードのネスト段数 (0: 指定ファイル) */
+    fragment_t *fragments;  /* 断片キャッシュ */
+    char **deps;            /* 依存ファイル一覧 (-M, -S 指定時の出力用) */
+    size_t ndeps;
+    MML_MacroTable macros;  /* 全チャンネル共通マクロ定義 */
+    size_t nerrors;         /* チャンネル別コンパイル以外のエラー件数 */
+} mmlsrc_t;
+
 static void
 usage(void)
 {
     fprintf(stderr,
-"使い方: %s [-b addr] 入力MMLファイル 出力バイナリファイル\n"
-"         -b addr コンパイル後データのベースアドレス\n",
-       progname);
+"使い方: %s [-O] [-b addr] [-M depfile] [-S mapfile] [-T tracefile] [-t ticks]\n"
+"         [-V vgmfile] [-H hexfile] [-C cfile] [-A asmfile] [-R prefix]\n"
+"         入力MMLファイル 出力バイナリファイル\n"
+"       %s -l [オプション] 入力MMLファイル... 出力バイナリファイル\n"
+"       %s -m optimize [-b addr] 入力バイナリファイル 出力バイナリファイル\n"
+"       %s -m verify [-l] [-b addr] 入力バイナリファイル...\n"
+"       %s -m info [-l] [-b addr] 入力バイナリファイル...\n"
+"       %s -m patch [-l] [-b addr] 前回のバイナリファイル 新しいバイナリファイル\n"
+"         出力パッチファイル [出力パッチ一覧ファイル]\n"
+"       %s -m z80 -D load,init,play[,sp] [-b addr] [-t ticks]\n"
+"         ドライバファイル 入力バイナリファイル [出力トレースファイル]\n"
+"       %s -m diff [-t ticks] 入力MMLファイル...\n"
+"       %s -m trace [-s start] トレースファイル [出力テキストファイル]\n"
+"       %s -m render [-jO] [-c kbytes] [-p synth] [-r rate] [-s start]\n"
+"         [-t ticks] 入力MMLファイル 出力WAVファイル\n"
+"       %s -m play [-jO] [-B samples] [-f format] [-p synth] [-r rate]\n"
+"         [-s start] [-t ticks] 入力MMLファイル\n"
+"         (ファイル名が - なら標準入力/標準出力)\n"
+"         -b addr コンパイル後データのベースアドレス\n"
+"         -m mode 動作モード\n"
+"            optimize: コンパイル済みバイナリを最適化して配置し直す\n"
+"            verify:   コンパイル済みバイナリを検証する\n"
+"            info:     コンパイル済みバイナリの各チャンネルの長さを表示する\n"
+"            patch:    前回のバイナリからの差分パッチを出力する\n"
+"            z80:      実機の音源ドライバを Z80 で実行して PSG 書き込みを記録する\n"
+"            diff:     最適化の有無で演奏内容が変わらないことを確認する\n"
+"            trace:    PSG レジスタ書き込みトレースをテキストで表示する\n"
+"            render:   ドライバモデルで演奏して WAV ファイルに出力する\n"
+"            play:     ドライバモデルで演奏して標準出力へ逐次出力する\n"
+"         -D load,init,play[,sp] ドライバのロード, 初期化, 割り込み処理,\n"
+"            スタックのアドレス\n"
+"         -t ticks 割り込み処理を呼び出す回数 (省略時 3600)\n"
+"            diff, -T では演奏を打ち切る割り込み回数 (省略時 216000)\n"
+"            render, play では出力する割り込み回数 (省略時 演奏終了まで)\n"
+"         -s start 開始位置 (割り込み番号, 分:秒, render では L行番号も可)\n"
+"         -r rate WAV のサンプリング周波数 (省略時 44100)\n"
+"         -p synth PSG の音声合成方式 (blep: 帯域制限ステップ (省略時),\n"
+"            oversample: オーバーサンプリング)\n"
+"         -c kbytes ループの繰り返し単位の PCM キャッシュの上限 (KB)\n"
+"         -j チャンネル毎のスレッドで合成する (blep のみ, -c と併用不可)\n"
+"         -B samples play で 1 度に書き出すサンプル数 (省略時 512)\n"
+"         -f format play の出力形式 (wav (省略時), raw: ヘッダ無しの PCM)\n"
+"         -l 複数の曲を曲インデックステーブル付きの 1 ファイルにまとめる\n"
+"         -O 出力サイズの最適化を行う\n"
+"         -M depfile make用の依存関係ファイルを出力\n"
+"         -S mapfile 出力バイトとMMLソース位置のソースマップを出力\n"
+"         -T tracefile ドライバモデルでの PSG レジスタ書き込みトレースを出力\n"
+"         -V vgmfile ドライバモデルでの PSG レジスタ書き込みを VGM 形式で出力\n"
+"         -H hexfile Intel HEX 形式で出力\n"
+"         -C cfile C 言語の配列定義を出力\n"
+"         -A asmfile アセンブラ DB ソースを出力\n"
+"         -R prefix チャンネル毎のデータを prefix_D.bin などに出力\n",
+       progname, progname, progname, progname, progname, progname,
+       progname, progname, progname, progname, progname);
     exit(EXIT_FAILURE);
 }
 
@@ -76,168 +201,2280 @@ put_word_le(uint8_t *buf, uint16_t v)
     buf[1] = (uint8_t)(v >> 8);
 }
 
-/* MMLコンパイルエラー表示 */
+/*
+ * MMLコンパイルエラー表示 (診断情報リストの first 番目以降を全て表示)
+ *  fname はインクルードファイル内のエラーの場合のみ指定
+ */
 static void
-print_mmlc_error(MML_Compiler *c, char *line)
+print_mmlc_error(MML_Compiler *c, size_t first, const char *fname,
+    char *line)
 {
-    fprintf(stderr, "エラー: %s\n", c->error_msg);
-    fprintf(stderr, "%s", line);
-    fprintf(stderr, "%*s^\n", c->error_col - 1, "");
+    if (first >= c->ndiags) {
+        /* 診断情報リストに入らなかった場合は最後のエラーのみ表示 */
+        if (fname != NULL)
+            fprintf(stderr, "エラー: %s: %s\n", fname, c->error_msg);
+        else
+            fprintf(stderr, "エラー: %s\n", c->error_msg);
+        fprintf(stderr, "%s", line);
+        fprintf(stderr, "%*s^\n", c->error_col - 1, "");
+        return;
+    }
+    for (size_t i = first; i < c->ndiags; i++) {
+        MML_Diag *d = &c->diags[i];
+        if (fname != NULL)
+            fprintf(stderr, "エラー: %s: %s\n", fname, d->msg);
+        else
+            fprintf(stderr, "エラー: %s\n", d->msg);
+        fprintf(stderr, "%s", line);
+        fprintf(stderr, "%*s^\n", d->col - 1, "");
+    }
 }
 
-int
-main(int argc, char *argv[])
+/* チャンネルのコンパイル結果の長さ (一時ファイル書き出し分を含む) */
+static size_t
+channel_len(const MML_Compiler *c)
 {
-    char *progpath;
-    int ch;
-    int baseaddr = 0x0000;
-    const char *ifname, *ofname;
-    FILE *ifp = NULL, *ofp = NULL;
+    return c->out_spilled + c->out_len;
+}
 
-    progpath = strdup(argv[0]);
-    progname = basename(progpath);
+/* 書き込み途中の出力一時ファイル (異常終了時に削除) */
+static char *tmpoutname;
 
-    while ((ch = getopt(argc, argv, "b:")) != -1) {
-        char *endptr;
-        switch (ch) {
-        case 'b':
-            baseaddr = (int)strtol(optarg, &endptr, 0);
-            if (*endptr != '\0' || baseaddr < 0 || baseaddr > 0xffff) {
-                usage();
-            }
-            break;
-        default:
-            usage();
-        }
+static void
+remove_tmpout(void)
+{
+    if (tmpoutname != NULL)
+        unlink(tmpoutname);
+}
+
+static void
+remove_tmpout_signal(int sig)
+{
+    remove_tmpout();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*
+ * 出力ファイルを開く
+ *  同じディレクトリの一時ファイルに書き込み、close_output() で
+ *  rename して置き換える (中断時に書きかけの出力を残さない)
+ */
+static int
+open_output(const char *ofname)
+{
+    if (strcmp(ofname, "-") == 0)
+        return STDOUT_FILENO;
+
+    size_t len = strlen(ofname) + sizeof(".XXXXXX");
+    tmpoutname = malloc(len);
+    if (tmpoutname == NULL)
+        errx(EXIT_FAILURE, "出力ファイル名を確保できませんでした");
+    snprintf(tmpoutname, len, "%s.XXXXXX", ofname);
+    int fd = mkstemp(tmpoutname);
+    if (fd < 0) {
+        free(tmpoutname);
+        tmpoutname = NULL;
+        errx(EXIT_FAILURE,
+          "出力コンパイルバイナリファイルを開けませんでした: %s", ofname);
     }
-    argc -= optind;
-    argv += optind;
+    /* mkstemp() は 0600 で作成するので fopen() と同じパーミッションにする */
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    return fd;
+}
 
-    if (argc != 2)
-        usage();
+static void
+close_output(int fd, const char *ofname)
+{
+    if (fd == STDOUT_FILENO)
+        return;
+    if (close(fd) != 0)
+        errx(EXIT_FAILURE, "出力ファイルの書き込みに失敗しました");
+    if (rename(tmpoutname, ofname) != 0) {
+        errx(EXIT_FAILURE,
+          "出力コンパイルバイナリファイルを作成できませんでした: %s", ofname);
+    }
+    free(tmpoutname);
+    tmpoutname = NULL;
+}
 
-    ifname = argv[0];
-    ofname = argv[1];
-    ifp = fopen(ifname, "r");
-    if (ifp == NULL) {
-        errx(EXIT_FAILURE, "入力MMLファイルを開けませんでした: %s", ifname);
+/* iovec 配列を全て書き込む (部分書き込みは続きから再試行) */
+static void
+writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            errx(EXIT_FAILURE, "出力ファイルの書き込みに失敗しました");
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
+}
 
-    psgch_t psgch[PSG_NCH];
-    for (int i = 0; i < PSG_NCH; i++) {
-        psgch_t *psgchp = &psgch[i];
-        MML_Compiler *c = &psgchp->mmlcp;
-        psgchp->buf = malloc(CH_BUF_SIZE);
-        if (psgchp->buf == NULL)
-            errx(EXIT_FAILURE, "コンパイル出力バッファが確保できませんでした");
-        mml_channel_init(c, psgchp->buf, CH_BUF_SIZE);
-        psgchp->last_line[0] = '\0';
+/*
+ * 曲インデックステーブル作成
+ *  曲毎のチャンネル先頭アドレス 3 ワードの並びと終端の 0 ワード
+ *  (1 曲のみの場合は通常のヘッダと同じ)
+ */
+static uint8_t *
+build_table(mmlsrc_t *songs, int nsongs, int baseaddr)
+{
+    uint8_t *table = calloc(1, MML_TABLE_LEN(nsongs));
+    if (table == NULL)
+        errx(EXIT_FAILURE, "出力バッファを確保できませんでした");
+    for (int s = 0; s < nsongs; s++) {
+        for (int i = 0; i < PSG_NCH; i++) {
+            put_word_le(table + MML_TABLE_ENTRY(s) + ch_offset[i],
+              baseaddr + songs[s].psgch[i].offset);
+        }
     }
+    return table;
+}
 
-    char line[LINE_BUF_SIZE];
-    int lineno = 0;
-    MML_Error error;
-    bool abort = false;
-    bool x_disabled = false;
+/*
+ * コンパイル結果の出力
+ *  ヘッダと各チャンネルのバッファを連結せずに一度の writev() で書き込む
+ *  (ストリーミング時の一時ファイル書き出し分はその位置で順に書き込む)
+ */
+static void
+write_image(int fd, mmlsrc_t *songs, int nsongs, int baseaddr)
+{
+    uint8_t *table = build_table(songs, nsongs, baseaddr);
+    struct iovec *iov = calloc(1 + nsongs * PSG_NCH, sizeof(*iov));
+    int iovcnt = 0;
 
-    /* 行単位コンパイル処理 */
-    while (fgets(line, sizeof(line), ifp) != NULL) {
-        lineno++;
-        char *p = line;
+    if (iov == NULL)
+        errx(EXIT_FAILURE, "出力バッファを確保できませんでした");
+    iov[iovcnt].iov_base = table;
+    iov[iovcnt].iov_len = MML_TABLE_LEN(nsongs);
+    iovcnt++;
 
-        /* 行頭の空白とタブをスキップ */
-        while (*p == ' ' || *p == '\t')
-            p++;
-        /* 先頭が数字なら `[行番号] "` のオリジナルコンパイラ書式も読み飛ばす */
-        if (isdigit((int)(unsigned char)*p)) {
-            /* 行番号相当の数字を読み飛ばす (わざわざ値はチェックしない) */
-            while (isdigit((int)(unsigned char)*p))
-                p++;
-            /* 行番号後に空白をスキップ */
-            while (*p == ' ')
-                p++;
-            /* 二重引用符 `"` をスキップ */
-            if (*p == '"')
-                p++;
-        }
-        ch = toupper((int)(unsigned char)*p);
+    for (int s = 0; s < nsongs; s++) {
         for (int i = 0; i < PSG_NCH; i++) {
-            if (!x_disabled && ch == 'D' + i) {
-                psgch_t *psgchp = &psgch[i];
-                MML_Compiler *c = &psgchp->mmlcp;
-                error = mml_compile_line(c, p + 1, lineno);
-                if (error != MML_OK) {
-                    print_mmlc_error(c, line);
-                    abort = true;
+            MML_Compiler *c = &songs[s].psgch[i].mmlcp;
+            if (songs[s].psgch[i].shared)
+                continue;
+            if (c->out_spilled > 0) {
+                uint8_t buf[COPY_BUF_SIZE];
+                size_t n;
+                writev_all(fd, iov, iovcnt);
+                iovcnt = 0;
+                rewind(c->spill_fp);
+                while ((n = fread(buf, 1, sizeof(buf), c->spill_fp)) > 0) {
+                    struct iovec spill = { .iov_base = buf, .iov_len = n };
+                    writev_all(fd, &spill, 1);
                 }
-                /* クローズ後のエラーメッセージ用に最終行を保存 */
-                strncpy(psgchp->last_line, line, sizeof(psgchp->last_line));
-                psgchp->last_line[sizeof(psgchp->last_line) - 1] = '\0';
+                if (ferror(c->spill_fp))
+                    errx(EXIT_FAILURE, "一時ファイルの読み込みに失敗しました");
             }
+            iov[iovcnt].iov_base = c->out;
+            iov[iovcnt].iov_len = c->out_len;
+            iovcnt++;
         }
-        if (ch == 'X') {
-            /* 行頭の'X'チャンネル指定はコンパイル停止/再開 */
-            x_disabled = !x_disabled;
-        } else {
-            DPRINTF("ignored line %d\n", lineno);
+    }
+    writev_all(fd, iov, iovcnt);
+    free(iov);
+    free(table);
+}
+
+/*
+ * 出力イメージをメモリ上に作成 (各種フォーマット出力用)
+ *  ストリーミング時に一時ファイルに書き出した分も読み戻す
+ */
+static uint8_t *
+load_image(mmlsrc_t *songs, int nsongs, int baseaddr, size_t len)
+{
+    uint8_t *img = malloc(len);
+    if (img == NULL)
+        errx(EXIT_FAILURE, "出力バッファを確保できませんでした");
+
+    uint8_t *table = build_table(songs, nsongs, baseaddr);
+    memcpy(img, table, MML_TABLE_LEN(nsongs));
+    free(table);
+    for (int s = 0; s < nsongs; s++) {
+        for (int i = 0; i < PSG_NCH; i++) {
+            psgch_t *psgchp = &songs[s].psgch[i];
+            MML_Compiler *c = &psgchp->mmlcp;
+            uint8_t *p = img + psgchp->offset;
+            if (psgchp->shared)
+                continue;
+            if (c->out_spilled > 0) {
+                rewind(c->spill_fp);
+                if (fread(p, 1, c->out_spilled, c->spill_fp) !=
+                  c->out_spilled)
+                    errx(EXIT_FAILURE, "一時ファイルの読み込みに失敗しました");
+                p += c->out_spilled;
+            }
+            memcpy(p, c->out, c->out_len);
         }
     }
-    fclose(ifp);
+    return img;
+}
 
-    /* 全行コンパイル後にチャンネルクローズしてエラーチェック */
-    for (int i = 0; i < PSG_NCH; i++) {
-        psgch_t *psgchp = &psgch[i];
-        MML_Compiler *c = &psgchp->mmlcp;
-        error = mml_finish_channel(c);
-        if (error != MML_OK) {
-            print_mmlc_error(c, psgchp->last_line);
-            abort = true;
+/*
+ * 各曲のチャンネル配置を決める
+ *  曲インデックステーブルの後に曲順、チャンネル順に並べる
+ *  share 指定時は他のチャンネル (他の曲も含む) と一致するか
+ *  その末尾と一致するチャンネルはデータを共有して出力しない
+ */
+static size_t
+layout_songs(mmlsrc_t *songs, int nsongs, int baseaddr, bool share)
+{
+    int nch = nsongs * PSG_NCH;
+    const uint8_t **data = calloc(nch, sizeof(*data));
+    size_t *len = calloc(nch, sizeof(*len));
+    int *host = calloc(nch, sizeof(*host));
+    if (data == NULL || len == NULL || host == NULL)
+        errx(EXIT_FAILURE, "配置情報を確保できませんでした");
+
+    for (int k = 0; k < nch; k++) {
+        MML_Compiler *c = &songs[k / PSG_NCH].psgch[k % PSG_NCH].mmlcp;
+        len[k] = channel_len(c);
+        /* 一時ファイルに書き出したチャンネルは比較できないので対象外 */
+        data[k] = (c->out_spilled == 0) ? c->out : NULL;
+        host[k] = -1;
+    }
+    if (share)
+        mml_share_suffixes(data, len, nch, host);
+
+    size_t layout = MML_TABLE_LEN(nsongs);
+    for (int k = 0; k < nch; k++) {
+        psgch_t *psgchp = &songs[k / PSG_NCH].psgch[k % PSG_NCH];
+        psgchp->shared = (host[k] >= 0);
+        if (psgchp->shared)
+            continue;
+        psgchp->offset = (uint16_t)layout;
+        layout += len[k];
+        if (baseaddr + layout > 0x10000) {
+            errx(EXIT_FAILURE,
+              "コンパイル結果がアドレス空間に収まりません: %s",
+              songs[k / PSG_NCH].fname);
         }
-        DPRINTF("psgch[%d].out_len = %d\n", i, c->out_len);
+    }
+    /* 共有先のチャンネルの末尾を指す */
+    for (int k = 0; k < nch; k++) {
+        if (host[k] < 0)
+            continue;
+        psgch_t *h = &songs[host[k] / PSG_NCH].psgch[host[k] % PSG_NCH];
+        songs[k / PSG_NCH].psgch[k % PSG_NCH].offset =
+          (uint16_t)(h->offset + len[host[k]] - len[k]);
     }
 
-    if (abort) {
-        errx(EXIT_FAILURE, "コンパイルエラーのため出力せず終了します");
+    free(data);
+    free(len);
+    free(host);
+    return layout;
+}
+
+/* バンクモードの曲毎のサイズ一覧表示 */
+static void
+print_bank_report(FILE *fp, mmlsrc_t *songs, int nsongs, int baseaddr,
+    size_t total)
+{
+    fprintf(fp, "曲  アドレス      D      E      F   合計  ファイル\n");
+    for (int s = 0; s < nsongs; s++) {
+        size_t songlen = 0;
+        fprintf(fp, "%3d  %04X    ", s, baseaddr + MML_TABLE_ENTRY(s));
+        for (int i = 0; i < PSG_NCH; i++) {
+            size_t len = channel_len(&songs[s].psgch[i].mmlcp);
+            fprintf(fp, " %6zu", len);
+            songlen += len;
+        }
+        fprintf(fp, " %6zu  %s\n", songlen, songs[s].fname);
+    }
+    size_t shared = 0;
+    for (int s = 0; s < nsongs; s++) {
+        for (int i = 0; i < PSG_NCH; i++) {
+            if (songs[s].psgch[i].shared)
+                shared += channel_len(&songs[s].psgch[i].mmlcp);
+        }
     }
+    if (shared > 0)
+        fprintf(fp, "チャンネルデータ共有 %zu バイト\n", shared);
+    fprintf(fp, "テーブル %zu バイト, 合計 %zu バイト (%04X-%04zX)\n",
+      (size_t)MML_TABLE_LEN(nsongs), total, baseaddr,
+      baseaddr + total - 1);
+}
 
-    /* チャンネルデータ出力 */
-    ofp = fopen(ofname, "wb");
-    if (ofp == NULL) {
+/* バイナリファイル全体の読み込み ("-" なら標準入力) */
+static uint8_t *
+read_file(const char *fname, size_t *lenp)
+{
+    FILE *fp = stdin;
+    if (strcmp(fname, "-") != 0 && (fp = fopen(fname, "rb")) == NULL)
+        errx(EXIT_FAILURE, "入力ファイルを開けませんでした: %s", fname);
+
+    /* コンパイル済みデータはアドレス空間 (64KB) に収まるはず */
+    size_t cap = 0x10000 + 1, len = 0, n;
+    uint8_t *buf = malloc(cap);
+    if (buf == NULL)
+        errx(EXIT_FAILURE, "入力バッファを確保できませんでした");
+    while (len < cap && (n = fread(buf + len, 1, cap - len, fp)) > 0)
+        len += n;
+    if (ferror(fp))
+        errx(EXIT_FAILURE, "入力ファイルを読み込めませんでした: %s", fname);
+    if (len > 0x10000)
+        errx(EXIT_FAILURE, "入力ファイルが大きすぎます: %s", fname);
+    if (fp != stdin)
+        fclose(fp);
+    *lenp = len;
+    return buf;
+}
+
+/*
+ * ベースアドレス未指定時はヘッダ (曲インデックステーブル) 直後が
+ * 最初の D チャンネル先頭という、オリジナルZ80版コンパイラと同じ配置から
+ * ベースアドレスを求める
+ */
+static int
+guess_baseaddr(const uint8_t *img, size_t len, size_t table,
+    const char *fname)
+{
+    if (len < table)
+        errx(EXIT_FAILURE, "コンパイル済みバイナリではありません: %s", fname);
+    int addr = img[CH1_ADDR_OFFSET] | (img[CH1_ADDR_OFFSET + 1] << 8);
+    if (addr < (int)table) {
         errx(EXIT_FAILURE,
-          "出力コンパイルバイナリファイルを開けませんでした: %s", ofname);
+          "ベースアドレスを判定できません (-b で指定してください): %s", fname);
+    }
+    return addr - (int)table;
+}
+
+/*
+ * バンクモードのイメージの曲数
+ *  テーブルは 0 ワードで終わる (終端が無ければ -1 を返す)
+ */
+static int
+bank_songs(const uint8_t *img, size_t len)
+{
+    for (int n = 0; ; n++) {
+        size_t p = MML_TABLE_ENTRY(n);
+        if (p + 2 > len)
+            return -1;
+        if ((img[p] | img[p + 1]) == 0)
+            return n;
     }
+}
+
+/* -m optimize: コンパイル済みバイナリの最適化 */
+static void
+optimize_binary(const char *ifname, const char *ofname, int baseaddr)
+{
+    static const char ch_name[PSG_NCH] = { 'D', 'E', 'F' };
+    size_t len, outlen;
+    uint8_t *img = read_file(ifname, &len);
+    if (baseaddr < 0)
+        baseaddr = guess_baseaddr(img, len, MML_TABLE_LEN(1), ifname);
 
-    psgch[0].offset = CH1_START_OFFSET;
-    psgch[1].offset = psgch[0].offset + psgch[0].mmlcp.out_len;
-    psgch[2].offset = psgch[1].offset + psgch[1].mmlcp.out_len;
-    int totallen    = psgch[2].offset + psgch[2].mmlcp.out_len;
+    MML_OptResult res;
+    uint8_t *out = mml_optimize_image(img, len, baseaddr, &outlen, &res);
+    if (out == NULL) {
+        if (res.error_ch >= 0) {
+            errx(EXIT_FAILURE, "%s: チャンネル%c: %s", ifname,
+              ch_name[res.error_ch], res.error);
+        }
+        errx(EXIT_FAILURE, "%s: %s", ifname, res.error);
+    }
 
-    DPRINTF("ch1 offset = %d\n", psgch[0].offset);
-    DPRINTF("ch2 offset = %d\n", psgch[1].offset);
-    DPRINTF("ch3 offset = %d\n", psgch[2].offset);
-    DPRINTF("totallen   = %d\n", totallen);
+    int ofd = open_output(ofname);
+    struct iovec iov = { .iov_base = out, .iov_len = outlen };
+    writev_all(ofd, &iov, 1);
+    close_output(ofd, ofname);
 
-    uint8_t *outbuf = malloc(totallen);
-    if (outbuf == NULL) {
-        errx(EXIT_FAILURE, "出力バッファを確保できませんでした");
+    FILE *fp = strcmp(ofname, "-") == 0 ? stderr : stdout;
+    fprintf(fp, "%s: %zu → %zu バイト (%04X-%04zX)\n", ifname, len, outlen,
+      baseaddr, baseaddr + outlen - 1);
+    fprintf(fp, "  冗長コマンド削除 %zu, 音長形式変更 %zu, ループ化 %zu\n",
+      res.removed, res.renoted, res.folded);
+    free(out);
+    free(img);
+}
+
+/*
+ * -m verify: コンパイル済みバイナリの検証
+ *  ヘッダ (バンクモードでは曲インデックステーブル) の各チャンネル先頭アドレスが
+ *  ファイル内を指していることと、各チャンネルのデータを検証する
+ *  異常は全て表示して、異常がなければ true を返す
+ */
+static bool
+verify_binary(const char *fname, int baseaddr, bool bank)
+{
+    static const char ch_name[PSG_NCH] = { 'D', 'E', 'F' };
+    size_t len;
+    uint8_t *img = read_file(fname, &len);
+    bool ok = true;
+
+    int nsongs = 1;
+    if (bank) {
+        nsongs = bank_songs(img, len);
+        if (nsongs < 0) {
+            warnx("%s: 曲インデックステーブルが終端していません", fname);
+            free(img);
+            return false;
+        }
+        if (nsongs == 0) {
+            warnx("%s: 曲インデックステーブルが空です", fname);
+            free(img);
+            return false;
+        }
     }
+    size_t table = MML_TABLE_LEN(nsongs);
+    if (baseaddr < 0)
+        baseaddr = guess_baseaddr(img, len, table, fname);
 
-    /* 出力バッファにコンパイル結果をセット */
-    for (int i = 0; i < PSG_NCH; i++) {
-        psgch_t *psgchp = &psgch[i];
-        MML_Compiler *c = &psgchp->mmlcp;
-        put_word_le(outbuf + ch_offset[i], baseaddr + psgchp->offset);
-        memcpy(outbuf + psgchp->offset, c->out, c->out_len);
-        free(psgchp->buf);
+    for (int s = 0; s < nsongs; s++) {
+        for (int i = 0; i < PSG_NCH; i++) {
+            const uint8_t *p = img + MML_TABLE_ENTRY(s) + ch_offset[i];
+            int32_t off = (p[0] | (p[1] << 8)) - baseaddr;
+            char where[32];
+            if (bank)
+                snprintf(where, sizeof(where), "曲%d チャンネル%c", s, ch_name[i]);
+            else
+                snprintf(where, sizeof(where), "チャンネル%c", ch_name[i]);
+            if (off < (int32_t)table || off >= (int32_t)len) {
+                warnx("%s: %s: 先頭アドレス %04X がファイル外を指しています",
+                  fname, where, p[0] | (p[1] << 8));
+                ok = false;
+                continue;
+            }
+            size_t errpos;
+            const char *e = mml_verify_stream(img, len, (size_t)off, &errpos);
+            if (e != NULL) {
+                warnx("%s: %s: %04zX (オフセット %04zX): %s", fname, where,
+                  baseaddr + errpos, errpos, e);
+                ok = false;
+            }
+        }
     }
+    free(img);
+    return ok;
+}
 
-    /* 出力バッファ書き込み */
-    if (fwrite(outbuf, 1, totallen, ofp) != totallen) {
-        errx(EXIT_FAILURE, "出力ファイルの書き込みに失敗しました");
+/*
+ * -m info: コンパイル済みバイナリの各チャンネルの長さ表示
+ *  ループを展開せずに繰り返しを読み飛ばして数えるので、
+ *  ネストした多数回のループでも命令数程度の時間で終わる
+ *  異常があれば表示して false を返す
+ */
+static bool
+info_binary(const char *fname, int baseaddr, bool bank)
+{
+    static const char ch_name[PSG_NCH] = { 'D', 'E', 'F' };
+    size_t len;
+    uint8_t *img = read_file(fname, &len);
+    bool ok = true;
+
+    int nsongs = bank ? bank_songs(img, len) : 1;
+    if (nsongs <= 0) {
+        warnx("%s: 曲インデックステーブルが不正です", fname);
+        free(img);
+        return false;
+    }
+    if (baseaddr < 0)
+        baseaddr = guess_baseaddr(img, len, MML_TABLE_LEN(nsongs), fname);
+
+    for (int s = 0; s < nsongs; s++) {
+        size_t start[PSG_NCH], end[PSG_NCH];
+        char song[16] = "";
+        if (bank)
+            snprintf(song, sizeof(song), "曲%d ", s);
+        int r = mml_image_channels(img, len, baseaddr, nsongs, s, start, end);
+        if (r < 0) {
+            warnx("%s: %sチャンネル%c: データがファイル内にありません",
+              fname, song, ch_name[-r - 1]);
+            ok = false;
+            continue;
+        }
+        for (int i = 0; i < PSG_NCH; i++) {
+            MML_IterLength res;
+            size_t errpos;
+            const char *e = mml_iter_length(img, len, start[i], &res, &errpos);
+            if (e != NULL) {
+                warnx("%s: %sチャンネル%c: %04zX (オフセット %04zX): %s",
+                  fname, song, ch_name[i], baseaddr + errpos, errpos, e);
+                ok = false;
+                continue;
+            }
+            printf("%s: %sチャンネル%c: %zu バイト, 音符/休符 %" PRIu64
+              ", 音長 %" PRIu64, fname, song, ch_name[i], end[i] - start[i],
+              res.nnotes, res.time);
+            if (res.loop) {
+                printf(" (J 以降 音符/休符 %" PRIu64 ", 音長 %" PRIu64 ")",
+                  res.loop_nnotes, res.loop_time);
+            }
+            putchar('\n');
+        }
+    }
+    free(img);
+    return ok;
+}
+
+/*
+ * ファイル名から C / アセンブラのシンボル名を作成
+ *  ディレクトリと拡張子を除き、識別子に使えない文字は '_' にする
+ */
+static char *
+make_symbol(const char *path)
+{
+    const char *base = strrchr(path, '/');
+    base = (base != NULL) ? base + 1 : path;
+    size_t len = strcspn(base, ".");
+    char *sym = malloc(len + 2);
+    if (sym == NULL)
+        errx(EXIT_FAILURE, "シンボル名を確保できませんでした");
+
+    char *q = sym;
+    if (len == 0 || isdigit((int)(unsigned char)base[0]))
+        *q++ = '_';
+    for (size_t i = 0; i < len; i++) {
+        int c = (unsigned char)base[i];
+        *q++ = (isalnum(c) || c == '_') ? c : '_';
+    }
+    *q = '\0';
+    return sym;
+}
+
+static FILE *
+open_format(const char *fname)
+{
+    FILE *fp = fopen(fname, "w");
+    if (fp == NULL)
+        errx(EXIT_FAILURE, "出力ファイルを開けませんでした: %s", fname);
+    return fp;
+}
+
+static void
+close_format(FILE *fp, bool ok, const char *fname)
+{
+    if (fclose(fp) != 0 || !ok)
+        errx(EXIT_FAILURE, "出力ファイルの書き込みに失敗しました: %s", fname);
+}
+
+/*
+ * -m patch: 前回のイメージとの差分パッチ出力
+ *  エミュレータなどで演奏中のイメージに変更箇所だけを書き込めるよう
+ *  バイナリのパッチ ofname とテキストの一覧 listname (省略可) を出力する
+ */
+static void
+patch_binary(const char *oldname, const char *newname, const char *ofname,
+    const char *listname, int baseaddr, bool bank)
+{
+    size_t oldlen, len, patchlen;
+    uint8_t *old = read_file(oldname, &oldlen);
+    uint8_t *img = read_file(newname, &len);
+
+    if (baseaddr < 0) {
+        int nsongs = bank ? bank_songs(img, len) : 1;
+        if (nsongs <= 0)
+            errx(EXIT_FAILURE, "曲インデックステーブルが不正です: %s", newname);
+        baseaddr = guess_baseaddr(img, len, MML_TABLE_LEN(nsongs), newname);
+    }
+    if (baseaddr + len > 0x10000)
+        errx(EXIT_FAILURE, "イメージがアドレス空間に収まりません: %s", newname);
+
+    uint8_t *patch = mml_make_patch(old, oldlen, img, len, baseaddr,
+      &patchlen);
+    if (patch == NULL)
+        errx(EXIT_FAILURE, "差分パッチを作成できませんでした");
+    int ofd = open_output(ofname);
+    struct iovec iov = { .iov_base = patch, .iov_len = patchlen };
+    writev_all(ofd, &iov, 1);
+    close_output(ofd, ofname);
+
+    if (listname != NULL) {
+        FILE *fp = open_format(listname);
+        close_format(fp, mml_write_patch_list(fp, old, oldlen, img, len,
+          baseaddr), listname);
+    }
+
+    size_t start, end, nranges = 0, nbytes = 0;
+    for (start = 0; mml_patch_range(old, oldlen, img, len, &start, &end);
+      start = end) {
+        nranges++;
+        nbytes += end - start;
+    }
+    FILE *fp = strcmp(ofname, "-") == 0 ? stderr : stdout;
+    fprintf(fp, "%s → %s: %zu 箇所 %zu バイト "
+      "(パッチ %zu バイト, 全体 %zu バイト)\n",
+      oldname, newname, nranges, nbytes, patchlen, len);
+    free(patch);
+    free(old);
+    free(img);
+}
+
+/* -m z80 の -D 指定 (ロード, 初期化, 割り込み処理, スタックのアドレス) */
+typedef struct {
+    int load;
+    int init;
+    int play;
+    int sp;
+} drvspec_t;
+
+/* "load,init,play[,sp]" 形式の -D 指定の解析 */
+static bool
+parse_drvspec(const char *arg, drvspec_t *spec)
+{
+    int *v[] = { &spec->load, &spec->init, &spec->play, &spec->sp };
+    const char *p = arg;
+    int n;
+
+    spec->sp = 0x0000;
+    for (n = 0; n < 4; n++) {
+        char *endptr;
+        long a = strtol(p, &endptr, 0);
+        if (endptr == p || a < 0 || a > 0xFFFF)
+            return false;
+        *v[n] = (int)a;
+        p = endptr;
+        if (*p != ',')
+            break;
+        p++;
+    }
+    return *p == '\0' && n >= 2 && n < 4;
+}
+
+/* 1 回の呼び出しの PSG レジスタ書き込みをトレースに出力 */
+static void
+put_z80_trace(FILE *fp, const MML_Z80Driver *d)
+{
+    for (size_t i = 0; i < d->nwrites; i++) {
+        fprintf(fp, "  %u %02X %02X\n", d->writes[i].cycle, d->writes[i].reg,
+          d->writes[i].value);
+    }
+}
+
+/*
+ * -m z80: 実機の音源ドライバによる演奏
+ *  ドライバを load に、曲を baseaddr に配置して HL = baseaddr で初期化ルーチンを
+ *  呼び出した後、割り込み処理を ticks 回呼び出して PSG レジスタへの書き込みと
+ *  処理サイクル数を記録する
+ */
+static void
+z80_binary(const char *drvname, const char *songname, const char *tracename,
+    int baseaddr, const drvspec_t *spec, long ticks)
+{
+    size_t drvlen, len;
+    uint8_t *drv = read_file(drvname, &drvlen);
+    uint8_t *img = read_file(songname, &len);
+    if (baseaddr < 0)
+        baseaddr = guess_baseaddr(img, len, MML_TABLE_LEN(1), songname);
+    if (spec->load < baseaddr + (int)len && baseaddr < spec->load + (int)drvlen)
+        errx(EXIT_FAILURE, "ドライバと曲データのアドレスが重なっています");
+
+    MML_Z80Driver *d = malloc(sizeof(*d));
+    if (d == NULL)
+        errx(EXIT_FAILURE, "Z80 の実行環境を確保できませんでした");
+    mml_z80_init(d, (uint16_t)spec->sp);
+    const char *e;
+    if ((e = mml_z80_load(d, drv, drvlen, spec->load)) != NULL)
+        errx(EXIT_FAILURE, "%s: %s", drvname, e);
+    if ((e = mml_z80_load(d, img, len, baseaddr)) != NULL)
+        errx(EXIT_FAILURE, "%s: %s", songname, e);
+
+    FILE *fp = NULL;
+    if (tracename != NULL) {
+        fp = (strcmp(tracename, "-") == 0) ? stdout : open_format(tracename);
+        fprintf(fp, "; %s: %s (%04X)\n", drvname, songname, baseaddr);
+        fprintf(fp, "; tick 番号 サイクル数\n");
+        fprintf(fp, ";   サイクル レジスタ 値\n");
+    }
+
+    uint32_t cycles, init_cycles, max_cycles = 0;
+    uint64_t total = 0;
+    size_t nwrites = 0;
+    long max_tick = 0, tick;
+    e = mml_z80_call(d, (uint16_t)spec->init, (uint16_t)baseaddr,
+      &init_cycles);
+    if (e != NULL)
+        errx(EXIT_FAILURE, "%s: 初期化ルーチン: %s", drvname, e);
+    if (fp != NULL) {
+        fprintf(fp, "init %u\n", init_cycles);
+        put_z80_trace(fp, d);
+    }
+    for (tick = 0; tick < ticks; tick++) {
+        e = mml_z80_call(d, (uint16_t)spec->play, (uint16_t)baseaddr,
+          &cycles);
+        if (e != NULL) {
+            errx(EXIT_FAILURE, "%s: 割り込み処理 (%ld 回目): %s", drvname,
+              tick, e);
+        }
+        if (fp != NULL) {
+            fprintf(fp, "tick %ld %u\n", tick, cycles);
+            put_z80_trace(fp, d);
+        }
+        if (cycles > max_cycles) {
+            max_cycles = cycles;
+            max_tick = tick;
+        }
+        total += cycles;
+        nwrites += d->nwrites;
+    }
+    if (fp != NULL && fp != stdout)
+        close_format(fp, !ferror(fp), tracename);
+
+    fp = (tracename != NULL && strcmp(tracename, "-") == 0) ? stderr : stdout;
+    fprintf(fp, "%s: 割り込み %ld 回, PSG 書き込み %zu 回, "
+      "最大 %u サイクル (%ld 回目), 平均 %.1f サイクル, 初期化 %u サイクル\n",
+      songname, ticks, nwrites, max_cycles, max_tick,
+      ticks > 0 ? (double)total / ticks : 0.0, init_cycles);
+    mml_z80_free(d);
+    free(d);
+    free(drv);
+    free(img);
+}
+
+/* 依存ファイル一覧に追加 (重複は追加しない); ファイル番号を返す */
+static int
+add_dep(mmlsrc_t *src, const char *path)
+{
+    for (size_t i = 0; i < src->ndeps; i++) {
+        if (strcmp(src->deps[i], path) == 0)
+            return (int)i;
+    }
+    char **nd = realloc(src->deps, (src->ndeps + 1) * sizeof(*nd));
+    if (nd == NULL || (nd[src->ndeps] = strdup(path)) == NULL)
+        errx(EXIT_FAILURE, "依存ファイル一覧を確保できませんでした");
+    src->deps = nd;
+    return (int)src->ndeps++;
+}
+
+/* make用依存関係ファイル出力 (パス中の空白はエスケープ) */
+static void
+put_dep_path(FILE *fp, const char *path)
+{
+    for (const char *p = path; *p != '\0'; p++) {
+        if (*p == ' ' || *p == '#')
+            fputc('\\', fp);
+        else if (*p == '$')
+            fputc('$', fp);
+        fputc(*p, fp);
+    }
+}
+
+/* 依存ファイルが複数の曲で重複している場合は最初の曲のみで出力 */
+static bool
+dep_seen(mmlsrc_t *songs, int s, const char *path)
+{
+    for (int t = 0; t < s; t++) {
+        for (size_t i = 0; i < songs[t].ndeps; i++) {
+            if (strcmp(songs[t].deps[i], path) == 0)
+                return true;
+        }
+    }
+    return false;
+}
+
+static void
+write_depfile(mmlsrc_t *songs, int nsongs, const char *depname,
+    const char *target)
+{
+    FILE *fp = fopen(depname, "w");
+    if (fp == NULL) {
+        errx(EXIT_FAILURE, "依存関係ファイルを開けませんでした: %s", depname);
+    }
+    put_dep_path(fp, target);
+    fputc(':', fp);
+    for (int s = 0; s < nsongs; s++) {
+        mmlsrc_t *src = &songs[s];
+        for (size_t i = 0; i < src->ndeps; i++) {
+            if (i == 0 && strcmp(src->deps[i], "-") == 0)
+                continue;           /* 標準入力 */
+            if (dep_seen(songs, s, src->deps[i]))
+                continue;
+            fputs(" \\\n  ", fp);
+            put_dep_path(fp, src->deps[i]);
+        }
+    }
+    fputc('\n', fp);
+    /* インクルードファイル削除時に make が止まらないようにダミーターゲット */
+    for (int s = 0; s < nsongs; s++) {
+        mmlsrc_t *src = &songs[s];
+        for (size_t i = 1; i < src->ndeps; i++) {
+            if (dep_seen(songs, s, src->deps[i]))
+                continue;
+            fputc('\n', fp);
+            put_dep_path(fp, src->deps[i]);
+            fputs(":\n", fp);
+        }
+    }
+    if (fclose(fp) != 0) {
+        errx(EXIT_FAILURE, "依存関係ファイルの書き込みに失敗しました: %s",
+          depname);
+    }
+}
+
+/* ソースマップ出力用: 可変長整数 (7bit単位, LSB first) */
+static void
+put_varint(FILE *fp, uint32_t v)
+{
+    while (v >= 0x80) {
+        fputc((int)(v & 0x7F) | 0x80, fp);
+        v >>= 7;
+    }
+    fputc((int)v, fp);
+}
+
+/* ソースマップ出力用: 符号付き差分 (zigzag 変換して可変長整数) */
+static void
+put_svarint(FILE *fp, int32_t v)
+{
+    put_varint(fp, ((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+}
+
+/*
+ * ソースマップ出力
+ *  各チャンネルのオペコード位置毎の MML ソース位置を差分符号化して出力する
+ *  (フォーマットは README 参照)
+ */
+static void
+write_srcmap(mmlsrc_t *src, const char *mapname, int baseaddr)
+{
+    FILE *fp = fopen(mapname, "wb");
+    if (fp == NULL) {
+        errx(EXIT_FAILURE, "ソースマップファイルを開けませんでした: %s", mapname);
+    }
+    fputs("P6SM", fp);
+    fputc(1, fp);                   /* バージョン */
+    put_varint(fp, (uint32_t)baseaddr);
+    put_varint(fp, (uint32_t)src->ndeps);
+    for (size_t i = 0; i < src->ndeps; i++) {
+        size_t len = strlen(src->deps[i]);
+        put_varint(fp, (uint32_t)len);
+        fwrite(src->deps[i], 1, len, fp);
+    }
+    for (int i = 0; i < PSG_NCH; i++) {
+        psgch_t *psgchp = &src->psgch[i];
+        MML_Compiler *c = &psgchp->mmlcp;
+        uint32_t offset = psgchp->offset;
+        int file = 0, line = 0, col = 0;
+
+        put_varint(fp, offset);
+        put_varint(fp, (uint32_t)c->nsrcmap);
+        for (size_t j = 0; j < c->nsrcmap; j++) {
+            MML_SrcPos *sp = &c->srcmap[j];
+            uint32_t delta = psgchp->offset + sp->offset - offset;
+            /* bit0: ファイル番号変更あり */
+            put_varint(fp, (delta << 1) | (sp->file != file));
+            if (sp->file != file)
+                put_varint(fp, (uint32_t)sp->file);
+            put_svarint(fp, sp->line - line);
+            put_svarint(fp, sp->col - col);
+            offset += delta;
+            file = sp->file;
+            line = sp->line;
+            col  = sp->col;
+        }
+    }
+    if (fclose(fp) != 0) {
+        errx(EXIT_FAILURE, "ソースマップファイルの書き込みに失敗しました: %s",
+          mapname);
+    }
+}
+
+/*
+ * インクルード指定行の解析
+ *  `#include "ファイル名"` (引用符は省略可) ならファイル名を返す
+ *  ファイル名は指定元ファイルのディレクトリからの相対パスとして解決する
+ */
+static char *
+parse_include(const char *p, const char *curfname)
+{
+    static const char directive[] = "#include";
+    char name[PATH_MAX];
+    size_t n = 0;
+
+    if (strncmp(p, directive, sizeof(directive) - 1) != 0)
+        return NULL;
+    p += sizeof(directive) - 1;
+    if (*p != ' ' && *p != '\t')
+        return NULL;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    char term = (*p == '"') ? *p++ : '\0';
+    while (*p != '\0' && *p != '\n' && *p != '\r' && n < sizeof(name) - 1) {
+        if (term != '\0' ? *p == term : (*p == ' ' || *p == '\t'))
+            break;
+        name[n++] = *p++;
+    }
+    name[n] = '\0';
+    if (n == 0)
+        return NULL;
+
+    char *path;
+    if (name[0] == '/' || strchr(curfname, '/') == NULL) {
+        path = strdup(name);
+    } else {
+        char *tmp = strdup(curfname);
+        if (tmp == NULL)
+            return NULL;
+        size_t len = strlen(dirname(tmp)) + 1 + n + 1;
+        path = malloc(len);
+        if (path != NULL) {
+            /* dirname() が引数を書き換える実装もあるので再度求める */
+            strcpy(tmp, curfname);
+            snprintf(path, len, "%s/%s", dirname(tmp), name);
+        }
+        free(tmp);
+    }
+    if (path == NULL)
+        errx(EXIT_FAILURE, "インクルードファイル名を確保できませんでした");
+    return path;
+}
+
+/*
+ * 全チャンネル共通マクロ定義行の解析
+ *  `#define 名前 本体` (本体は行末またはコメント ';' の手前まで)
+ *  定義行でなければ 0, 定義したら 1, 書式エラーなら -1 を返す
+ */
+static int
+parse_define(mmlsrc_t *src, const char *p)
+{
+    static const char directive[] = "#define";
+
+    if (strncmp(p, directive, sizeof(directive) - 1) != 0)
+        return 0;
+    p += sizeof(directive) - 1;
+    if (*p != ' ' && *p != '\t')
+        return 0;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    const char *name = p;
+    if (!isalpha((unsigned char)*p) && *p != '_')
+        return -1;
+    while (isalnum((unsigned char)*p) || *p == '_')
+        p++;
+    size_t namelen = p - name;
+    if (*p != ' ' && *p != '\t')
+        return -1;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    const char *body = p;
+    while (*p != '\0' && *p != ';' && *p != '\n')
+        p++;
+    while (p > body && isspace((unsigned char)p[-1]))
+        p--;
+    if (!mml_macro_define(&src->macros, name, namelen, body, p - body))
+        errx(EXIT_FAILURE, "マクロ定義用のメモリが確保できませんでした");
+    return 1;
+}
+
+static void compile_file(mmlsrc_t *src, const char *fname);
+
+/* 断片キャッシュ検索 */
+static fragment_t *
+find_fragment(mmlsrc_t *src, const char *path)
+{
+    MML_ChannelState st[PSG_NCH];
+
+    for (int i = 0; i < PSG_NCH; i++)
+        mml_save_state(&src->psgch[i].mmlcp, &st[i]);
+    for (fragment_t *f = src->fragments; f != NULL; f = f->next) {
+        if (strcmp(f->path, path) == 0 && f->x_entry == src->x_disabled &&
+            memcmp(f->entry, st, sizeof(st)) == 0)
+            return f;
+    }
+    return NULL;
+}
+
+/*
+ * インクルード断片のコンパイル
+ *  同じ断片・同じ開始状態でコンパイル済みならキャッシュを再利用し、
+ *  そうでなければコンパイルして再利用可能ならキャッシュに登録する
+ */
+static void
+compile_fragment(mmlsrc_t *src, const char *path)
+{
+    fragment_t *f = find_fragment(src, path);
+
+    if (f != NULL) {
+        DPRINTF("fragment %s: reuse cached object\n", path);
+        for (int i = 0; i < PSG_NCH; i++) {
+            psgch_t *psgchp = &src->psgch[i];
+            MML_Compiler *c = &psgchp->mmlcp;
+            if (mml_append_object(c, f->obj[i], f->obj_len[i],
+                f->map[i], f->nmap[i]) != MML_OK) {
+                print_mmlc_error(c, c->ndiags - 1, path, f->last_line[i]);
+                src->abort = true;
+            }
+            mml_restore_state(c, &f->exit[i]);
+            if (f->has_line[i])
+                memcpy(psgchp->last_line, f->last_line[i], LINE_BUF_SIZE);
+        }
+        src->x_disabled = f->x_exit;
+        return;
+    }
+
+    /* キャッシュ登録用に開始時の状態と出力位置を保存 */
+    f = calloc(1, sizeof(*f));
+    if (f == NULL || (f->path = strdup(path)) == NULL)
+        errx(EXIT_FAILURE, "インクルード断片情報を確保できませんでした");
+    size_t start[PSG_NCH], ndiags[PSG_NCH], mstart[PSG_NCH], spilled[PSG_NCH];
+    size_t jump[PSG_NCH];
+    char (*saved_line)[LINE_BUF_SIZE] = f->last_line;
+    for (int i = 0; i < PSG_NCH; i++) {
+        psgch_t *psgchp = &src->psgch[i];
+        MML_Compiler *c = &psgchp->mmlcp;
+        mml_save_state(c, &f->entry[i]);
+        start[i] = c->out_len;
+        spilled[i] = c->out_spilled;
+        mstart[i] = c->nsrcmap;
+        ndiags[i] = c->ndiags;
+        jump[i] = c->jump_pos;
+        /* 断片内で当該チャンネルの行があったか判定するため一旦退避 */
+        memcpy(saved_line[i], psgchp->last_line, LINE_BUF_SIZE);
+        psgchp->last_line[0] = '\0';
+    }
+    f->x_entry = src->x_disabled;
+
+    src->depth++;
+    compile_file(src, path);
+    src->depth--;
+
+    for (int i = 0; i < PSG_NCH; i++) {
+        psgch_t *psgchp = &src->psgch[i];
+        f->has_line[i] = psgchp->last_line[0] != '\0';
+        if (!f->has_line[i])
+            memcpy(psgchp->last_line, saved_line[i], LINE_BUF_SIZE);
+    }
+
+    /* エラーや断片外のループ操作がなければキャッシュに登録 */
+    bool reusable = true;
+    for (int i = 0; i < PSG_NCH; i++) {
+        MML_Compiler *c = &src->psgch[i].mmlcp;
+        if (c->ndiags != ndiags[i] || !mml_state_reusable(c, &f->entry[i]))
+            reusable = false;
+        /* 断片の出力が一時ファイルに書き出された場合は切り出せない */
+        if (c->out_spilled != spilled[i])
+            reusable = false;
+        /* 'J' の位置と行は出力の再利用では復元できない */
+        if (c->jump_pos != jump[i])
+            reusable = false;
+    }
+    if (!reusable) {
+        DPRINTF("fragment %s: not reusable\n", path);
+        free(f->path);
+        free(f);
+        return;
+    }
+    for (int i = 0; i < PSG_NCH; i++) {
+        psgch_t *psgchp = &src->psgch[i];
+        MML_Compiler *c = &psgchp->mmlcp;
+        mml_save_state(c, &f->exit[i]);
+        f->obj_len[i] = c->out_len - start[i];
+        /*
+         * 断片の出力範囲のソースマップを切り出す
+         *  (断片直前の何も出力しない文の記録は断片先頭の記録で上書きされ、
+         *   断片末尾の記録は次の文の位置なので含めない)
+         */
+        size_t m = mstart[i];
+        if (m > 0 && c->srcmap[m - 1].offset >= spilled[i] + start[i])
+            m--;
+        size_t mend = c->nsrcmap;
+        while (mend > m &&
+          c->srcmap[mend - 1].offset >= c->out_spilled + c->out_len)
+            mend--;
+        f->nmap[i] = mend - m;
+        f->map[i] = malloc((f->nmap[i] + 1) * sizeof(MML_SrcPos));
+        if (f->map[i] == NULL)
+            errx(EXIT_FAILURE, "インクルード断片情報を確保できませんでした");
+        for (size_t j = 0; j < f->nmap[i]; j++) {
+            f->map[i][j] = c->srcmap[m + j];
+            f->map[i][j].offset -= spilled[i] + start[i];
+        }
+        f->obj[i] = malloc(f->obj_len[i] + 1);
+        if (f->obj[i] == NULL)
+            errx(EXIT_FAILURE, "インクルード断片情報を確保できませんでした");
+        memcpy(f->obj[i], c->out + start[i], f->obj_len[i]);
+        memcpy(f->last_line[i], psgchp->last_line, LINE_BUF_SIZE);
+    }
+    f->x_exit = src->x_disabled;
+    f->next = src->fragments;
+    src->fragments = f;
+}
+
+/* MMLファイル単位のコンパイル処理 (インクルードファイルからも再帰的に呼ばれる) */
+static void
+compile_file(mmlsrc_t *src, const char *fname)
+{
+    FILE *ifp;
+    int ch;
+
+    if (src->depth > INCLUDE_MAX_DEPTH) {
+        errx(EXIT_FAILURE, "インクルードのネストが深すぎます: %s", fname);
+    }
+    if (src->depth == 0 && strcmp(fname, "-") == 0)
+        ifp = stdin;
+    else
+        ifp = fopen(fname, "r");
+    if (ifp == NULL) {
+        if (src->depth == 0)
+            errx(EXIT_FAILURE, "入力MMLファイルを開けませんでした: %s", fname);
+        errx(EXIT_FAILURE, "インクルードファイルを開けませんでした: %s", fname);
+    }
+    int fileno = add_dep(src, fname);
+
+    psgch_t *psgch = src->psgch;
+    const char *errfname = (src->depth > 0) ? fname : NULL;
+    char line[LINE_BUF_SIZE];
+    int lineno = 0;
+    MML_Error error;
+
+    /* 行単位コンパイル処理 */
+    while (fgets(line, sizeof(line), ifp) != NULL) {
+        lineno++;
+        char *p = line;
+
+        /* 行頭の空白とタブをスキップ */
+        while (*p == ' ' || *p == '\t')
+            p++;
+        /* 行頭の `#define 名前 本体` は全チャンネル共通マクロ定義 */
+        int def = src->x_disabled ? 0 : parse_define(src, p);
+        if (def < 0) {
+            if (errfname != NULL)
+                fprintf(stderr, "エラー: %s: ", errfname);
+            else
+                fprintf(stderr, "エラー: ");
+            fprintf(stderr, "マクロ定義の書式が不正です (%d 行目)\n%s",
+              lineno, line);
+            src->abort = true;
+            src->nerrors++;
+        }
+        if (def != 0)
+            continue;
+        /* 行頭の `#include "ファイル名"` はインクルード */
+        char *incpath = parse_include(p, fname);
+        if (incpath != NULL) {
+            if (!src->x_disabled)
+                compile_fragment(src, incpath);
+            free(incpath);
+            continue;
+        }
+        /* 先頭が数字なら `[行番号] "` のオリジナルコンパイラ書式も読み飛ばす */
+        if (isdigit((int)(unsigned char)*p)) {
+            /* 行番号相当の数字を読み飛ばす (わざわざ値はチェックしない) */
+            while (isdigit((int)(unsigned char)*p))
+                p++;
+            /* 行番号後に空白をスキップ */
+            while (*p == ' ')
+                p++;
+            /* 二重引用符 `"` をスキップ */
+            if (*p == '"')
+                p++;
+        }
+        ch = toupper((int)(unsigned char)*p);
+        for (int i = 0; i < PSG_NCH; i++) {
+            if (!src->x_disabled && ch == 'D' + i) {
+                psgch_t *psgchp = &psgch[i];
+                MML_Compiler *c = &psgchp->mmlcp;
+                size_t ndiags = c->ndiags;
+                size_t jump_pos = c->jump_pos;
+                c->file = fileno;
+                c->col_base = (int)(p + 1 - line);
+                error = mml_compile_line(c, p + 1, lineno);
+                if (error != MML_OK) {
+                    print_mmlc_error(c, ndiags, errfname, line);
+                    src->abort = true;
+                }
+                /* クローズ後のエラーメッセージ用に最終行を保存 */
+                strncpy(psgchp->last_line, line, sizeof(psgchp->last_line));
+                psgchp->last_line[sizeof(psgchp->last_line) - 1] = '\0';
+                if (c->jump_pos != jump_pos)
+                    memcpy(psgchp->jump_line, psgchp->last_line,
+                      sizeof(psgchp->jump_line));
+            }
+        }
+        if (ch == 'X') {
+            /* 行頭の'X'チャンネル指定はコンパイル停止/再開 */
+            src->x_disabled = !src->x_disabled;
+        } else {
+            DPRINTF("ignored line %d\n", lineno);
+        }
+    }
+    if (ifp != stdin)
+        fclose(ifp);
+}
+
+/*
+ * 曲 (MMLファイル) 単位のコンパイル
+ *  エラーがあれば表示して false を返す (エラー件数は src->nerrors に加算)
+ */
+static bool
+compile_song(mmlsrc_t *src, const char *ifname, bool srcmap, bool optimize)
+{
+    /*
+     * 標準入力からのストリーミング時はメモリ使用量を抑えるため
+     * E, F チャンネルは閾値を超えた分を一時ファイルに書き出す
+     * (ヘッダに全チャンネルの長さが必要なので D チャンネルはメモリ上に保持)
+     */
+    bool streaming = (strcmp(ifname, "-") == 0);
+
+    src->fname = ifname;
+    for (int i = 0; i < PSG_NCH; i++) {
+        psgch_t *psgchp = &src->psgch[i];
+        MML_Compiler *c = &psgchp->mmlcp;
+        bool spill = streaming && i > 0;
+        size_t bufsize = spill ? SPILL_THRESHOLD : CH_BUF_SIZE;
+        uint8_t *buf = malloc(bufsize);
+        if (buf == NULL)
+            errx(EXIT_FAILURE, "コンパイル出力バッファが確保できませんでした");
+        mml_channel_init(c, buf, bufsize);
+        if (spill && (c->spill_fp = tmpfile()) == NULL)
+            err(EXIT_FAILURE, "一時ファイルを作成できませんでした");
+        c->global_macros = &src->macros;
+        c->srcmap_enable = srcmap;
+        c->optimize = optimize;
+        psgchp->last_line[0] = '\0';
+        psgchp->jump_line[0] = '\0';
+    }
+
+    compile_file(src, ifname);
+    bool abort = src->abort;
+    MML_Error error;
+
+    /* 全行コンパイル後にチャンネルクローズしてエラーチェック */
+    for (int i = 0; i < PSG_NCH; i++) {
+        psgch_t *psgchp = &src->psgch[i];
+        MML_Compiler *c = &psgchp->mmlcp;
+        size_t ndiags = c->ndiags;
+        error = mml_finish_channel(c);
+        if (error != MML_OK) {
+            print_mmlc_error(c, ndiags, NULL,
+              (error == MML_ERR_ZERO_CYCLE) ?
+              psgchp->jump_line : psgchp->last_line);
+            abort = true;
+        }
+        DPRINTF("psgch[%d].out_len = %d\n", i, c->out_len);
+    }
+    if (abort) {
+        for (int i = 0; i < PSG_NCH; i++)
+            src->nerrors += src->psgch[i].mmlcp.ndiags;
+    }
+    return !abort;
+}
+
+static void
+free_song(mmlsrc_t *src)
+{
+    for (int i = 0; i < PSG_NCH; i++) {
+        MML_Compiler *c = &src->psgch[i].mmlcp;
+        if (c->spill_fp != NULL)
+            fclose(c->spill_fp);
+        mml_channel_free(c);
+        free(c->out);       /* 一時ファイル書き出し時は拡張されている場合あり */
+    }
+
+    while (src->fragments != NULL) {
+        fragment_t *f = src->fragments;
+        src->fragments = f->next;
+        for (int i = 0; i < PSG_NCH; i++) {
+            free(f->obj[i]);
+            free(f->map[i]);
+        }
+        free(f->path);
+        free(f);
+    }
+    for (size_t i = 0; i < src->ndeps; i++)
+        free(src->deps[i]);
+    free(src->deps);
+    mml_macro_free(&src->macros);
+}
+
+/* ドライバモデルで演奏した PSG レジスタ書き込みトレースの出力 (-T) */
+static void
+write_trace(mmlsrc_t *src, const char *tracename, int baseaddr, size_t layout,
+    unsigned long maxticks)
+{
+    uint8_t *img = load_image(src, 1, baseaddr, layout);
+    size_t start[PSG_NCH];
+    unsigned long nticks;
+
+    for (int i = 0; i < PSG_NCH; i++)
+        start[i] = src->psgch[i].offset;
+    FILE *fp = fopen(tracename, "wb");
+    if (fp == NULL)
+        errx(EXIT_FAILURE, "トレースファイルを開けませんでした: %s", tracename);
+    const char *e = mml_trace_write(fp, img, layout, start, maxticks, &nticks);
+    if (e != NULL)
+        errx(EXIT_FAILURE, "%s: トレース出力: %s", src->fname, e);
+    if (fclose(fp) != 0) {
+        errx(EXIT_FAILURE, "トレースファイルの書き込みに失敗しました: %s",
+          tracename);
+    }
+    free(img);
+}
+
+/* ドライバモデルで演奏した PSG レジスタ書き込みの VGM ファイル出力 (-V) */
+static void
+write_vgm(mmlsrc_t *src, const char *vgmname, int baseaddr, size_t layout,
+    unsigned long maxticks)
+{
+    uint8_t *img = load_image(src, 1, baseaddr, layout);
+    size_t start[PSG_NCH];
+    MML_VgmInfo info;
+
+    for (int i = 0; i < PSG_NCH; i++)
+        start[i] = src->psgch[i].offset;
+    FILE *fp = fopen(vgmname, "wb");
+    if (fp == NULL)
+        errx(EXIT_FAILURE, "VGM ファイルを開けませんでした: %s", vgmname);
+    const char *e = mml_vgm_write(fp, img, layout, start, maxticks, &info);
+    if (e != NULL)
+        errx(EXIT_FAILURE, "%s: VGM 出力: %s", src->fname, e);
+    if (ferror(fp) || fclose(fp) != 0) {
+        errx(EXIT_FAILURE, "VGM ファイルの書き込みに失敗しました: %s",
+          vgmname);
+    }
+    if (info.limited) {
+        warnx("%s: 割り込み %lu 回までに繰り返しが見つからないため"
+          "打ち切りました", src->fname, maxticks);
+    }
+    free(img);
+}
+
+/*
+ * -m trace: トレースファイルをテキストで表示
+ *  start の割り込みの直前のチェックポイントから読み込み、
+ *  start 時点の全レジスタの値とそれ以降の書き込みを表示する
+ */
+static void
+dump_trace(const char *tracename, const char *outname, unsigned long start)
+{
+    FILE *ifp = fopen(tracename, "rb");
+    if (ifp == NULL)
+        errx(EXIT_FAILURE, "トレースファイルを開けませんでした: %s", tracename);
+    MML_Trace t;
+    const char *e;
+    if ((e = mml_trace_open(&t, ifp)) != NULL ||
+      (e = mml_trace_seek(&t, start, NULL)) != NULL)
+        errx(EXIT_FAILURE, "%s: %s", tracename, e);
+
+    FILE *fp = (outname == NULL || strcmp(outname, "-") == 0) ? stdout :
+      open_format(outname);
+    fprintf(fp, "; %s: %u Hz, PSG %lu Hz, 割り込み %lu 回\n", tracename,
+      t.hz, t.clock, t.nticks);
+    fprintf(fp, "; tick 番号\n");
+    fprintf(fp, ";   サブ tick レジスタ 値\n");
+
+    uint8_t prev[PSG_NREGS], reg, value;
+    unsigned long last = 0;
+    bool head = false;
+    int r;
+    for (;;) {
+        memcpy(prev, t.reg, sizeof(prev));
+        if ((r = mml_trace_next(&t, &reg, &value)) <= 0)
+            break;
+        if (t.tick < start)
+            continue;
+        if (!head && start > 0) {
+            fprintf(fp, "state %lu", start);
+            for (int k = 0; k < PSG_NREGS; k++)
+                fprintf(fp, " %02X", prev[k]);
+            fputc('\n', fp);
+        }
+        if (!head || t.tick != last)
+            fprintf(fp, "tick %lu\n", t.tick);
+        fprintf(fp, "  %d %02X %02X\n", t.sub, reg, value);
+        head = true;
+        last = t.tick;
+    }
+    if (r < 0)
+        errx(EXIT_FAILURE, "%s: トレースファイルのデータが不正です", tracename);
+    if (fp != stdout)
+        close_format(fp, !ferror(fp), outname);
+    mml_trace_close(&t);
+    fclose(ifp);
+}
+
+/* -m diff: ドライバモデルで演奏するイメージ */
+typedef struct {
+    uint8_t *img;
+    size_t   len;
+    size_t   start[PSG_NCH];
+} playimg_t;
+
+/* コンパイル結果を配置してイメージを作る */
+static void
+load_playimg(playimg_t *pi, mmlsrc_t *src, bool share)
+{
+    pi->len = layout_songs(src, 1, 0, share);
+    pi->img = load_image(src, 1, 0, pi->len);
+    for (int i = 0; i < PSG_NCH; i++)
+        pi->start[i] = src->psgch[i].offset;
+}
+
+/* ソースマップからチャンネル先頭からのオフセットに対応する位置を探す */
+static const MML_SrcPos *
+find_srcpos(const MML_Compiler *c, size_t offset)
+{
+    size_t lo = 0, hi = c->nsrcmap;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (c->srcmap[mid].offset <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo > 0) ? &c->srcmap[lo - 1] : NULL;
+}
+
+/* 基準側の演奏中の音符/休符のソース位置を表示 */
+static void
+put_diff_srcpos(mmlsrc_t *src, const MML_Player *p, int i)
+{
+    static const char ch_name[PSG_NCH] = { 'D', 'E', 'F' };
+    const MML_PlayerChannel *ch = &p->ch[i];
+    const MML_SrcPos *sp = NULL;
+
+    if (ch->note != MML_NOPOS) {
+        sp = find_srcpos(&src->psgch[i].mmlcp,
+          ch->note - src->psgch[i].offset);
+    }
+    if (sp == NULL) {
+        printf("  チャンネル%c: 演奏開始前\n", ch_name[i]);
+        return;
+    }
+    printf("  チャンネル%c: %s %d 行目, %d 桁目\n", ch_name[i],
+      src->deps[sp->file], sp->line, sp->col);
+}
+
+/*
+ * 2 つのイメージをドライバモデルで演奏して割り込み毎の PSG レジスタを比較
+ *  最初に相違のあった割り込みと、基準側で演奏中の音符のソース位置を表示する
+ */
+static bool
+diff_play(mmlsrc_t *src, const char *what, const playimg_t *ref,
+    const playimg_t *opt, unsigned long maxticks)
+{
+    static const char ch_name[PSG_NCH] = { 'D', 'E', 'F' };
+    MML_Player a, b;
+
+    mml_player_init(&a, ref->img, ref->len, ref->start);
+    mml_player_init(&b, opt->img, opt->len, opt->start);
+    while (!(mml_player_done(&a) && mml_player_done(&b))) {
+        if (a.tick >= maxticks) {
+            printf("%s: %s: 一致 (%lu 割り込みで打ち切り)\n", src->fname,
+              what, a.tick);
+            return true;
+        }
+        bool oka = mml_player_tick(&a);
+        bool okb = mml_player_tick(&b);
+        if (!oka || !okb) {
+            const MML_Player *p = oka ? &b : &a;
+            printf("%s: %s: %sのチャンネル%c: %s (割り込み %lu)\n",
+              src->fname, what, oka ? "最適化後" : "最適化なし",
+              ch_name[p->error_ch], p->error, p->tick);
+            return false;
+        }
+        for (int r = 0; r < PSG_NREGS; r++) {
+            if (a.reg[r] == b.reg[r])
+                continue;
+            printf("%s: %s: 割り込み %lu でレジスタ R%d が相違 "
+              "(最適化なし %02X, 最適化後 %02X)\n", src->fname, what,
+              a.tick - 1, r, a.reg[r], b.reg[r]);
+            int i = mml_player_reg_channel(r, a.reg[r] ^ b.reg[r]);
+            if (i >= 0) {
+                put_diff_srcpos(src, &a, i);
+            } else {
+                for (i = 0; i < PSG_NCH; i++)
+                    put_diff_srcpos(src, &a, i);
+            }
+            return false;
+        }
+    }
+    printf("%s: %s: 一致 (%lu 割り込み)\n", src->fname, what, a.tick);
+    return true;
+}
+
+/*
+ * 1 曲分の差分演奏テスト
+ *  最適化なしのコンパイル結果を基準にして、-O のコンパイル結果と
+ *  基準をバイナリ最適化 (-m optimize) した結果をそれぞれ比較する
+ */
+static bool
+diff_song(const char *fname, unsigned long maxticks)
+{
+    mmlsrc_t *songs = calloc(2, sizeof(*songs));
+    if (songs == NULL)
+        errx(EXIT_FAILURE, "コンパイル状態を確保できませんでした");
+    bool ok = compile_song(&songs[0], fname, true, false) &&
+      compile_song(&songs[1], fname, false, true);
+    if (!ok) {
+        fprintf(stderr, "%s: コンパイルエラーのため比較できません\n", fname);
+    } else {
+        playimg_t ref, opt, bin;
+        MML_OptResult res;
+        size_t end[PSG_NCH];
+
+        load_playimg(&ref, &songs[0], false);
+        load_playimg(&opt, &songs[1], true);
+        ok = diff_play(&songs[0], "-O", &ref, &opt, maxticks);
+
+        bin.img = mml_optimize_image(ref.img, ref.len, 0, &bin.len, &res);
+        if (bin.img == NULL) {
+            printf("%s: -m optimize: %s\n", fname, res.error);
+            ok = false;
+        } else {
+            (void)mml_image_channels(bin.img, bin.len, 0, 1, 0, bin.start,
+              end);
+            if (!diff_play(&songs[0], "-m optimize", &ref, &bin, maxticks))
+                ok = false;
+        }
+        free(ref.img);
+        free(opt.img);
+        free(bin.img);
+    }
+    for (int s = 0; s < 2; s++)
+        free_song(&songs[s]);
+    free(songs);
+    return ok;
+}
+
+/*
+ * 開始位置の指定 (-s) の解析
+ *  "分:秒[.小数]" は時刻、"L行番号" は MML ソースの行、それ以外は割り込み番号
+ *  行指定の場合は line に行番号、それ以外は tick に割り込み番号を返す
+ */
+static bool
+parse_start(const char *arg, unsigned long *tick, long *line)
+{
+    char *endptr;
+
+    *tick = 0;
+    *line = -1;
+    if (arg[0] == 'L' || arg[0] == 'l') {
+        *line = strtol(arg + 1, &endptr, 10);
+        return endptr != arg + 1 && *endptr == '\0' && *line > 0;
+    }
+    if (strchr(arg, ':') != NULL) {
+        long min = strtol(arg, &endptr, 10);
+        if (endptr == arg || *endptr != ':' || min < 0 ||
+          !isdigit((unsigned char)endptr[1]))
+            return false;
+        double sec = strtod(endptr + 1, &endptr);
+        if (*endptr != '\0' || sec < 0 || sec >= 60)
+            return false;
+        *tick = (unsigned long)((min * 60 + sec) * MML_PLAYER_HZ);
+        return true;
+    }
+    long v = strtol(arg, &endptr, 0);
+    if (*endptr != '\0' || endptr == arg || v < 0)
+        return false;
+    *tick = (unsigned long)v;
+    return true;
+}
+
+/* 割り込み番号を "分:秒" で表示 */
+static const char *
+tick_time(unsigned long tick, char *buf, size_t len)
+{
+    unsigned long sec = tick / MML_PLAYER_HZ;
+    snprintf(buf, len, "%lu:%02lu.%02lu", sec / 60, sec % 60,
+      tick % MML_PLAYER_HZ * 100 / MML_PLAYER_HZ);
+    return buf;
+}
+
+static double
+elapsed_ms(const struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1000.0 +
+      (t1.tv_nsec - t0->tv_nsec) / 1000000.0;
+}
+
+/*
+ * 行 line の音符/休符のイメージ上の位置に印を付ける
+ *  (指定 MML ファイル自体の行のみで、インクルードファイルの行は対象外)
+ */
+static uint8_t *
+mark_line(mmlsrc_t *src, const playimg_t *pi, long line)
+{
+    uint8_t *mark = calloc(pi->len, 1);
+    if (mark == NULL)
+        errx(EXIT_FAILURE, "作業領域を確保できませんでした");
+    for (int i = 0; i < PSG_NCH; i++) {
+        const MML_Compiler *c = &src->psgch[i].mmlcp;
+        for (size_t j = 0; j < c->nsrcmap; j++) {
+            const MML_SrcPos *sp = &c->srcmap[j];
+            size_t pos = pi->start[i] + sp->offset;
+            if (sp->file == 0 && sp->line == line && pos < pi->len &&
+              pi->img[pos] < OP_OCTAVE)
+                mark[pos] = 1;
+        }
+    }
+    return mark;
+}
+
+/* -m render -j: ミキサーのスレッドで合成したサンプルを書き込む */
+struct render_out {
+    FILE *fp;
+    bool  ok;
+};
+
+static bool
+render_output(void *arg, const int16_t *buf, size_t n)
+{
+    struct render_out *out = arg;
+
+    out->ok = mml_write_pcm(out->fp, buf, n);
+    return out->ok;
+}
+
+/*
+ * -m render: ドライバモデルで演奏した WAV ファイルの出力
+ *  開始位置 (-s) が指定された場合は、保存したドライバモデルの状態から
+ *  音声を出力せずに開始位置まで進めてからレンダリングを始める
+ */
+static void
+render_song(const char *ifname, const char *ofname, bool optimize,
+    unsigned rate, int synth, long cache, bool threads, const char *startarg,
+    long ticks)
+{
+    mmlsrc_t *src = calloc(1, sizeof(*src));
+    playimg_t pi;
+    MML_Snapshots snaps;
+    MML_Renderer r;
+    unsigned long start = 0, found;
+    long line = -1;
+    const char *e;
+    struct timespec t0;
+    char tbuf[2][32];
+
+    if (src == NULL)
+        errx(EXIT_FAILURE, "コンパイル状態を確保できませんでした");
+    if (startarg != NULL && !parse_start(startarg, &start, &line))
+        usage();
+    if (!compile_song(src, ifname, true, optimize)) {
+        errx(EXIT_FAILURE, "コンパイルエラー %zu 件のため出力せず終了します",
+          src->nerrors);
+    }
+    load_playimg(&pi, src, optimize);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint8_t *mark = (line > 0) ? mark_line(src, &pi, line) : NULL;
+    e = mml_snapshots_build(&snaps, pi.img, pi.len, pi.start,
+      MODEL_DEFAULT_TICKS, mark, &found);
+    if (e != NULL)
+        errx(EXIT_FAILURE, "%s: %s", ifname, e);
+    if (line > 0) {
+        if (found == MML_NOTICK)
+            errx(EXIT_FAILURE, "%s: %ld 行目の音符/休符は演奏されません",
+              ifname, line);
+        start = found;
+    }
+    if (start > snaps.nticks)
+        errx(EXIT_FAILURE, "%s: 開始位置が演奏の終了後です", ifname);
+    unsigned long end = (ticks >= 0 && start + ticks < snaps.nticks) ?
+      start + ticks : snaps.nticks;
+
+    mml_render_init(&r, pi.img, pi.len, pi.start, rate, synth);
+    if ((e = mml_render_seek(&r, &snaps, start)) != NULL)
+        errx(EXIT_FAILURE, "%s: %s", ifname, e);
+    double seek_ms = elapsed_ms(&t0);
+    if (cache > 0 && !mml_render_memo(&r, (size_t)cache * 1024))
+        errx(EXIT_FAILURE, "PCM キャッシュを確保できませんでした");
+
+    FILE *fp = (strcmp(ofname, "-") == 0) ? stdout : open_format(ofname);
+    unsigned long nsamples = mml_render_sample(end, rate) -
+      mml_render_sample(start, rate);
+    int16_t *buf = malloc(MML_RENDER_MAX_SAMPLES(rate) * sizeof(*buf));
+    if (buf == NULL)
+        errx(EXIT_FAILURE, "レンダリング用バッファを確保できませんでした");
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    bool ok = mml_write_wav_header(fp, rate, (uint32_t)nsamples);
+    if (threads) {
+        struct render_out out = { fp, ok };
+        if (ok && (e = mml_render_threads(&r, end - start, render_output,
+          &out)) != NULL)
+            errx(EXIT_FAILURE, "%s: %s", ifname, e);
+        ok = out.ok;
+    }
+    for (unsigned long t = start; !threads && ok && t < end; t++) {
+        size_t n = mml_render_tick(&r, buf);
+        if (n == 0 && r.player.error != NULL)
+            errx(EXIT_FAILURE, "%s: %s", ifname, r.player.error);
+        ok = mml_write_pcm(fp, buf, n);
+    }
+    double render_ms = elapsed_ms(&t0);
+    if (fp != stdout)
+        close_format(fp, ok, ofname);
+    else if (!ok || fflush(fp) != 0)
+        errx(EXIT_FAILURE, "出力ファイルの書き込みに失敗しました");
+
+    fp = (fp == stdout) ? stderr : stdout;
+    fprintf(fp, "%s: 割り込み %lu〜%lu (%s〜%s), %lu サンプル (%u Hz), "
+      "シーク %.2f ms, レンダリング %.2f ms (%s%s)\n", ifname, start, end,
+      tick_time(start, tbuf[0], sizeof(tbuf[0])),
+      tick_time(end, tbuf[1], sizeof(tbuf[1])), nsamples, rate, seek_ms,
+      render_ms, synth == MML_PSG_BLEP ? "blep" : "oversample",
+      threads ? ", チャンネル毎のスレッド" : "");
+    if (r.memo != NULL) {
+        fprintf(fp, "  PCM キャッシュ: %lu 区間, %lu 割り込み分をコピー\n",
+          r.memo->hits, r.memo->copied);
+    }
+
+    free(buf);
+    free(mark);
+    mml_render_free(&r);
+    mml_snapshots_free(&snaps);
+    free(pi.img);
+    free_song(src);
+    free(src);
+}
+
+/* -m play: 一定サンプル数毎に標準出力へ書き出す */
+struct play_out {
+    FILE    *fp;
+    int16_t *block;
+    size_t   size;
+    size_t   n;
+    bool     ok;
+};
+
+static bool
+play_flush(struct play_out *out)
+{
+    out->ok = mml_write_pcm(out->fp, out->block, out->n) &&
+      fflush(out->fp) == 0;
+    out->n = 0;
+    return out->ok;
+}
+
+static bool
+play_output(void *arg, const int16_t *buf, size_t n)
+{
+    struct play_out *out = arg;
+
+    while (n > 0) {
+        size_t m = out->size - out->n;
+        if (m > n)
+            m = n;
+        memcpy(out->block + out->n, buf, m * sizeof(*buf));
+        out->n += m;
+        buf += m;
+        n -= m;
+        if (out->n == out->size && !play_flush(out))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * -m play: ドライバモデルで演奏した PCM を標準出力へストリーミング
+ *  シーク用の状態は保存せず、block サンプル合成する毎に書き出す
+ *  'J' のあるチャンネルは繰り返し続け、全チャンネルが終了するか
+ *  ticks 回演奏するか、出力先が閉じられるまで続ける
+ */
+static void
+play_song(const char *ifname, bool optimize, unsigned rate, int synth,
+    bool threads, bool wav, size_t block, const char *startarg, long ticks)
+{
+    mmlsrc_t *src = calloc(1, sizeof(*src));
+    playimg_t pi;
+    MML_Snapshots none = { NULL, 0, 0 };
+    MML_Renderer r;
+    unsigned long start = 0;
+    long line = -1;
+    const char *e;
+
+    if (src == NULL)
+        errx(EXIT_FAILURE, "コンパイル状態を確保できませんでした");
+    if (startarg != NULL && (!parse_start(startarg, &start, &line) ||
+      line > 0))
+        usage();
+    if (!compile_song(src, ifname, false, optimize)) {
+        errx(EXIT_FAILURE, "コンパイルエラー %zu 件のため出力せず終了します",
+          src->nerrors);
+    }
+    load_playimg(&pi, src, optimize);
+
+    /* 開始位置まではドライバモデルだけを進める */
+    mml_render_init(&r, pi.img, pi.len, pi.start, rate, synth);
+    if ((e = mml_render_seek(&r, &none, start)) != NULL)
+        errx(EXIT_FAILURE, "%s: %s", ifname, e);
+
+    struct play_out out = { stdout, malloc(block * sizeof(int16_t)), block,
+      0, true };
+    int16_t *buf = malloc(MML_RENDER_MAX_SAMPLES(rate) * sizeof(*buf));
+    if (out.block == NULL || buf == NULL)
+        errx(EXIT_FAILURE, "レンダリング用バッファを確保できませんでした");
+    unsigned long nticks = (ticks >= 0) ? (unsigned long)ticks : MML_NOTICK;
+
+    /* 出力先が閉じられたら書き込みエラーで終了する */
+    signal(SIGPIPE, SIG_IGN);
+    if (wav)
+        out.ok = mml_write_wav_header(stdout, rate, MML_WAV_UNKNOWN);
+    if (threads) {
+        if (out.ok && (e = mml_render_threads(&r, nticks, play_output,
+          &out)) != NULL)
+            errx(EXIT_FAILURE, "%s: %s", ifname, e);
+    } else {
+        for (unsigned long t = 0; out.ok && t < nticks &&
+          !mml_player_ended(&r.player); t++) {
+            size_t n = mml_render_tick(&r, buf);
+            if (n == 0 && r.player.error != NULL)
+                errx(EXIT_FAILURE, "%s: %s", ifname, r.player.error);
+            play_output(&out, buf, n);
+        }
+    }
+    if (out.ok && out.n > 0)
+        play_flush(&out);
+    if (!out.ok && errno != EPIPE)
+        errx(EXIT_FAILURE, "出力ファイルの書き込みに失敗しました");
+
+    free(buf);
+    free(out.block);
+    mml_render_free(&r);
+    free(pi.img);
+    free_song(src);
+    free(src);
+}
+
+/*
+ * -m diff: 複数の MML ファイルの差分演奏テストを CPU 数まで並列に実行
+ *  各ファイルの出力は一時ファイルに受けてファイル順に表示する
+ *  (相違やエラーのあったファイルの分は標準エラー出力)
+ */
+static bool
+diff_songs(char **files, int nfiles, unsigned long maxticks)
+{
+    struct {
+        pid_t pid;
+        FILE *out;
+        int   status;
+        bool  done;
+    } *jobs = calloc(nfiles, sizeof(*jobs));
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int next = 0, running = 0, shown = 0, nfailed = 0;
+
+    if (jobs == NULL)
+        errx(EXIT_FAILURE, "ジョブ情報を確保できませんでした");
+    if (ncpu < 1)
+        ncpu = 1;
+    for (int k = 0; k < nfiles; k++) {
+        if (strcmp(files[k], "-") == 0)
+            errx(EXIT_FAILURE, "-m diff では標準入力を使用できません");
+    }
+    fflush(stdout);
+
+    while (shown < nfiles) {
+        while (running < ncpu && next < nfiles) {
+            FILE *out = tmpfile();
+            if (out == NULL)
+                err(EXIT_FAILURE, "一時ファイルを作成できませんでした");
+            pid_t pid = fork();
+            if (pid < 0)
+                err(EXIT_FAILURE, "プロセスを作成できませんでした");
+            if (pid == 0) {
+                dup2(fileno(out), STDOUT_FILENO);
+                dup2(fileno(out), STDERR_FILENO);
+                bool ok = diff_song(files[next], maxticks);
+                fflush(stdout);
+                _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+            jobs[next].pid = pid;
+            jobs[next].out = out;
+            next++;
+            running++;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+            err(EXIT_FAILURE, "プロセスの終了待ちに失敗しました");
+        for (int k = shown; k < next; k++) {
+            if (jobs[k].pid == pid) {
+                jobs[k].status = status;
+                jobs[k].done = true;
+                running--;
+            }
+        }
+
+        /* 終わったものからファイル順に表示 */
+        for (; shown < next && jobs[shown].done; shown++) {
+            char buf[COPY_BUF_SIZE];
+            size_t n;
+            bool ok = WIFEXITED(jobs[shown].status) &&
+              WEXITSTATUS(jobs[shown].status) == EXIT_SUCCESS;
+            FILE *fp = ok ? stdout : stderr;
+            rewind(jobs[shown].out);
+            while ((n = fread(buf, 1, sizeof(buf), jobs[shown].out)) > 0)
+                fwrite(buf, 1, n, fp);
+            fflush(fp);
+            fclose(jobs[shown].out);
+            if (!ok)
+                nfailed++;
+        }
+    }
+    free(jobs);
+
+    if (nfiles > 1) {
+        printf("%d ファイル中 %d ファイルで相違またはエラー\n", nfiles,
+          nfailed);
+    }
+    return nfailed == 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char *progpath;
+    int ch;
+    int baseaddr = 0x0000;
+    bool baseset = false;
+    bool bank = false;
+    bool optimize = false;
+    const char *ofname, *depname = NULL, *mapname = NULL;
+    const char *hexname = NULL, *cname = NULL, *asmname = NULL;
+    const char *rawprefix = NULL;
+    const char *tracename = NULL;
+    const char *vgmname = NULL;
+    const char *mode = NULL;
+    drvspec_t drvspec;
+    bool drvset = false;
+    long ticks = -1;
+    const char *startarg = NULL;
+    long rate = RENDER_DEFAULT_RATE;
+    bool rateset = false;
+    int synth = MML_PSG_BLEP;
+    bool synthset = false;
+    long cache = 0;
+    bool threads = false;
+    long block = PLAY_DEFAULT_BLOCK;
+    bool blockset = false;
+    bool wav = true;
+    bool formatset = false;
+
+    progpath = strdup(argv[0]);
+    progname = basename(progpath);
+
+    while ((ch = getopt(argc, argv,
+      "A:b:B:c:C:D:f:H:jlm:M:Op:r:R:s:S:t:T:V:")) != -1) {
+        char *endptr;
+        switch (ch) {
+        case 'b':
+            baseaddr = (int)strtol(optarg, &endptr, 0);
+            if (*endptr != '\0' || baseaddr < 0 || baseaddr > 0xffff) {
+                usage();
+            }
+            baseset = true;
+            break;
+        case 'B':
+            block = strtol(optarg, &endptr, 0);
+            if (*endptr != '\0' || block <= 0 || block > PLAY_MAX_BLOCK)
+                usage();
+            blockset = true;
+            break;
+        case 'c':
+            cache = strtol(optarg, &endptr, 0);
+            if (*endptr != '\0' || cache <= 0 || cache > RENDER_MAX_CACHE)
+                usage();
+            break;
+        case 'D':
+            if (!parse_drvspec(optarg, &drvspec))
+                usage();
+            drvset = true;
+            break;
+        case 'j':
+            threads = true;
+            break;
+        case 'l':
+            bank = true;
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        case 'M':
+            depname = optarg;
+            break;
+        case 'O':
+            optimize = true;
+            break;
+        case 'p':
+            if (strcmp(optarg, "blep") == 0)
+                synth = MML_PSG_BLEP;
+            else if (strcmp(optarg, "oversample") == 0)
+                synth = MML_PSG_OVERSAMPLE;
+            else
+                usage();
+            synthset = true;
+            break;
+        case 'r':
+            rate = strtol(optarg, &endptr, 0);
+            if (*endptr != '\0' || rate < RENDER_MIN_RATE ||
+              rate > RENDER_MAX_RATE)
+                usage();
+            rateset = true;
+            break;
+        case 's':
+            startarg = optarg;
+            break;
+        case 'S':
+            mapname = optarg;
+            break;
+        case 'T':
+            tracename = optarg;
+            break;
+        case 'V':
+            vgmname = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "wav") == 0)
+                wav = true;
+            else if (strcmp(optarg, "raw") == 0)
+                wav = false;
+            else
+                usage();
+            formatset = true;
+            break;
+        case 'H':
+            hexname = optarg;
+            break;
+        case 'C':
+            cname = optarg;
+            break;
+        case 'A':
+            asmname = optarg;
+            break;
+        case 'R':
+            rawprefix = optarg;
+            break;
+        case 't':
+            ticks = strtol(optarg, &endptr, 0);
+            if (*endptr != '\0' || ticks < 0)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    /*
+     * -D は -m z80 のみ、-t は -m z80, diff, render, play と
+     * -T, -V 指定時のみ、-s は -m trace, render, play のみ、
+     * -r, -p, -j は -m render, play のみ、
+     * -c は -m render のみ、-B, -f は -m play のみ
+     * (-j は帯域制限ステップのみで -c と併用不可)
+     */
+    bool render = (mode != NULL && strcmp(mode, "render") == 0);
+    bool play = (mode != NULL && strcmp(mode, "play") == 0);
+    if (drvset && (mode == NULL || strcmp(mode, "z80") != 0))
+        usage();
+    if (ticks >= 0 && (mode == NULL ? tracename == NULL && vgmname == NULL :
+      (strcmp(mode, "z80") != 0 && strcmp(mode, "diff") != 0 && !render &&
+      !play)))
+        usage();
+    if (startarg != NULL && (mode == NULL ||
+      (strcmp(mode, "trace") != 0 && !render && !play)))
+        usage();
+    if ((rateset || synthset || threads) && !render && !play)
+        usage();
+    if (cache > 0 && !render)
+        usage();
+    if ((blockset || formatset) && !play)
+        usage();
+    if (threads && (synth != MML_PSG_BLEP || cache > 0))
+        usage();
+
+    /* コンパイル以外の動作モード */
+    if (mode != NULL) {
+        if ((optimize && !render && !play) || depname != NULL || mapname != NULL ||
+          tracename != NULL || vgmname != NULL ||
+          hexname != NULL || cname != NULL || asmname != NULL ||
+          rawprefix != NULL)
+            usage();
+        int status = EXIT_SUCCESS;
+        if (strcmp(mode, "optimize") == 0 && !bank && argc == 2) {
+            optimize_binary(argv[0], argv[1], baseset ? baseaddr : -1);
+        } else if (strcmp(mode, "patch") == 0 && (argc == 3 || argc == 4)) {
+            patch_binary(argv[0], argv[1], argv[2], argc == 4 ? argv[3] : NULL,
+              baseset ? baseaddr : -1, bank);
+        } else if (strcmp(mode, "z80") == 0 && drvset && !bank &&
+          (argc == 2 || argc == 3)) {
+            z80_binary(argv[0], argv[1], argc == 3 ? argv[2] : NULL,
+              baseset ? baseaddr : -1, &drvspec,
+              ticks >= 0 ? ticks : Z80_DEFAULT_TICKS);
+        } else if (strcmp(mode, "diff") == 0 && !bank && !baseset &&
+          argc >= 1) {
+            if (!diff_songs(argv, argc,
+              ticks >= 0 ? (unsigned long)ticks : MODEL_DEFAULT_TICKS))
+                status = EXIT_FAILURE;
+        } else if (strcmp(mode, "trace") == 0 && !bank && !baseset &&
+          (argc == 1 || argc == 2)) {
+            unsigned long start = 0;
+            long line;
+            if (startarg != NULL &&
+              (!parse_start(startarg, &start, &line) || line > 0))
+                usage();
+            dump_trace(argv[0], argc == 2 ? argv[1] : NULL, start);
+        } else if (render && !bank && !baseset && argc == 2) {
+            render_song(argv[0], argv[1], optimize, (unsigned)rate, synth,
+              cache, threads, startarg, ticks);
+        } else if (play && !bank && !baseset && argc == 1) {
+            play_song(argv[0], optimize, (unsigned)rate, synth, threads, wav,
+              (size_t)block, startarg, ticks);
+        } else if (strcmp(mode, "info") == 0 && argc >= 1) {
+            for (int i = 0; i < argc; i++) {
+                if (!info_binary(argv[i], baseset ? baseaddr : -1, bank))
+                    status = EXIT_FAILURE;
+            }
+        } else if (strcmp(mode, "verify") == 0 && argc >= 1) {
+            /* ビルド毎に全データを検証できるよう複数ファイルをまとめて */
+            for (int i = 0; i < argc; i++) {
+                if (!verify_binary(argv[i], baseset ? baseaddr : -1, bank))
+                    status = EXIT_FAILURE;
+            }
+        } else {
+            usage();
+        }
+        free(progpath);
+        exit(status);
+    }
+
+    if (bank ? argc < 2 : argc != 2)
+        usage();
+
+    /* 最後の引数が出力ファイル、それ以外が曲毎の入力ファイル */
+    int nsongs = argc - 1;
+    ofname = argv[nsongs];
+    if (bank) {
+        if (mapname != NULL)
+            errx(EXIT_FAILURE, "バンクモードではソースマップを出力できません");
+        if (tracename != NULL || vgmname != NULL)
+            errx(EXIT_FAILURE, "バンクモードではトレースを出力できません");
+        for (int s = 0; s < nsongs; s++) {
+            if (strcmp(argv[s], "-") == 0)
+                errx(EXIT_FAILURE, "バンクモードでは標準入力を使用できません");
+        }
+    }
+
+    /* エラー終了や中断時に書きかけの出力一時ファイルを残さない */
+    atexit(remove_tmpout);
+    signal(SIGINT, remove_tmpout_signal);
+    signal(SIGTERM, remove_tmpout_signal);
+    signal(SIGHUP, remove_tmpout_signal);
+
+    /* 全曲コンパイルしてから全エラー件数を表示 */
+    mmlsrc_t *songs = calloc(nsongs, sizeof(*songs));
+    if (songs == NULL)
+        errx(EXIT_FAILURE, "コンパイル状態を確保できませんでした");
+    bool abort = false;
+    size_t nerrors = 0;
+    for (int s = 0; s < nsongs; s++) {
+        if (!compile_song(&songs[s], argv[s], mapname != NULL, optimize))
+            abort = true;
+        nerrors += songs[s].nerrors;
+    }
+    if (abort) {
+        errx(EXIT_FAILURE, "コンパイルエラー %zu 件のため出力せず終了します",
+          nerrors);
+    }
+
+    /* 全チャンネルの長さが確定したので配置を決める */
+    size_t layout = layout_songs(songs, nsongs, baseaddr, optimize);
+
+    DPRINTF("ch1 offset = %d\n", songs[0].psgch[0].offset);
+    DPRINTF("ch2 offset = %d\n", songs[0].psgch[1].offset);
+    DPRINTF("ch3 offset = %d\n", songs[0].psgch[2].offset);
+    DPRINTF("totallen   = %zu\n", layout);
+
+    /* チャンネルデータ出力 */
+    int ofd = open_output(ofname);
+    write_image(ofd, songs, nsongs, baseaddr);
+    close_output(ofd, ofname);
+
+    if (bank) {
+        print_bank_report(strcmp(ofname, "-") == 0 ? stderr : stdout,
+          songs, nsongs, baseaddr, layout);
+    }
+
+    /* 出力が成功してから依存関係ファイルとソースマップを更新 */
+    if (depname != NULL)
+        write_depfile(songs, nsongs, depname, ofname);
+    if (mapname != NULL)
+        write_srcmap(&songs[0], mapname, baseaddr);
+    if (tracename != NULL) {
+        write_trace(&songs[0], tracename, baseaddr, layout,
+          ticks >= 0 ? (unsigned long)ticks : MODEL_DEFAULT_TICKS);
+    }
+    if (vgmname != NULL) {
+        write_vgm(&songs[0], vgmname, baseaddr, layout,
+          ticks >= 0 ? (unsigned long)ticks : MODEL_DEFAULT_TICKS);
+    }
+
+    /* 同じコンパイル結果から各種フォーマットを出力 */
+    if (hexname != NULL || cname != NULL || asmname != NULL ||
+      rawprefix != NULL) {
+        uint8_t *img = load_image(songs, nsongs, baseaddr, layout);
+        char *sym = make_symbol(strcmp(ofname, "-") != 0 ? ofname :
+          strcmp(argv[0], "-") != 0 ? argv[0] : "psgdata");
+        FILE *fp;
+        if (hexname != NULL) {
+            fp = open_format(hexname);
+            close_format(fp, mml_write_ihex(fp, img, layout, baseaddr),
+              hexname);
+        }
+        if (cname != NULL) {
+            fp = open_format(cname);
+            close_format(fp,
+              mml_write_carray(fp, img, layout, baseaddr, sym), cname);
+        }
+        if (asmname != NULL) {
+            fp = open_format(asmname);
+            close_format(fp, mml_write_asm(fp, img, layout, baseaddr,
+              bank ? nsongs : 0, sym), asmname);
+        }
+        if (rawprefix != NULL) {
+            static const char ch_name[PSG_NCH] = { 'D', 'E', 'F' };
+            size_t len = strlen(rawprefix) + sizeof("_65535_D.bin");
+            char *rawname = malloc(len);
+            if (rawname == NULL)
+                errx(EXIT_FAILURE, "出力ファイル名を確保できませんでした");
+            for (int s = 0; s < nsongs; s++) {
+                for (int i = 0; i < PSG_NCH; i++) {
+                    psgch_t *psgchp = &songs[s].psgch[i];
+                    if (bank) {
+                        snprintf(rawname, len, "%s_%d_%c.bin", rawprefix, s,
+                          ch_name[i]);
+                    } else {
+                        snprintf(rawname, len, "%s_%c.bin", rawprefix,
+                          ch_name[i]);
+                    }
+                    fp = fopen(rawname, "wb");
+                    if (fp == NULL) {
+                        errx(EXIT_FAILURE,
+                          "出力ファイルを開けませんでした: %s", rawname);
+                    }
+                    size_t chlen = channel_len(&psgchp->mmlcp);
+                    close_format(fp, fwrite(img + psgchp->offset, 1, chlen,
+                      fp) == chlen, rawname);
+                }
+            }
+            free(rawname);
+        }
+        free(sym);
+        free(img);
     }
 
-    free(outbuf);
-    fclose(ofp);
+    for (int s = 0; s < nsongs; s++)
+        free_song(&songs[s]);
+    free(songs);
     free(progpath);
 
     exit(EXIT_SUCCESS);
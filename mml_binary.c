@@ -0,0 +1,299 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * コンパイル済み PSG データバイナリの命令デコード
+ *  出力フォーマット変換、検証、最適化などで共通に使用する
+ */
+
+#include "mml_binary.h"
+#include "mml_compiler.h"       /* MML_MAX_NEST */
+
+#include <stdlib.h>
+
+/*
+ * p から始まる命令の長さを返す
+ *  未定義の命令や avail バイト内に収まらない場合は 0
+ */
+size_t
+mml_op_len(const uint8_t *p, size_t avail)
+{
+    size_t len;
+
+    if (avail == 0)
+        return 0;
+
+    uint8_t op = p[0];
+    if (op < 0x80) {
+        /* 音符/休符; 音長種別で後続の音長バイト数が決まる */
+        if ((op & OP_NOTE_TONE) > 12)
+            return 0;
+        switch (op & OP_NOTE_LEN) {
+        case NOTE_LEN_1BYTE:
+            len = 2;
+            break;
+        case NOTE_LEN_2BYTE:
+            len = 3;
+            break;
+        default:
+            len = 1;
+            break;
+        }
+    } else if (op >= 0x81 && op <= 0x88) {
+        len = 1;                /* オクターブ */
+    } else if (op >= 0x90 && op <= 0x9F) {
+        len = 1;                /* 音量 */
+    } else if ((op >= 0xA1 && op <= 0xAF) || (op >= 0xB1 && op <= 0xBF)) {
+        len = 1;                /* 音量相対 */
+    } else {
+        switch (op) {
+        case OP_X:
+        case OP_NOISE_MODE1:
+        case OP_NOISE_MODE2:
+        case OP_NOISE_MODE3:
+        case OP_VIBRATO_SW:
+        case OP_J:
+        case OP_END:
+            len = 1;
+            break;
+        case OP_ENVELOPE:
+            /* 第1パラメータが0 (エンベロープOFF) のときは残りを持たない */
+            if (avail < 2)
+                return 0;
+            len = (p[1] == 0) ? 2 : 6;
+            break;
+        case OP_NOISE_FREQ:
+        case OP_NOISE_REL:
+        case OP_LOOP:
+        case OP_LOOP_END8:
+        case OP_I:
+        case OP_LPLUS:
+        case OP_L:
+        case OP_Q:
+        case OP_DETUNE:
+        case OP_DETUNE_REL:
+        case OP_VIBRATO_DEPTH:
+            len = 2;
+            break;
+        case OP_LOOP_END16:
+        case OP_LOOP_EXIT:
+        case OP_TEMPO:
+            len = 3;
+            break;
+        case OP_VIBRATO:
+            len = 5;
+            break;
+        default:
+            return 0;
+        }
+    }
+    return (len <= avail) ? len : 0;
+}
+
+/*
+ * ループ命令 (0xF1/0xF2/0xF3) なら飛び先位置を *target に返す
+ *  オフセットはいずれも命令の次の位置からの相対値で、
+ *  0xF1 は上位バイト 0xFF を省略した 1 バイトオフセット
+ *  p は pos 位置の命令 (命令長分のデータがあること)
+ */
+bool
+mml_op_branch(const uint8_t *p, size_t pos, int32_t *target)
+{
+    switch (p[0]) {
+    case OP_LOOP_END8:
+        *target = (int32_t)pos + 2 + (int16_t)(0xFF00 | p[1]);
+        return true;
+    case OP_LOOP_END16:
+    case OP_LOOP_EXIT:
+        *target = (int32_t)pos + 3 + (int16_t)(p[1] | (p[2] << 8));
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * チャンネル先頭 pos から命令をたどり、終了コマンド 0xFF の次の位置を返す
+ *  不正な命令があるか、終了コマンドがない場合は 0
+ */
+size_t
+mml_stream_end(const uint8_t *img, size_t len, size_t pos)
+{
+    while (pos < len) {
+        size_t n = mml_op_len(img + pos, len - pos);
+        if (n == 0)
+            return 0;
+        pos += n;
+        if (img[pos - n] == OP_END)
+            return pos;
+    }
+    return 0;
+}
+
+/*
+ * イメージのヘッダ (nsongs 曲の曲インデックステーブルの song 番目) から
+ * 各チャンネルのデータ範囲 [start, end) を求める
+ *  チャンネルは終了コマンド 0xFF までで、他のチャンネルと
+ *  データを共有 (重複) していてもよい
+ *  異常があった場合はチャンネル番号 (1〜) を負にして返す
+ */
+int
+mml_image_channels(const uint8_t *img, size_t len, int baseaddr,
+    int nsongs, int song, size_t start[PSG_NCH], size_t end[PSG_NCH])
+{
+    static const uint16_t ch_offset[PSG_NCH] = {
+        CH1_ADDR_OFFSET, CH2_ADDR_OFFSET, CH3_ADDR_OFFSET
+    };
+
+    size_t table = MML_TABLE_LEN(nsongs);
+    if (len < table)
+        return -1;
+    for (int i = 0; i < PSG_NCH; i++) {
+        const uint8_t *p = img + MML_TABLE_ENTRY(song) + ch_offset[i];
+        int32_t off = (p[0] | (p[1] << 8)) - baseaddr;
+        if (off < (int32_t)table || off >= (int32_t)len)
+            return -(i + 1);
+        start[i] = (size_t)off;
+        end[i] = mml_stream_end(img, len, start[i]);
+        if (end[i] == 0)
+            return -(i + 1);
+    }
+    return 0;
+}
+
+/*
+ * チャンネル先頭 pos からのデータを実行せずに検証する
+ *  命令を先頭から 1 回たどるだけなので命令数に比例する時間で終わる
+ *  - 未定義の命令がなく、終了コマンド 0xFF で終わっていること
+ *  - ループ回数が 2〜255 で、ネストが 4 段以内であること
+ *  - ループ終了 (0xF1/0xF2) の戻り先が自分のループ内の命令の先頭であること
+ *  - ループ脱出 (0xF3) がループ内にあり、飛び先がループ終了の直後であること
+ *  - ループ本体と 'J' 以降に音長のある音符/休符があること (空回りしないこと)
+ *  異常があればエラー内容を返し、その命令位置を *errpos に返す
+ */
+const char *
+mml_verify_stream(const uint8_t *img, size_t len, size_t pos, size_t *errpos)
+{
+    struct {
+        size_t start;           /* ループ本体の先頭 */
+        size_t exit;            /* ループ脱出命令の位置 (無ければ 0) */
+        int32_t exit_target;
+    } loops[MML_MAX_NEST];
+    int depth = 0;
+    const char *error = NULL;
+    size_t note_end = 0;        /* 最後の音符/休符の直後の位置 */
+    size_t jump = 0;            /* 'J' の位置 (無ければ 0) */
+
+    /* 戻り先が命令の先頭かどうかの判定用 */
+    uint8_t *head = calloc(len / 8 + 1, 1);
+    if (head == NULL) {
+        *errpos = pos;
+        return "作業領域を確保できませんでした";
+    }
+
+    for (;;) {
+        const uint8_t *p = img + pos;
+        size_t n = (pos < len) ? mml_op_len(p, len - pos) : 0;
+        int32_t target;
+
+        *errpos = pos;
+        if (n == 0) {
+            error = (pos < len) ? "未定義の命令です" :
+              "終了コマンド (0xFF) がありません";
+            break;
+        }
+        head[pos / 8] |= 1 << (pos % 8);
+
+        if (p[0] < OP_OCTAVE && !(n == 2 && p[1] == 0) &&
+          !(n == 3 && p[1] == 0 && p[2] == 0))
+            note_end = pos + n;         /* 音長 0 の音符は演奏が進まない */
+        if (p[0] == OP_END) {
+            if (depth > 0) {
+                error = "ループが閉じないままチャンネルが終了しています";
+            } else if (jump != 0 && note_end <= jump) {
+                *errpos = jump;
+                error = "'J' (0xFE) 以降に音符・休符がなく演奏が進みません";
+            }
+            break;
+        }
+        if (p[0] == OP_J)
+            jump = pos;
+        if (p[0] == OP_J && depth > 0) {
+            error = "ループ内に 'J' (0xFE) があります";
+            break;
+        }
+        if (p[0] == OP_LOOP) {
+            if (p[1] < 2) {
+                error = "ループ回数が範囲外です (2〜255)";
+                break;
+            }
+            if (depth >= MML_MAX_NEST) {
+                error = "ループのネストが 4 段を超えています";
+                break;
+            }
+            loops[depth].start = pos + n;
+            loops[depth].exit = 0;
+            depth++;
+        }
+        if (p[0] == OP_LOOP_EXIT) {
+            if (depth == 0) {
+                error = "ループ外にループ脱出 (0xF3) があります";
+                break;
+            }
+            if (loops[depth - 1].exit != 0) {
+                error = "1 つのループにループ脱出 (0xF3) が複数あります";
+                break;
+            }
+            (void)mml_op_branch(p, pos, &target);
+            loops[depth - 1].exit = pos;
+            loops[depth - 1].exit_target = target;
+        }
+        if (p[0] == OP_LOOP_END8 || p[0] == OP_LOOP_END16) {
+            if (depth == 0) {
+                error = "対応するループ開始のないループ終了があります";
+                break;
+            }
+            (void)mml_op_branch(p, pos, &target);
+            depth--;
+            if (target < (int32_t)loops[depth].start || target >= (int32_t)pos ||
+              (head[target / 8] & (1 << (target % 8))) == 0) {
+                error = "ループ終了の戻り先がループ内の命令の先頭ではありません";
+                break;
+            }
+            if (note_end <= (size_t)target) {
+                error = "ループ本体に音符・休符がなく演奏が進みません";
+                break;
+            }
+            if (loops[depth].exit != 0 &&
+              loops[depth].exit_target != (int32_t)(pos + n)) {
+                *errpos = loops[depth].exit;
+                error = "ループ脱出 (0xF3) の飛び先がループ終了の直後ではありません";
+                break;
+            }
+        }
+        pos += n;
+    }
+    free(head);
+    return error;
+}
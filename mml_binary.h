@@ -0,0 +1,101 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MML_BINARY_H
+#define MML_BINARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* MMLコンパイル結果オブジェクトファイル構造 */
+#define CH1_ADDR_OFFSET		0
+#define CH2_ADDR_OFFSET		2
+#define CH3_ADDR_OFFSET		4
+#define RESERVED_OFFSET		6
+#define CH1_START_OFFSET	8	/* オリジナルZ80版コンパイラ準拠 */
+
+#define PSG_NCH 3
+#define PSG_NREGS 16	/* AY-3-8910 のレジスタ数 */
+
+/*
+ * バンクモード (-l) の曲インデックステーブル
+ *  曲毎のチャンネル先頭アドレス 3 ワードの並びと終端の 0 ワード
+ *  (1 曲の場合は上記のヘッダと同じ構造)
+ */
+#define MML_TABLE_ENTRY(n)	((n) * PSG_NCH * 2)
+#define MML_TABLE_LEN(n)	(MML_TABLE_ENTRY(n) + 2)
+
+/* コンパイル済みバイナリのオペコード */
+#define OP_NOTE_TIE	0x40	/* 音符/休符: タイ */
+#define OP_NOTE_LEN	0x30	/* 音符/休符: 音長種別 (bit5-4) */
+#define OP_NOTE_TONE	0x0F	/* 音符/休符: 音種別 (0=休符) */
+#define OP_OCTAVE	0x80	/* 0x81-0x88 */
+#define OP_VOLUME	0x90	/* 0x90-0x9F */
+#define OP_VOLUME_DOWN	0xA0	/* 0xA1-0xAF */
+#define OP_VOLUME_UP	0xB0	/* 0xB1-0xBF */
+#define OP_X		0xE9
+#define OP_ENVELOPE	0xEA
+#define OP_NOISE_FREQ	0xEB
+#define OP_NOISE_REL	0xEC
+#define OP_NOISE_MODE1	0xED
+#define OP_NOISE_MODE2	0xEE
+#define OP_NOISE_MODE3	0xEF
+#define OP_LOOP		0xF0
+#define OP_LOOP_END8	0xF1
+#define OP_LOOP_END16	0xF2
+#define OP_LOOP_EXIT	0xF3
+#define OP_I		0xF4
+#define OP_VIBRATO	0xF5
+#define OP_VIBRATO_SW	0xF6
+#define OP_LPLUS	0xF7
+#define OP_TEMPO	0xF8
+#define OP_L		0xF9
+#define OP_Q		0xFA
+#define OP_DETUNE	0xFB
+#define OP_DETUNE_REL	0xFC
+#define OP_VIBRATO_DEPTH 0xFD
+#define OP_J		0xFE
+#define OP_END		0xFF
+
+/* ドライバのチャンネル状態初期値 (コンパイラ、最適化はこれを前提にする) */
+#define DRV_INIT_OCTAVE	4
+#define DRV_INIT_L	24	/* L音長  4分音符 相当 */
+#define DRV_INIT_LP	192	/* L+音長 全音符×2 相当 */
+
+/* 音符/休符の音長種別 (bit5-4) */
+#define NOTE_LEN_L	0x00
+#define NOTE_LEN_LP	0x10
+#define NOTE_LEN_1BYTE	0x20
+#define NOTE_LEN_2BYTE	0x30
+
+size_t mml_op_len(const uint8_t *p, size_t avail);
+bool mml_op_branch(const uint8_t *p, size_t pos, int32_t *target);
+size_t mml_stream_end(const uint8_t *img, size_t len, size_t pos);
+const char *mml_verify_stream(const uint8_t *img, size_t len, size_t pos,
+    size_t *errpos);
+int mml_image_channels(const uint8_t *img, size_t len, int baseaddr,
+    int nsongs, int song, size_t start[PSG_NCH], size_t end[PSG_NCH]);
+
+#endif /* MML_BINARY_H */
@@ -23,6 +23,8 @@
  */
 
 #include "mml_compiler.h"
+#include "mml_binary.h"
+#include "mml_optimize.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -32,14 +34,23 @@
 
 static int  peek(MML_Compiler *c);
 static int  get(MML_Compiler *c);
+static void pop_macro_frames(MML_Compiler *c);
+static void macro_statement(MML_Compiler *c);
+static const MML_Macro *find_macro(MML_Compiler *c, const char *name,
+    size_t namelen);
+static const MML_MacroExp *expand_macro(MML_Macro *m, const char *args,
+    size_t argslen);
 static void skip_space(MML_Compiler *c);
 static int  parse_unsigned(MML_Compiler *c, int *out);
 static int  parse_signed(MML_Compiler *c, int *out);
 static int  sign_byte(int v);
 static void set_error(MML_Compiler *c, MML_Error e, const char *msg);
+static void add_diag(MML_Compiler *c, MML_Error e);
+static void resync_statement(MML_Compiler *c);
 static int  ensure_space(MML_Compiler *c, size_t need);
 static void emit_byte(MML_Compiler *c, uint8_t v);
 static void emit_word_le(MML_Compiler *c, uint16_t v);
+static void srcmap_mark(MML_Compiler *c, int col);
 
 static int  notename_to_tonenum(char name);
 static void parse_para(MML_Compiler *c, uint8_t *flagp, uint16_t *valuep);
@@ -49,6 +60,9 @@ static uint8_t make_note_header(MML_Compiler *c, int tone, int len96, int tie);
 
 static void set_octave(MML_Compiler *c, int n);
 static void emit_octave(MML_Compiler *c, int n);
+static void emit_note(MML_Compiler *c, int tone, int len96, int tie);
+static bool merge_note(MML_Compiler *c, int tone, int len96, int tie);
+static void remove_octaves(MML_Compiler *c);
 
 static void compile_statement(MML_Compiler *c);
 static void compile_note(MML_Compiler *c, int note);
@@ -70,11 +84,13 @@ mml_channel_init(MML_Compiler *c, uint8_t *out_buf, size_t out_size)
     c->out     = out_buf;
     c->out_len = 0;
     c->out_cap = out_size;
+    c->spill_fp    = NULL;
+    c->out_spilled = 0;
 
     /* チャンネル状態の初期値 (ドライバ仕様に合わせる) */
-    c->l_len96     = 24;        /* L音長  4分音符 相当 */
-    c->lp_len96    = 192;       /* L+音長 全音符×2 相当 */
-    c->octave      = 4;         /* ドライバ側初期値を仮定 */
+    c->l_len96     = DRV_INIT_L;
+    c->lp_len96    = DRV_INIT_LP;
+    c->octave      = DRV_INIT_OCTAVE;   /* ドライバ側初期値を仮定 */
     c->octave_last = c->octave; 
     c->key_shift   = 0;
 
@@ -87,16 +103,52 @@ mml_channel_init(MML_Compiler *c, uint8_t *out_buf, size_t out_size)
         c->loops[i].saved_octave      = 0;
         c->loops[i].saved_octave_last = 0;
     }
+    c->nest_shadow = 0;
+    c->nest_low = 0;
 
     c->error = MML_OK;
     c->error_msg[0] = '\0';
 
+    c->diags      = NULL;
+    c->ndiags     = 0;
+    c->diags_cap  = 0;
+    c->stmt_error = false;
+    c->out_overflow = false;
+
+    c->optimize = false;
+    c->note_pos = NONOTE;
+    c->len_varies = false;
+    c->gate = 0;
+    c->gate_varies = false;
+
+    c->nnotes      = 0;
+    c->jump_pos    = NOJUMP;
+    c->jump_nnotes = 0;
+    c->jump_ndiags = 0;
+    c->jump_line   = 0;
+    c->jump_col    = 0;
+
     /* 行入力用フィールドはまだ設定しない */
     c->src  = NULL;
     c->pos  = 0;
     c->len  = 0;
     c->line = 0;
     c->col  = 0;
+
+    c->mdepth = 0;
+    c->mcol   = 0;
+    c->macro  = NULL;
+    c->last_macro = NULL;
+    c->macros.head = NULL;
+    c->macros.gen  = 0;
+    c->global_macros = NULL;
+
+    c->col_base = 0;
+    c->file     = 0;
+    c->srcmap_enable = false;
+    c->srcmap     = NULL;
+    c->nsrcmap    = 0;
+    c->srcmap_cap = 0;
 }
 
 /*
@@ -114,15 +166,21 @@ mml_compile_line(MML_Compiler *c, const char *src, int line_no)
     c->pos  = 0;
     c->line = line_no;
     c->col  = 1;
+    c->mdepth = 0;
+    c->macro  = NULL;
+    c->last_macro = NULL;
 
     c->error = MML_OK;
     c->error_col = NOERROR;
     c->error_msg[0] = '\0';
 
-    while (c->pos < c->len && c->error == MML_OK) {
+    /* エラーがあっても次の文から解析を再開して行末まで全エラーを集める */
+    /* (マクロ展開の終端は peek() で展開元に戻るのでここでは見ない) */
+    while (peek(c) >= 0) {
         compile_statement(c);
     }
 
+    /* 戻り値は行内で最初に発生したエラー */
     return c->error;
 }
 
@@ -133,6 +191,13 @@ mml_compile_line(MML_Compiler *c, const char *src, int line_no)
 MML_Error
 mml_finish_channel(MML_Compiler *c)
 {
+    c->error = MML_OK;
+    c->error_col = NOERROR;
+    c->stmt_error = false;
+
+    /* エンドマークは最終行の行末に対応させる */
+    srcmap_mark(c, c->col);
+
     /* ネストが閉じているか最終チェック */
     if (c->nest_depth != 0) {
         set_error(c, MML_ERR_CLOSE_NEST,
@@ -140,40 +205,488 @@ mml_finish_channel(MML_Compiler *c)
         return c->error;
     }
 
+    /* 'J' 以降に音符/休符がなければ戻った後に演奏が進まなくなる */
+    /* (エラーの文があれば音符が出力されなかっただけなので報告しない) */
+    if (c->jump_pos != NOJUMP && c->nnotes == c->jump_nnotes &&
+      c->ndiags == c->jump_ndiags) {
+        c->line = c->jump_line;
+        c->error_col = c->jump_col;
+        c->last_macro = NULL;
+        set_error(c, MML_ERR_ZERO_CYCLE,
+          "'J'以降に音符・休符がないため演奏が進まなくなります");
+        return c->error;
+    }
+
     /* 出力末尾にエンドマーク 0xFF を付加 */
     emit_byte(c, 0xFF);
+
+    /* 冗長なオクターブの削除はチャンネル全体がバッファにある場合のみ */
+    if (c->optimize && c->error == MML_OK && c->out_spilled == 0)
+        remove_octaves(c);
+    return c->error;
+}
+
+/*
+ * チャンネル別データ解放
+ *  出力バッファは呼び出し側の管理なのでここでは診断情報リストのみ
+ */
+void
+mml_channel_free(MML_Compiler *c)
+{
+    free(c->diags);
+    c->diags     = NULL;
+    c->ndiags    = 0;
+    c->diags_cap = 0;
+    mml_macro_free(&c->macros);
+    free(c->srcmap);
+    c->srcmap     = NULL;
+    c->nsrcmap    = 0;
+    c->srcmap_cap = 0;
+}
+
+/*
+ * マクロ定義
+ *  name, body は長さ指定 (NUL終端不要)
+ *  同名マクロは再定義で上書きし、展開キャッシュも破棄する
+ */
+bool
+mml_macro_define(MML_MacroTable *t, const char *name, size_t namelen,
+    const char *body, size_t bodylen)
+{
+    MML_Macro *m;
+
+    for (m = t->head; m != NULL; m = m->next) {
+        if (strlen(m->name) == namelen && memcmp(m->name, name, namelen) == 0)
+            break;
+    }
+    char *nbody = malloc(bodylen + 1);
+    if (nbody == NULL)
+        return false;
+    memcpy(nbody, body, bodylen);
+    nbody[bodylen] = '\0';
+
+    if (m == NULL) {
+        m = calloc(1, sizeof(*m));
+        if (m == NULL || (m->name = malloc(namelen + 1)) == NULL) {
+            free(m);
+            free(nbody);
+            return false;
+        }
+        memcpy(m->name, name, namelen);
+        m->name[namelen] = '\0';
+        m->next = t->head;
+        t->head = m;
+    } else {
+        free(m->body);
+        while (m->exps != NULL) {
+            MML_MacroExp *e = m->exps;
+            m->exps = e->next;
+            free(e->args);
+            free(e->text);
+            free(e);
+        }
+    }
+    m->body = nbody;
+    t->gen++;
+    return true;
+}
+
+/* マクロ定義表解放 */
+void
+mml_macro_free(MML_MacroTable *t)
+{
+    while (t->head != NULL) {
+        MML_Macro *m = t->head;
+        t->head = m->next;
+        while (m->exps != NULL) {
+            MML_MacroExp *e = m->exps;
+            m->exps = e->next;
+            free(e->args);
+            free(e->text);
+            free(e);
+        }
+        free(m->name);
+        free(m->body);
+        free(m);
+    }
+}
+
+/*
+ * インクルード断片キャッシュ用チャンネル状態保存
+ *  断片コンパイル前に呼び出し、ネスト操作の最浅段の記録もリセットする
+ *  断片の出力が前後に依存しないよう、直前の音符との結合も打ち切る
+ */
+void
+mml_save_state(MML_Compiler *c, MML_ChannelState *st)
+{
+    memset(st, 0, sizeof(*st));     /* memcmp() で比較できるように */
+    st->nest_depth  = c->nest_depth;
+    st->l_len96     = c->l_len96;
+    st->lp_len96    = c->lp_len96;
+    st->octave      = c->octave;
+    st->octave_last = c->octave_last;
+    st->key_shift   = c->key_shift;
+    for (int i = 0; i < MML_MAX_NEST; i++)
+        st->loop_octave_emit[i] = c->loops[i].loop_octave_emit;
+    st->len_varies  = c->len_varies;
+    st->gate        = c->gate;
+    st->gate_varies = c->gate_varies;
+    st->macro_gen = c->macros.gen +
+      (c->global_macros != NULL ? c->global_macros->gen : 0);
+
+    c->nest_low = c->nest_depth;
+    c->note_pos = NONOTE;
+}
+
+/*
+ * 断片コンパイル結果の再利用可否判定
+ *  断片の外で開始されたループを ':' ']' で操作している場合は
+ *  出力位置に依存するので再利用不可
+ */
+bool
+mml_state_reusable(const MML_Compiler *c, const MML_ChannelState *entry)
+{
+    unsigned gen = c->macros.gen +
+      (c->global_macros != NULL ? c->global_macros->gen : 0);
+
+    /* マクロを定義する断片は再利用すると定義が反映されないので不可 */
+    return c->nest_depth == entry->nest_depth &&
+      c->nest_low >= entry->nest_depth && gen == entry->macro_gen &&
+      c->nest_shadow == 0 && !c->out_overflow;
+}
+
+/* キャッシュされた断片コンパイル後の状態を復元 */
+void
+mml_restore_state(MML_Compiler *c, const MML_ChannelState *st)
+{
+    c->nest_depth  = st->nest_depth;
+    c->l_len96     = st->l_len96;
+    c->lp_len96    = st->lp_len96;
+    c->octave      = st->octave;
+    c->octave_last = st->octave_last;
+    c->key_shift   = st->key_shift;
+    for (int i = 0; i < MML_MAX_NEST; i++)
+        c->loops[i].loop_octave_emit = st->loop_octave_emit[i];
+    c->len_varies  = st->len_varies;
+    c->gate        = st->gate;
+    c->gate_varies = st->gate_varies;
+}
+
+/*
+ * キャッシュされた断片コンパイル結果を出力バッファに追加
+ *  map は断片先頭からのオフセットで記録したソースマップ
+ */
+MML_Error
+mml_append_object(MML_Compiler *c, const uint8_t *obj, size_t len,
+    const MML_SrcPos *map, size_t nmap)
+{
     c->error = MML_OK;
+    c->error_col = NOERROR;
+    c->stmt_error = false;
+    if (!ensure_space(c, len))
+        return c->error;
+    c->note_pos = NONOTE;
+    if (c->srcmap_enable) {
+        int file = c->file, line = c->line, col_base = c->col_base;
+        for (size_t i = 0; i < nmap; i++) {
+            c->file = map[i].file;
+            c->line = map[i].line;
+            c->col_base = 0;
+            size_t out_len = c->out_len;
+            c->out_len += map[i].offset;
+            srcmap_mark(c, map[i].col);
+            c->out_len = out_len;
+        }
+        c->file = file;
+        c->line = line;
+        c->col_base = col_base;
+    }
+    memcpy(c->out + c->out_len, obj, len);
+    c->out_len += len;
+
+    /* ループ本体や 'J' 以降の音符/休符の有無の判定用に数える */
+    for (size_t i = 0, n; i < len; i += n) {
+        n = mml_op_len(obj + i, len - i);
+        if (n == 0)
+            break;
+        if (obj[i] < OP_OCTAVE)
+            c->nnotes++;
+    }
     return MML_OK;
 }
 
 /* --- バッファ処理ヘルパ関数 ---------------------------------------------- */
 
-/* 入力 1文字チェック */
+/*
+ * 入力 1文字チェック
+ *  '$' で始まるマクロの使用/定義はここで処理し、展開後の文字を返す
+ */
 static int
 peek(MML_Compiler *c)
 {
-    if (c->pos >= c->len)
-        return -1;
-    int ch = (unsigned char)c->src[c->pos];
-    return ch;
+    for (;;) {
+        pop_macro_frames(c);
+        if (c->pos >= c->len)
+            return -1;
+        int ch = (unsigned char)c->src[c->pos];
+        if (ch == '$' && c->pos + 1 < c->len &&
+            (isalpha((unsigned char)c->src[c->pos + 1]) ||
+             c->src[c->pos + 1] == '_')) {
+            macro_statement(c);
+            continue;
+        }
+        return ch;
+    }
 }
 
-/* 入力 1文字読み出し */
+/* 入力 1文字読み出し (マクロ展開は peek() 側で実施済みの前提) */
 static int
 get(MML_Compiler *c)
 {
+    pop_macro_frames(c);
     if (c->pos >= c->len)
         return -1;
     int ch = (unsigned char)c->src[c->pos++];
     if (ch == '\n') {
         /* 改行チェックは別で実施される前提でそのまま返す */
         return ch;
+    } else if (c->mdepth > 0) {
+        /* マクロ展開中は行上の桁は使用箇所のまま */
+        c->mcol++;
     } else {
         c->col++;
     }
+    /* 空白以外を読み進めたらマクロ本体末尾のエラーではなくなる */
+    if (ch != ' ' && ch != '\t' && ch != '\r')
+        c->last_macro = NULL;
     return ch;
 }
 
+/* 読み終わったマクロ展開から展開元の入力に戻る */
+static void
+pop_macro_frames(MML_Compiler *c)
+{
+    while (c->pos >= c->len && c->mdepth > 0) {
+        MML_SrcFrame *f = &c->mframes[--c->mdepth];
+        /*
+         * 数値の終端判定などで展開元の次の文字を見ただけの時点で
+         * エラーになった場合は読み終えたマクロ本体の位置を示す
+         */
+        c->last_macro   = c->macro;
+        c->last_mcol    = c->mcol;
+        c->last_use_col = (c->mdepth == 0) ? f->use_col : c->col;
+        c->src   = f->src;
+        c->pos   = f->pos;
+        c->len   = f->len;
+        c->mcol  = f->mcol;
+        c->macro = f->macro;
+        if (c->mdepth == 0)
+            c->col = f->use_end_col;
+    }
+}
+
+/* マクロ名の文字 */
+static int
+is_macro_name(int ch)
+{
+    return isalnum(ch) || ch == '_';
+}
+
+/*
+ * マクロ使用 `$名前` `$名前(引数,...)` / チャンネル別定義 `$名前=本体`
+ *  使用時は展開結果を新たな入力として積み、以降の peek()/get() で読ませる
+ *  展開中のエラー位置は行上の使用箇所の桁とマクロ本体上の桁で示す
+ */
+static void
+macro_statement(MML_Compiler *c)
+{
+    const char *src = c->src;
+    size_t p = c->pos + 1;
+    size_t name = p;
+    int dollar_col = c->col + 1;    /* エラー表示の '^' が '$' を指す桁 */
+
+    while (p < c->len && is_macro_name((unsigned char)src[p]))
+        p++;
+    size_t namelen = p - name;
+
+    if (p < c->len && src[p] == '=') {
+        /* チャンネル別定義: 本体は行末 (コメント ';' の手前) まで */
+        size_t body = ++p;
+        while (p < c->len && src[p] != ';' && src[p] != '\n')
+            p++;
+        size_t end = p;
+        while (end > body && isspace((unsigned char)src[end - 1]))
+            end--;
+        if (c->mdepth > 0) {
+            set_error(c, MML_ERR_SYNTAX,
+              "マクロ本体の中でマクロは定義できません");
+        } else if (!mml_macro_define(&c->macros, src + name, namelen,
+            src + body, end - body)) {
+            set_error(c, MML_ERR_INTERNAL,
+              "マクロ定義用のメモリが確保できませんでした");
+        }
+        /* 定義部分はすべて読み捨て (桁はそのまま進める) */
+        while (c->pos < p)
+            (void)get(c);
+        return;
+    }
+
+    /* 引数 (省略可) */
+    size_t args = p, argslen = 0;
+    if (p < c->len && src[p] == '(') {
+        args = ++p;
+        while (p < c->len && src[p] != ')' && src[p] != '\n')
+            p++;
+        if (p >= c->len || src[p] != ')') {
+            c->error_col = dollar_col;
+            set_error(c, MML_ERR_SYNTAX,
+              "マクロ引数の')'がありません");
+            while (c->pos < p)
+                (void)get(c);
+            return;
+        }
+        argslen = p - args;
+        p++;
+    }
+
+    /* 使用箇所は展開前にすべて読み進めておく */
+    while (c->pos < p)
+        (void)get(c);
+
+    const MML_Macro *m = find_macro(c, src + name, namelen);
+    if (m == NULL) {
+        c->error_col = dollar_col;
+        set_error(c, MML_ERR_SYNTAX, "定義されていないマクロです");
+        return;
+    }
+    if (c->mdepth >= MML_MAX_MACRO_DEPTH) {
+        c->error_col = dollar_col;
+        set_error(c, MML_ERR_SYNTAX,
+          "マクロの展開が深すぎます (再帰定義?)");
+        return;
+    }
+    const MML_MacroExp *e = expand_macro((MML_Macro *)m, src + args, argslen);
+    if (e == NULL) {
+        c->error_col = dollar_col;
+        set_error(c, MML_ERR_FUNC_RANGE,
+          "マクロの引数が不足しています ($1〜$9)");
+        return;
+    }
+
+    MML_SrcFrame *f = &c->mframes[c->mdepth++];
+    f->src   = c->src;
+    f->pos   = c->pos;
+    f->len   = c->len;
+    f->mcol  = c->mcol;
+    f->macro = c->macro;
+    f->use_col = dollar_col;
+    f->use_end_col = c->col;
+    if (c->mdepth == 1) {
+        /* 展開中のエラーは行上では '$' の位置を示す */
+        c->col = dollar_col;
+    }
+    c->src   = e->text;
+    c->pos   = 0;
+    c->len   = e->len;
+    c->mcol  = 1;
+    c->macro = m;
+}
+
+/* マクロ検索 (チャンネル別定義を優先) */
+static const MML_Macro *
+find_macro(MML_Compiler *c, const char *name, size_t namelen)
+{
+    MML_MacroTable *tables[2] = { &c->macros, c->global_macros };
+
+    for (int i = 0; i < 2; i++) {
+        if (tables[i] == NULL)
+            continue;
+        for (MML_Macro *m = tables[i]->head; m != NULL; m = m->next) {
+            if (strlen(m->name) == namelen &&
+                memcmp(m->name, name, namelen) == 0)
+                return m;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * マクロ展開 ($1〜$9 を引数で置換)
+ *  展開結果はマクロ毎に引数の組単位でキャッシュする
+ *  引数不足またはメモリ不足時は NULL
+ */
+static const MML_MacroExp *
+expand_macro(MML_Macro *m, const char *args, size_t argslen)
+{
+    MML_MacroExp *e;
+
+    for (e = m->exps; e != NULL; e = e->next) {
+        if (strlen(e->args) == argslen && memcmp(e->args, args, argslen) == 0)
+            return e;
+    }
+
+    /* 引数の切り出し */
+    const char *argv[9];
+    size_t argl[9];
+    int argc = 0;
+    if (argslen > 0) {
+        const char *a = args, *end = args + argslen;
+        while (argc < 9) {
+            const char *comma = memchr(a, ',', end - a);
+            const char *aend = (comma != NULL) ? comma : end;
+            argv[argc] = a;
+            argl[argc] = aend - a;
+            argc++;
+            if (comma == NULL)
+                break;
+            a = comma + 1;
+        }
+    }
+
+    /* 置換後の長さを求めてから展開 */
+    size_t len = 0;
+    for (const char *b = m->body; *b != '\0'; b++) {
+        if (b[0] == '$' && b[1] >= '1' && b[1] <= '9') {
+            int n = b[1] - '1';
+            if (n >= argc)
+                return NULL;
+            len += argl[n];
+            b++;
+        } else {
+            len++;
+        }
+    }
+    e = calloc(1, sizeof(*e));
+    if (e == NULL)
+        return NULL;
+    e->args = malloc(argslen + 1);
+    e->text = malloc(len + 1);
+    if (e->args == NULL || e->text == NULL) {
+        free(e->args);
+        free(e->text);
+        free(e);
+        return NULL;
+    }
+    memcpy(e->args, args, argslen);
+    e->args[argslen] = '\0';
+    char *t = e->text;
+    for (const char *b = m->body; *b != '\0'; b++) {
+        if (b[0] == '$' && b[1] >= '1' && b[1] <= '9') {
+            int n = b[1] - '1';
+            memcpy(t, argv[n], argl[n]);
+            t += argl[n];
+            b++;
+        } else {
+            *t++ = *b;
+        }
+    }
+    *t = '\0';
+    e->len = len;
+    e->next = m->exps;
+    m->exps = e;
+    return e;
+}
+
 /* 入力のスペースやタブを読み捨て */
 static void
 skip_space(MML_Compiler *c)
@@ -231,30 +744,134 @@ sign_byte(int v)
     return (v >= 0) ? v : (0x80 | -v);
 }
 
-/* エラー文字列と発生箇所を共通構造体にセット */
+/*
+ * エラー文字列と発生箇所を共通構造体にセット
+ *  1文につき最初のエラーのみ診断情報リストに追加する
+ *  (エラー後の連鎖的なエラーは次の文の再同期で読み飛ばされる)
+ */
 static void
 set_error(MML_Compiler *c, MML_Error e, const char *msg)
 {
-    if (c->error == MML_OK) {
+    if (c->stmt_error)
+        return;
+    c->stmt_error = true;
+
+    if (c->error_col == NOERROR)
+        c->error_col = c->col;
+    if (c->last_macro != NULL) {
+        /* 読み終えた直後のマクロ本体末尾でのエラー */
+        c->error_col = c->last_use_col;
+        snprintf(c->error_msg, sizeof(c->error_msg),
+          "%s (%d 行目, %d 桁目, マクロ'$%s'の %d 桁目)",
+          msg != NULL ? msg : "エラー", c->line, c->error_col,
+          c->last_macro->name, c->last_mcol);
+    } else if (c->mdepth > 0) {
+        /* マクロ展開中はマクロ本体上の位置も示す */
+        snprintf(c->error_msg, sizeof(c->error_msg),
+          "%s (%d 行目, %d 桁目, マクロ'$%s'の %d 桁目)",
+          msg != NULL ? msg : "エラー", c->line, c->error_col,
+          c->macro->name, c->mcol);
+    } else {
+        snprintf(c->error_msg, sizeof(c->error_msg),
+          "%s (%d 行目, %d 桁目)",
+          msg != NULL ? msg : "エラー", c->line, c->error_col);
+    }
+    add_diag(c, e);
+
+    /* 戻り値用には行内で最初のエラー種別を残す */
+    if (c->error == MML_OK)
         c->error = e;
-        if (msg) {
-            if (c->error_col == NOERROR)
-                c->error_col = c->col;
-            snprintf(c->error_msg, sizeof(c->error_msg),
-              "%s (%d 行目, %d 桁目)",
-              msg, c->line, c->error_col);
+}
+
+/* 診断情報リストに現在のエラー情報を追加 (確保失敗時は error_msg のみ残る) */
+static void
+add_diag(MML_Compiler *c, MML_Error e)
+{
+    if (c->ndiags >= c->diags_cap) {
+        size_t ncap = (c->diags_cap == 0) ? 16 : c->diags_cap * 2;
+        MML_Diag *nd = realloc(c->diags, ncap * sizeof(*nd));
+        if (nd == NULL)
+            return;
+        c->diags = nd;
+        c->diags_cap = ncap;
+    }
+    MML_Diag *d = &c->diags[c->ndiags++];
+    d->error = e;
+    d->line  = c->line;
+    d->col   = c->error_col;
+    memcpy(d->msg, c->error_msg, sizeof(d->msg));
+}
+
+/*
+ * エラー発生後の再同期
+ *  エラーになった文の残りのパラメータ部分 (数字, 符号, 区切り等) を読み捨て
+ *  次のコマンド文字または音符から解析を再開させる
+ */
+static void
+resync_statement(MML_Compiler *c)
+{
+    for (;;) {
+        int ch = peek(c);
+        if (ch < 0 || ch == '\n')
+            break;
+        if (!isdigit(ch) && strchr(" \t\r,+-%.^&#", ch) == NULL)
+            break;
+        (void)get(c);
+    }
+}
+
+/*
+ * 出力バッファ溢れ時の一時ファイル書き出し
+ *  ']' ':' で後から書き換える未完了ループ部分より前だけを書き出せる
+ */
+static int
+spill_output(MML_Compiler *c, size_t need)
+{
+    size_t safe = c->out_len;
+    if (c->nest_depth > 0)
+        safe = c->loops[0].loop_start - 2;     /* '[' コマンド長=2 */
+
+    if (safe > 0) {
+        if (fwrite(c->out, 1, safe, c->spill_fp) != safe)
+            return 0;
+        memmove(c->out, c->out + safe, c->out_len - safe);
+        c->out_len -= safe;
+        c->out_spilled += safe;
+        for (int i = 0; i < c->nest_depth; i++) {
+            c->loops[i].loop_start -= safe;
+            if (c->loops[i].exit_mark != LOOP_NOEXIT)
+                c->loops[i].exit_mark -= safe;
         }
     }
+    if (c->out_len + need > c->out_cap) {
+        /* 未完了ループがバッファより大きい場合は拡張するしかない */
+        size_t ncap = c->out_cap * 2;
+        while (c->out_len + need > ncap)
+            ncap *= 2;
+        uint8_t *nout = realloc(c->out, ncap);
+        if (nout == NULL)
+            return 0;
+        c->out = nout;
+        c->out_cap = ncap;
+    }
+    return 1;
 }
 
 /* 出力バッファサイズチェック */
 static int
 ensure_space(MML_Compiler *c, size_t need)
 {
+    if (c->out_len + need > c->out_cap && c->spill_fp != NULL &&
+        spill_output(c, need))
+        return 1;
     if (c->out_len + need > c->out_cap) {
-        c->error_col = c->col;
-        set_error(c, MML_ERR_INTERNAL,
-          "コンパイル結果出力サイズがバッファサイズを超えました");
+        /* 以降の出力もすべて溢れるので報告は1回のみ */
+        if (!c->out_overflow) {
+            c->out_overflow = true;
+            c->error_col = c->col;
+            set_error(c, MML_ERR_INTERNAL,
+              "コンパイル結果出力サイズがバッファサイズを超えました");
+        }
         return 0;
     }
     return 1;
@@ -279,6 +896,34 @@ emit_word_le(MML_Compiler *c, uint16_t v)
     c->out[c->out_len++] = (uint8_t)(v >> 8);
 }
 
+/*
+ * ソースマップ記録: 次に出力するオペコードの位置を記録
+ *  同じ出力位置の記録は最後のもので上書きする (何も出力しない文の分)
+ *  col は c->src 上の桁 (行頭からの桁に変換して記録)
+ */
+static void
+srcmap_mark(MML_Compiler *c, int col)
+{
+    if (!c->srcmap_enable)
+        return;
+    if (c->nsrcmap > 0 &&
+        c->srcmap[c->nsrcmap - 1].offset == c->out_spilled + c->out_len) {
+        c->nsrcmap--;
+    } else if (c->nsrcmap >= c->srcmap_cap) {
+        size_t ncap = (c->srcmap_cap == 0) ? 256 : c->srcmap_cap * 2;
+        MML_SrcPos *nm = realloc(c->srcmap, ncap * sizeof(*nm));
+        if (nm == NULL)
+            return;
+        c->srcmap = nm;
+        c->srcmap_cap = ncap;
+    }
+    MML_SrcPos *sp = &c->srcmap[c->nsrcmap++];
+    sp->offset = (uint32_t)(c->out_spilled + c->out_len);
+    sp->file   = c->file;
+    sp->line   = c->line;
+    sp->col    = c->col_base + col;
+}
+
 /* --- 音符・休符・Lコマンド音長用ヘルパ関数 ------------------------------- */
 
 /* ノート文字列からノート番号へ変換 */
@@ -551,6 +1196,172 @@ make_note_header(MML_Compiler *c, int tone, int len96, int tie)
 
 /* --- コマンド出力ヘルパ関数 ---------------------------------------------- */
 
+/* L / L+ 音長で (音長バイトを省いて) 出力される音長か */
+static bool
+implicit_len(const MML_Compiler *c, int len96)
+{
+    return len96 == c->l_len96 || len96 == c->lp_len96;
+}
+
+/* 音符/休符コマンドの出力バイト数 */
+static size_t
+note_size(const MML_Compiler *c, int len96)
+{
+    if (implicit_len(c, len96))
+        return 1;
+    return (len96 <= 255) ? 2 : 3;
+}
+
+/* 音符/休符コマンド出力 */
+static void
+emit_note(MML_Compiler *c, int tone, int len96, int tie)
+{
+    c->note_pos = c->out_spilled + c->out_len;
+    c->nnotes++;
+
+    uint8_t onpu = make_note_header(c, tone, len96, tie);
+    emit_byte(c, onpu);
+
+    /* L / L+ と一致しないときだけ長さバイトを出す */
+    if (len96 != c->l_len96 && len96 != c->lp_len96) {
+        if (len96 <= 255) {
+            /* 音長1バイト */
+            emit_byte(c, (uint8_t)len96);
+        } else {
+            /* 音長2バイト */
+            emit_word_le(c, (uint16_t)len96);
+        }
+    }
+
+    c->note_end = c->out_spilled + c->out_len;
+    c->note_tone = tone;
+    c->note_len96 = len96;
+    c->note_tie = tie;
+}
+
+/*
+ * 直前の音符/休符との結合 (最適化)
+ *  タイ付きの音符の直後の同じ音の音符、休符の直後の休符を
+ *  音長を加算した 1 つの音符/休符に書き換える
+ *  間に他のコマンド (オクターブ、ループ、'J' など) が出力されていれば
+ *  結合しないので、ループの境界をまたぐことはない
+ *  ループ内と 'J' 以降は後の L / L+ で 2 周目から音長が変わりうるので、
+ *  結合前後のどちらかが L / L+ 音長で出力される場合は結合しない
+ *  ループ内で L / L+ を設定した後は ':' で脱出した後の L / L+ 音長が
+ *  ドライバ上の値と異なりうるので同様に結合しない
+ *  タイでつながらない音符は残り音長が Q 以下で消音するので、後ろの音符の
+ *  音長が Q より長い場合だけ結合して消音の時刻を変えない
+ *  (ループ内と 'J' 以降は Q が変わりうるので最大値の 255 とみなす)
+ */
+static bool
+merge_note(MML_Compiler *c, int tone, int len96, int tie)
+{
+    if (c->note_pos == NONOTE || c->note_pos < c->out_spilled ||
+      c->note_end != c->out_spilled + c->out_len)
+        return false;           /* 直前の出力が音符でない (か書き出し済み) */
+    if (tone != c->note_tone)
+        return false;
+    if (tone != 0 && !c->note_tie)
+        return false;           /* タイでつながっていない音符 */
+    if (tone == 0 && c->note_tie)
+        return false;           /* タイ付きの休符はそのまま残す */
+    if (tone != 0 && !tie &&
+      len96 <= (c->nest_depth > 0 || c->gate_varies ? 255 : c->gate))
+        return false;           /* 結合すると Q による消音が早まる */
+
+    /* 音長は 2 バイトで表せる範囲まで、出力サイズが増えない場合のみ */
+    int sum = c->note_len96 + len96;
+    if (sum > 32767)
+        return false;
+    if ((c->nest_depth > 0 || c->len_varies) &&
+      (implicit_len(c, c->note_len96) || implicit_len(c, len96) ||
+      implicit_len(c, sum)))
+        return false;
+    size_t pos = c->note_pos - c->out_spilled;
+    if (note_size(c, sum) > c->out_len - pos + note_size(c, len96))
+        return false;
+
+    /* 結合される側の音符の文のソースマップ記録は不要 */
+    while (c->nsrcmap > 0 && c->srcmap[c->nsrcmap - 1].offset > c->note_pos)
+        c->nsrcmap--;
+    c->out_len = pos;
+    emit_note(c, tone, sum, tie);
+    return true;
+}
+
+/* 削除位置の表 pos (昇順 n 個) で x より前にあるものの数 */
+static size_t
+removed_before(const size_t *pos, size_t n, size_t x)
+{
+    size_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (pos[mid] < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * 冗長なオクターブの削除 (最適化、チャンネル終了時)
+ *  ループや 'J' で合流する全ての経路で同じオクターブに確定しているものと
+ *  参照されないまま上書きされるものだけを削除するので演奏は変わらない
+ *  (ループ内最初のオクターブの即時出力もここで不要なものは消える)
+ *  ループの飛び先とソースマップの位置は詰めた位置に合わせて書き換える
+ */
+static void
+remove_octaves(MML_Compiler *c)
+{
+    size_t *pos, n;
+
+    if (mml_redundant_octaves(c->out, c->out_len, &pos, &n) != NULL ||
+      n == 0) {
+        free(pos);
+        return;
+    }
+
+    /* 削除位置より後ろの命令位置と飛び先を削除した数だけ詰める */
+    for (size_t q = 0, len; q < c->out_len; q += len) {
+        int32_t t;
+        len = mml_op_len(c->out + q, c->out_len - q);
+        if (len == 0)
+            break;
+        if (mml_op_branch(c->out + q, q, &t)) {
+            int32_t nq = (int32_t)(q - removed_before(pos, n, q));
+            int32_t nt = t - (int32_t)removed_before(pos, n, (size_t)t);
+            uint16_t off = (uint16_t)(nt - (nq + (int32_t)len));
+            c->out[q + 1] = (uint8_t)(off & 0xFF);
+            if (len == 3)
+                c->out[q + 2] = (uint8_t)(off >> 8);
+        }
+    }
+    size_t k = 0;
+    for (size_t q = 0, i = 0; q < c->out_len; q++) {
+        if (i < n && pos[i] == q) {
+            i++;
+            continue;
+        }
+        c->out[k++] = c->out[q];
+    }
+    c->out_len = k;
+    c->note_pos = NONOTE;
+
+    /* 削除したオクターブの文の記録は続く文の記録と重なるので削除 */
+    k = 0;
+    for (size_t i = 0; i < c->nsrcmap; i++) {
+        MML_SrcPos sp = c->srcmap[i];
+        sp.offset -= (uint32_t)removed_before(pos, n, sp.offset);
+        if (k > 0 && c->srcmap[k - 1].offset == sp.offset)
+            k--;
+        c->srcmap[k++] = sp;
+    }
+    c->nsrcmap = k;
+    free(pos);
+}
+
 /* オクターブ出力; 範囲チェックを集約 */
 static void
 set_octave(MML_Compiler *c, int n)
@@ -573,6 +1384,9 @@ emit_octave(MML_Compiler *c, int n)
     }
     emit_byte(c, 0x80 + (uint8_t)n);
     c->octave_last = n;
+    /* 音符の前に出力した場合は続く音符も同じ文の位置に対応 */
+    if (c->nsrcmap > 0)
+        srcmap_mark(c, c->srcmap[c->nsrcmap - 1].col - c->col_base);
 }
 
 /* --- メイン行単位パーサー ------------------------------------------------ */
@@ -581,10 +1395,15 @@ emit_octave(MML_Compiler *c, int n)
 static void
 compile_statement(MML_Compiler *c)
 {
+    c->stmt_error = false;
+    c->error_col = NOERROR;
+
     skip_space(c);
     int ch = peek(c);
     if (ch < 0)
         return;
+    /* マクロ展開中の c->col はエラー表示用に '$' の次の桁なので1つ戻す */
+    srcmap_mark(c, (c->mdepth > 0) ? c->col - 1 : c->col);
 
     if (ch == ';') {
         /* コメント: 行末まで読み飛ばし */
@@ -610,6 +1429,10 @@ compile_statement(MML_Compiler *c)
         /* コマンド処理 */
         compile_command(c, up);
     }
+
+    /* エラー時は文の残りを読み捨てて次の文の先頭に同期 */
+    if (c->stmt_error)
+        resync_statement(c);
 }
 
 /* 音符・休符処理 */
@@ -692,19 +1515,9 @@ compile_note(MML_Compiler *c, int note)
     if (c->octave_last != octave) {
         emit_octave(c, octave);
     }
-    uint8_t onpu = make_note_header(c, tone, len96, tie);
-    emit_byte(c, onpu);
-
-    /* L / L+ と一致しないときだけ長さバイトを出す */
-    if (len96 != c->l_len96 && len96 != c->lp_len96) {
-        if (len96 <= 255) {
-            /* 音長1バイト */
-            emit_byte(c, (uint8_t)len96);
-        } else {
-            /* 音長2バイト */
-            emit_word_le(c, (uint16_t)len96);
-        }
-    }
+    if (c->optimize && merge_note(c, tone, len96, tie))
+        return;
+    emit_note(c, tone, len96, tie);
 }
 
 /* コマンド処理 */
@@ -727,9 +1540,10 @@ compile_command(MML_Compiler *c, int command)
         set_octave(c, v);
 
         /* ループ先頭ではコンパイル時オクターブは確定できないので即時出力 */
-        if (c->nest_depth > 0 && !c->loops[c->nest_depth].loop_octave_emit) {
+        if (c->nest_depth > 0 &&
+          !c->loops[c->nest_depth - 1].loop_octave_emit) {
             emit_octave(c, v);
-            c->loops[c->nest_depth].loop_octave_emit = true;
+            c->loops[c->nest_depth - 1].loop_octave_emit = true;
         }
         break;
     }
@@ -811,11 +1625,17 @@ compile_command(MML_Compiler *c, int command)
         if (c->nest_depth > 0) {
             set_error(c, MML_ERR_RETURN_IN_NEST,
               "'J'コマンドはネスト中に指定できません");
-             /* 解析上はこのあとのネスト終了をパースできないので一旦リセット */
-            c->nest_depth = 0;
-           return;
+            /* ネスト状態はそのまま維持して以降のネストチェックを継続 */
+            return;
         }
         emit_byte(c, 0xFE);
+        c->jump_pos    = c->out_spilled + c->out_len - 1;
+        c->jump_nnotes = c->nnotes;
+        c->jump_ndiags = c->ndiags;
+        c->jump_line   = c->line;
+        c->jump_col    = c->col;
+        c->len_varies  = true;
+        c->gate_varies = true;
         break;
     }
     case 'L': { /* 音長設定。nは音長に準ずる (L+n の場合は L+音長設定) */
@@ -850,6 +1670,8 @@ compile_command(MML_Compiler *c, int command)
             emit_byte(c, 0xF7);           /* L+ コマンド */
         }
         emit_byte(c, (uint8_t)len96); /* パラメータは L / L+ 共通で音長 */
+        if (c->nest_depth > 0)
+            c->len_varies = true;
         break;
     }
 
@@ -946,6 +1768,9 @@ compile_command(MML_Compiler *c, int command)
         }
         emit_byte(c, 0xFA);
         emit_byte(c, (uint8_t)v);
+        c->gate = v;
+        if (c->nest_depth > 0)
+            c->gate_varies = true;
         break;
     }
     case 'S': { /* ソフトウェアエンベロープ */
@@ -1102,14 +1927,13 @@ compile_command(MML_Compiler *c, int command)
         if (c->nest_depth > 0) {
             set_error(c, MML_ERR_RETURN_IN_NEST,
               "'X'コマンドはネスト中に指定できません");
-            /* 解析上はこのあとのネスト終了をパースできないので一旦リセット */
-            c->nest_depth = 0;
+            /* ネスト状態はそのまま維持して以降のネストチェックを継続 */
             return;
         }
         emit_byte(c, 0xE9);
-        /* 残り行データをすべて読み捨てて return */
-        while ((ch = peek(c)) >= 0 && ch != '\n')
-            (void)get(c);
+        /* 残り行データをすべて読み捨てて return (マクロも展開しない) */
+        while ((ch = get(c)) >= 0 && ch != '\n')
+            /* nothing */;
         /* XXX: 当該チャンネルのコンパイル終了を呼び出し側に通知するI/Fが未 */
         break;
     }
@@ -1132,8 +1956,8 @@ compile_command(MML_Compiler *c, int command)
         if (c->nest_depth >= MML_MAX_NEST) {
             set_error(c, MML_ERR_FUNC_RANGE,
             "'['コマンドのネストが深すぎます (4段まで)");
-            /* 解析上はこのあとのネスト終了をパースできないので一旦リセット */
-            c->nest_depth = 0;
+            /* 対応する ']' を読み捨てられるように影ネストの段数だけ数える */
+            c->nest_shadow++;
             return;
         }
         emit_byte(c, 0xF0);
@@ -1148,26 +1972,46 @@ compile_command(MML_Compiler *c, int command)
         ls->saved_octave = 0;
         ls->saved_octave_last = 0;
         ls->loop_octave_emit = false;
+        ls->nnotes = c->nnotes;
+        ls->ndiags = c->ndiags;
         break;
     }
     case ']': { /* ネスト終了 */
+        if (c->nest_shadow > 0) {
+            /* 深すぎてエラーになった '[' に対応する ']' は読み捨て */
+            int dummy;
+            (void)parse_unsigned(c, &dummy);
+            c->nest_shadow--;
+            return;
+        }
         if (c->nest_depth <= 0) {
             set_error(c, MML_ERR_OUT_OF_NEST,
               "']'コマンドに対応するネスト開始'['がありません");
             return;
         }
+        /* 回数指定のエラー時も以降のネストチェックのためループは閉じる */
+        int col = c->col;
         int count;
         if (!parse_unsigned(c, &count)) {
             set_error(c, MML_ERR_FUNC_RANGE,
               "']'コマンドの数値指定がありません");
-            return;
-        }
-        if (count < 2 || count > 255) {
+            count = 2;
+        } else if (count < 2 || count > 255) {
             set_error(c, MML_ERR_FUNC_RANGE,
               "']'コマンドの値が範囲外です (2〜255)");
-            return;
+            count = 2;
         }
         MML_LoopState *ls = &c->loops[c->nest_depth - 1];
+        if (c->nest_depth - 1 < c->nest_low)
+            c->nest_low = c->nest_depth - 1;
+
+        /* 本体に音符/休符がなければドライバが割り込み内で空回りする */
+        /* (本体にエラーの文があれば連鎖的なエラーになるので報告しない) */
+        if (c->nnotes == ls->nnotes && c->ndiags == ls->ndiags) {
+            c->error_col = col;
+            set_error(c, MML_ERR_ZERO_CYCLE,
+              "ループ本体に音符・休符がないため演奏が進まなくなります");
+        }
 
         /* [ コマンドのネスト回数をここでセット */
         size_t nestnum_pos = ls->loop_start - 1;
@@ -1221,21 +2065,24 @@ compile_command(MML_Compiler *c, int command)
         break;
     }
     case ':': { /* ネスト脱出 */
+        if (c->nest_shadow > 0) {
+            /* 深すぎてエラーになったネスト内の ':' は読み捨て */
+            return;
+        }
         if (c->nest_depth <= 0) {
             set_error(c, MML_ERR_OUT_OF_NEST,
               "':'コマンドをネスト'[',']'の外で使用しています");
-            /* 解析上はこのあとのネスト終了をパースできないので一旦リセット */
-            c->nest_depth = 0;
             return;
         }
         MML_LoopState *ls = &c->loops[c->nest_depth - 1];
         if (ls->exit_mark != LOOP_NOEXIT) {
             set_error(c, MML_ERR_DUP_EXIT,
               "':'コマンドをネスト'[',']'の中で複数指定しています");
-            /* 解析上はこのあとのネスト終了をパースできないので一旦リセット */
-            c->nest_depth = 0;
+            /* 最初の ':' を有効としてネスト状態は維持 */
             return;
         }
+        if (c->nest_depth - 1 < c->nest_low)
+            c->nest_low = c->nest_depth - 1;
         emit_byte(c, 0xF3);
         emit_word_le(c, 0x0000); /* 後で ] 側で埋める */
         ls->exit_mark = c->out_len;
@@ -1246,9 +2093,9 @@ compile_command(MML_Compiler *c, int command)
         break;
     }
     case ';': { /* コメント */
-        /* 残り行データをすべて読み捨てて return */
-        while ((ch = peek(c)) >= 0 && ch != '\n')
-            (void)get(c);
+        /* 残り行データをすべて読み捨てて return (マクロも展開しない) */
+        while ((ch = get(c)) >= 0 && ch != '\n')
+            /* nothing */;
         break;
     }
     default:
@@ -28,6 +28,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 /* エラーメッセージ種別 (結局使ってない) */
 typedef enum {
@@ -40,6 +41,7 @@ typedef enum {
     MML_ERR_DUP_EXIT,
     MML_ERR_RETURN_IN_NEST,
     MML_ERR_NOTE_OVERFLOW,
+    MML_ERR_ZERO_CYCLE,
     MML_ERR_INTERNAL
 } MML_Error;
 
@@ -57,23 +59,97 @@ typedef struct {
 
     /* [] のネスト最初のオクターブがリピート時にズレることがある問題対応 */
     bool loop_octave_emit;
+    unsigned long nnotes;  /* '[' 地点までに出力した音符/休符の数 */
+    size_t ndiags;         /* '[' 地点までの診断情報の数 */
 } MML_LoopState;
 
 #define MML_MAX_NEST 4
 
+/* マクロ展開結果キャッシュ (マクロ毎に引数の組単位で保持) */
+typedef struct MML_MacroExp {
+    struct MML_MacroExp *next;
+    char *args;            /* 引数文字列 ("n1,n2" 形式, 引数なしは "") */
+    char *text;            /* $1〜$9 置換後の展開文字列 */
+    size_t len;
+} MML_MacroExp;
+
+/* マクロ定義 */
+typedef struct MML_Macro {
+    struct MML_Macro *next;
+    char *name;
+    char *body;
+    MML_MacroExp *exps;
+} MML_Macro;
+
+/* マクロ定義表 (チャンネル別および全チャンネル共通) */
+typedef struct {
+    MML_Macro *head;
+    unsigned   gen;        /* 定義変更毎に増加 (断片キャッシュ用) */
+} MML_MacroTable;
+
+/* ソースマップ: 出力オペコード位置と MML ソース上の位置の対応 (1件分) */
+typedef struct {
+    uint32_t offset;       /* チャンネル出力先頭からのオフセット */
+    int      file;         /* ファイル番号 (呼び出し側で管理) */
+    int      line;
+    int      col;          /* 行頭からの桁 (1〜) */
+} MML_SrcPos;
+
+/* マクロ展開中の入力元 (展開元の入力位置を退避) */
+#define MML_MAX_MACRO_DEPTH 8
+typedef struct {
+    const char *src;
+    size_t      pos;
+    size_t      len;
+    int         mcol;
+    const MML_Macro *macro;
+    int         use_col;     /* 行上のマクロ使用箇所 '$' の桁 */
+    int         use_end_col; /* 行上のマクロ使用箇所の直後の桁 */
+} MML_SrcFrame;
+
+/* コンパイルエラー診断情報 (1件分) */
+typedef struct {
+    MML_Error error;
+    int       line;
+    int       col;
+    char      msg[128];    /* "メッセージ (n 行目, m 桁目)" 形式 */
+} MML_Diag;
+
 typedef struct {
     /* --- 入力行情報 (各行コンパイル時に初期化) --- */
     const char *src;
     size_t      pos;
     size_t      len;
     int         line;
-    int         col;
+    int         col;          /* マクロ展開中は行上の使用箇所の桁で固定 */
+    int         col_base;     /* src の行頭からの位置 (ソースマップ用) */
+    int         file;         /* ファイル番号 (ソースマップ用) */
+
+    /* --- マクロ展開状態 --- */
+    MML_SrcFrame mframes[MML_MAX_MACRO_DEPTH];
+    int          mdepth;      /* 展開中マクロの段数 (0: 行そのものを解析中) */
+    int          mcol;        /* 展開中マクロ本体上の桁 */
+    const MML_Macro *macro;   /* 展開中マクロ */
+    const MML_Macro *last_macro; /* 直前に読み終えたマクロ (エラー位置用) */
+    int          last_mcol;
+    int          last_use_col;
+    MML_MacroTable  macros;   /* チャンネル別マクロ定義 */
+    MML_MacroTable *global_macros; /* 全チャンネル共通マクロ定義 (呼び出し側管理) */
 
     /* --- 出力オブジェクトバッファ (全行共通の追記バッファ) --- */
     uint8_t *out;
     size_t   out_len;
     size_t   out_cap;
 
+    /*
+     * --- 出力バッファ溢れ時の一時ファイル書き出し (ストリーミング用) ---
+     *  spill_fp が NULL でなければ、バッファ溢れ時に未完了ループより前の
+     *  確定済み出力を書き出して out を先頭に詰める
+     *  (未完了ループだけで溢れる場合は out を realloc() で拡張する)
+     */
+    FILE    *spill_fp;
+    size_t   out_spilled;   /* spill_fp に書き出し済みのバイト数 */
+
     /* --- チャンネル状態 (コンパイル全体で継続して保持) --- */
     int nest_depth;
     int l_len96;          /* L で指定された音長 (96分音符単位) */
@@ -84,14 +160,75 @@ typedef struct {
 
     /* --- ループ状態管理 --- */
     MML_LoopState loops[MML_MAX_NEST];
+    int nest_shadow;      /* 4段を超えた '[' の段数 (エラー回復用の影ネスト) */
+    int nest_low;         /* ':' ']' で操作した最も浅いネスト段 (断片キャッシュ用) */
 
     /* --- コンパイルエラー情報 --- */
     MML_Error error;
 #define NOERROR (-1)
     int       error_col;
     char      error_msg[128];
+
+    /* --- 診断情報リスト (全行分を蓄積; 1文につき最大1件) --- */
+    MML_Diag *diags;
+    size_t    ndiags;
+    size_t    diags_cap;
+    bool      stmt_error;   /* 解析中の文でエラー発生済み */
+    bool      out_overflow; /* 出力バッファ溢れ報告済み */
+
+    /* --- ソースマップ (srcmap_enable 時のみ記録) --- */
+    bool        srcmap_enable;
+    MML_SrcPos *srcmap;
+    size_t      nsrcmap;
+    size_t      srcmap_cap;
+
+    /*
+     * --- 最適化 (optimize 時のみ) ---
+     *  直前に出力した音符/休符の情報 (出力位置は一時ファイル書き出し分を含む)
+     *  直後に同じ音の音符が続けば 1 つの音符に結合する
+     */
+    bool   optimize;
+#define NONOTE SIZE_MAX
+    size_t note_pos;      /* 直前の音符の出力位置 (結合できなければ NONOTE) */
+    size_t note_end;      /* 直前の音符の直後の出力位置 */
+    int    note_tone;
+    int    note_len96;
+    int    note_tie;
+    bool   len_varies;    /* 'J' 以降かループ内の L / L+ 以降 (L / L+ 音長が
+                             ドライバ上の値と異なりうる) */
+    int    gate;          /* 直前の Q の値 (ゲートタイム) */
+    bool   gate_varies;   /* 'J' 以降かループ内の Q 以降 (Q がドライバ上の値と
+                             異なりうる) */
+
+    /*
+     * --- 演奏が進まない繰り返しの検出用 ---
+     *  音符/休符を含まないループ本体や 'J' 以降の区間は
+     *  ドライバが 1 回の割り込み内で空回りし続けるのでエラーにする
+     */
+    unsigned long nnotes;       /* 出力した音符/休符の数 */
+#define NOJUMP SIZE_MAX
+    size_t jump_pos;            /* 'J' の出力位置 (無ければ NOJUMP) */
+    unsigned long jump_nnotes;  /* 'J' 地点までに出力した音符/休符の数 */
+    size_t jump_ndiags;         /* 'J' 地点までの診断情報の数 */
+    int    jump_line;           /* 'J' の行と桁 (エラー表示用) */
+    int    jump_col;
 } MML_Compiler;
 
+/* インクルード断片キャッシュ用チャンネル状態 (出力位置に依存しない部分のみ) */
+typedef struct {
+    int  nest_depth;
+    int  l_len96;
+    int  lp_len96;
+    int  octave;
+    int  octave_last;
+    int  key_shift;
+    bool loop_octave_emit[MML_MAX_NEST];
+    bool len_varies;
+    int  gate;
+    bool gate_varies;
+    unsigned macro_gen;
+} MML_ChannelState;
+
 /* --- 公開API ------------------------------------------------------------- */
 /* チャンネル別データ初期化 */
 void mml_channel_init(MML_Compiler *c, uint8_t *out_buf, size_t out_size);
@@ -102,6 +239,21 @@ MML_Error mml_compile_line(MML_Compiler *c, const char *src, int line_no);
 /* チャンネル終了処理 */
 MML_Error mml_finish_channel(MML_Compiler *c);
 
+/* チャンネル別データ解放 (診断情報リスト, チャンネル別マクロ定義) */
+void mml_channel_free(MML_Compiler *c);
+
+/* マクロ定義 (同名の定義は上書き) / 定義表解放 */
+bool mml_macro_define(MML_MacroTable *t, const char *name, size_t namelen,
+    const char *body, size_t bodylen);
+void mml_macro_free(MML_MacroTable *t);
+
+/* インクルード断片キャッシュ用: 状態保存/再利用可否判定/状態復元/出力追加 */
+void mml_save_state(MML_Compiler *c, MML_ChannelState *st);
+bool mml_state_reusable(const MML_Compiler *c, const MML_ChannelState *entry);
+void mml_restore_state(MML_Compiler *c, const MML_ChannelState *st);
+MML_Error mml_append_object(MML_Compiler *c, const uint8_t *obj, size_t len,
+    const MML_SrcPos *map, size_t nmap);
+
 /* デバッグ用定義 */
 #ifdef DEBUG
 #define DPRINTF(...)	(void)fprintf(stderr, __VA_ARGS__)
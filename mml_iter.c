@@ -0,0 +1,253 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * コンパイル済みコマンド列を演奏順にたどる
+ *  ループ ([ : ]) は展開せず、MML_MAX_NEST 段の残り回数だけを状態に持つので
+ *  255 回のループが 4 段ネストしていてもメモリ使用量は変わらない
+ *  ドライバモデル (mml_player.c) と長さの計算 (-m info) で共通に使う
+ */
+
+#include "mml_iter.h"
+
+#include <string.h>
+
+static int
+iter_error(MML_Iter *it, const char *msg)
+{
+    it->error = msg;
+    return -1;
+}
+
+void
+mml_iter_init(MML_Iter *it, const uint8_t *img, size_t len, size_t pos,
+    unsigned flags)
+{
+    memset(it, 0, sizeof(*it));
+    it->img = img;
+    it->len = len;
+    it->flags = flags;
+    it->pos = pos;
+    it->jump = MML_NOPOS;
+    it->l = DRV_INIT_L;
+    it->lp = DRV_INIT_LP;
+}
+
+/* 音符/休符の音長 */
+static int
+note_len(const MML_Iter *it, const uint8_t *op)
+{
+    switch (op[0] & OP_NOTE_LEN) {
+    case NOTE_LEN_L:
+        return it->l;
+    case NOTE_LEN_LP:
+        return it->lp;
+    case NOTE_LEN_1BYTE:
+        return op[1];
+    default:
+        return op[1] | (op[2] << 8);
+    }
+}
+
+/* ループ終端/脱出の分岐 */
+static bool
+branch(MML_Iter *it, size_t pos)
+{
+    int32_t target;
+
+    (void)mml_op_branch(it->img + pos, pos, &target);
+    if (target < 0 || (size_t)target >= it->len)
+        return false;
+    it->pos = (size_t)target;
+    return true;
+}
+
+/* ループの繰り返し開始 */
+static void
+set_head(MML_Iter *it)
+{
+    MML_IterHead *h = &it->head[it->nest - 1];
+
+    h->time = it->time;
+    h->nnotes = it->nnotes;
+    h->l = it->l;
+    h->lp = it->lp;
+    h->loops = it->loops;
+}
+
+/*
+ * 残りの繰り返しの読み飛ばし
+ *  繰り返しの長さは開始時の L/L+ 音長だけで決まる (内側のループの回数は
+ *  毎回 0xF0 で設定し直される) ので、終了時の L/L+ 音長が開始時と同じなら
+ *  以降の繰り返しも同じ長さになる
+ *  0xF3 での脱出がある場合も考えて、最後の 1 回は読み飛ばさない
+ */
+static void
+skip_iterations(MML_Iter *it)
+{
+    const MML_IterHead *h = &it->head[it->nest - 1];
+    uint8_t *count = &it->count[it->nest - 1];
+
+    if (*count > 1 && h->l == it->l && h->lp == it->lp &&
+      h->loops == it->loops) {
+        it->time += (*count - 1) * (it->time - h->time);
+        it->nnotes += (*count - 1) * (it->nnotes - h->nnotes);
+        *count = 1;
+    }
+}
+
+/*
+ * 次のコマンドを処理して返す
+ *  ループ、'J' と 0xFF の分岐、L/L+ 音長の設定は処理済みの状態で返すので、
+ *  それ以外のコマンドの解釈は呼び出し側で行う
+ *  コマンドを返したら 1, 演奏終了なら 0, 不正なデータなら -1 を返す
+ *  (エラー時の pos は不正なコマンドの位置)
+ */
+int
+mml_iter_next(MML_Iter *it, MML_Event *ev)
+{
+    size_t pos = it->pos;
+
+    if (it->error != NULL)
+        return -1;
+    if (it->ended)
+        return 0;
+
+    size_t n = (pos < it->len) ? mml_op_len(it->img + pos, it->len - pos) : 0;
+    const uint8_t *op = it->img + pos;
+    if (n == 0)
+        return iter_error(it, "不正なコマンドです");
+
+    ev->pos = pos;
+    ev->op = op;
+    ev->len = 0;
+    ev->time = it->time;
+    it->pos += n;
+
+    if (op[0] < OP_OCTAVE) {
+        ev->len = note_len(it, op);
+        it->time += ev->len;
+        it->nnotes++;
+        return 1;
+    }
+
+    switch (op[0]) {
+    case OP_LOOP:
+        if (it->nest >= MML_MAX_NEST) {
+            it->pos = pos;
+            return iter_error(it, "ループのネストが深すぎます");
+        }
+        it->count[it->nest++] = op[1];
+        set_head(it);
+        break;
+    case OP_LOOP_END8:
+    case OP_LOOP_END16:
+        if (it->nest == 0) {
+            it->pos = pos;
+            return iter_error(it, "ループ外にループ終端があります");
+        }
+        if (--it->count[it->nest - 1] == 0) {
+            it->nest--;
+            break;
+        }
+        if (!branch(it, pos)) {
+            it->pos = pos;
+            return iter_error(it, "分岐先がイメージの範囲外です");
+        }
+        it->repeats++;
+        if (it->flags & MML_ITER_SKIP)
+            skip_iterations(it);
+        set_head(it);
+        break;
+    case OP_LOOP_EXIT:
+        if (it->nest == 0) {
+            it->pos = pos;
+            return iter_error(it, "ループ外にループ脱出があります");
+        }
+        if (it->count[it->nest - 1] == 1) {
+            it->nest--;
+            if (!branch(it, pos)) {
+                it->pos = pos;
+                return iter_error(it, "分岐先がイメージの範囲外です");
+            }
+        }
+        break;
+    case OP_LPLUS:
+        it->lp = op[1];
+        break;
+    case OP_L:
+        it->l = op[1];
+        break;
+    case OP_J:
+        it->jump = it->pos;
+        break;
+    case OP_END:
+        if (it->jump == MML_NOPOS) {
+            it->ended = true;
+        } else {
+            it->pos = it->jump;
+            it->loops++;
+        }
+        break;
+    }
+    return 1;
+}
+
+/*
+ * チャンネルの長さの計算
+ *  繰り返しを読み飛ばしながら最初の 0xFF までたどる
+ *  不正なデータの場合はエラー内容を返す
+ */
+const char *
+mml_iter_length(const uint8_t *img, size_t len, size_t pos,
+    MML_IterLength *res, size_t *errpos)
+{
+    MML_Iter it;
+    MML_Event ev;
+    uint64_t jtime = 0, jnotes = 0;
+    int r;
+
+    memset(res, 0, sizeof(*res));
+    mml_iter_init(&it, img, len, pos, MML_ITER_SKIP);
+    while ((r = mml_iter_next(&it, &ev)) > 0) {
+        if (ev.op[0] == OP_J) {
+            res->loop = true;
+            jtime = it.time;
+            jnotes = it.nnotes;
+        } else if (ev.op[0] == OP_END) {
+            break;
+        }
+    }
+    if (r < 0) {
+        *errpos = it.pos;
+        return it.error;
+    }
+    res->time = it.time;
+    res->nnotes = it.nnotes;
+    if (res->loop) {
+        res->loop_time = it.time - jtime;
+        res->loop_nnotes = it.nnotes - jnotes;
+    }
+    return NULL;
+}
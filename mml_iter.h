@@ -0,0 +1,99 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MML_ITER_H
+#define MML_ITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mml_binary.h"
+#include "mml_compiler.h"       /* MML_MAX_NEST */
+
+#define MML_NOPOS	SIZE_MAX
+
+/*
+ * 読み飛ばし指定
+ *  音長と音符/休符数だけが必要な場合に、長さの変わらないループの繰り返しを
+ *  コマンドを返さずにまとめて進める (最後の 1 回は通常通り返す)
+ */
+#define MML_ITER_SKIP	0x01
+
+/* 演奏順のコマンド */
+typedef struct {
+    size_t   pos;           /* コマンドの位置 (イメージ先頭から) */
+    const uint8_t *op;
+    int      len;           /* 音符/休符の音長 (それ以外は 0) */
+    uint64_t time;          /* 開始時刻 (96分音符単位) */
+} MML_Event;
+
+/* ループの繰り返し開始時の状態 */
+typedef struct {
+    uint64_t time;
+    uint64_t nnotes;
+    int      l;
+    int      lp;
+    unsigned long loops;
+} MML_IterHead;
+
+/*
+ * チャンネル 1 本のコマンド列を演奏順にたどる状態
+ *  ループは展開せず、ネスト毎の残り回数だけを持つ
+ */
+typedef struct {
+    const uint8_t *img;
+    size_t   len;
+    unsigned flags;
+    size_t   pos;           /* 次に処理するコマンドの位置 */
+    size_t   jump;          /* 'J' (0xFE) の次の位置 (無ければ MML_NOPOS) */
+    int      nest;
+    uint8_t  count[MML_MAX_NEST];   /* ループ残り回数 */
+    MML_IterHead head[MML_MAX_NEST];
+    int      l;             /* L 音長 */
+    int      lp;            /* L+ 音長 */
+    uint64_t time;          /* 処理済みの音長の合計 */
+    uint64_t nnotes;        /* 処理済みの音符/休符数 */
+    unsigned long repeats;  /* ループの先頭に戻った回数 */
+    unsigned long loops;    /* 'J' に戻った回数 */
+    bool     ended;         /* 0xFF で終了 ('J' なし) */
+    const char *error;
+} MML_Iter;
+
+/* チャンネルの長さ */
+typedef struct {
+    uint64_t time;          /* 0xFF までの音長 (96分音符単位) */
+    uint64_t nnotes;        /* 0xFF までの音符/休符数 */
+    uint64_t loop_time;     /* うち 'J' 以降 */
+    uint64_t loop_nnotes;
+    bool     loop;          /* 'J' がある */
+} MML_IterLength;
+
+void mml_iter_init(MML_Iter *it, const uint8_t *img, size_t len, size_t pos,
+    unsigned flags);
+int mml_iter_next(MML_Iter *it, MML_Event *ev);
+const char *mml_iter_length(const uint8_t *img, size_t len, size_t pos,
+    MML_IterLength *res, size_t *errpos);
+
+#endif /* MML_ITER_H */
@@ -0,0 +1,1071 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * コンパイル済みバイナリの最適化
+ *  MMLソースの無いバイナリ (オリジナルZ80版コンパイラの出力など) を
+ *  ループ構造の命令木に分解し、演奏内容を変えずにサイズを小さくして配置し直す
+ *
+ *  - 冗長なオクターブ/L/L+ コマンドの削除
+ *    (ループ構造をたどって値が確定していて同じ値を設定するもの、
+ *     参照されないまま上書きされるもの)
+ *  - L/L+ 音長の再選択 (音長を省略できる音符が増えるように設定し直す)
+ *  - 繰り返しフレーズのループへの畳み込み
+ *  ループのオフセットは配置し直した位置で全て計算し直す
+ */
+
+#include "mml_optimize.h"
+#include "mml_output.h"
+#include "mml_compiler.h"       /* MML_MAX_NEST */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#define FOLD_MAX_PHRASE	128	/* ループに畳み込むフレーズの最大命令数 */
+#define FOLD_MAX_COUNT	255	/* ループ回数の最大値 */
+
+/* 命令木のノード種別 */
+enum {
+    NODE_OP,            /* ループ以外の命令 */
+    NODE_LOOP,          /* '[' 〜 ']' (本体を子に持つ) */
+    NODE_EXIT,          /* ':' (0xF3) */
+    NODE_J              /* 'J' (0xFE) */
+};
+
+/* 値が確定していない/まだどこからも到達していない状態 */
+#define ST_UNKNOWN	(-1)
+#define ST_NONE		(-2)
+
+/* ドライバのチャンネル状態のうち最適化で追跡するもの */
+#define REG_OCTAVE	0
+#define REG_L		1
+#define REG_LP		2
+#define NREG		3
+#define REG_ALL		((1u << NREG) - 1)
+typedef struct {
+    int reg[NREG];
+} opt_state;
+
+typedef struct opt_node opt_node;
+
+typedef struct {
+    opt_node *v;
+    size_t    n;
+    size_t    cap;
+} opt_seq;
+
+struct opt_node {
+    int       kind;
+    uint8_t   op[6];
+    uint8_t   len;
+    int       count;    /* NODE_LOOP: ループ回数 */
+    opt_seq   body;     /* NODE_LOOP: ループ本体 */
+    size_t    mark;     /* NODE_EXIT: 読み込み時は飛び先、出力時は出力位置 */
+    size_t    pos;      /* 読み込み時の位置 */
+    opt_state in;       /* この命令を実行する直前の状態 */
+};
+
+/* 出力用可変長バッファ */
+typedef struct {
+    uint8_t *buf;
+    size_t   len;
+    size_t   cap;
+    bool     nomem;
+} opt_buf;
+
+/* チャンネル単位の作業情報 */
+typedef struct {
+    const uint8_t *data;
+    size_t         len;
+    size_t         pos;
+    const char    *error;
+    MML_OptResult *res;
+} opt_ctx;
+
+/* --- 命令木の操作 -------------------------------------------------------- */
+
+static void
+seq_free(opt_seq *s)
+{
+    for (size_t i = 0; i < s->n; i++) {
+        if (s->v[i].kind == NODE_LOOP)
+            seq_free(&s->v[i].body);
+    }
+    free(s->v);
+    s->v = NULL;
+    s->n = s->cap = 0;
+}
+
+static bool
+seq_push(opt_seq *s, const opt_node *node)
+{
+    if (s->n >= s->cap) {
+        size_t ncap = (s->cap == 0) ? 16 : s->cap * 2;
+        opt_node *nv = realloc(s->v, ncap * sizeof(*nv));
+        if (nv == NULL)
+            return false;
+        s->v = nv;
+        s->cap = ncap;
+    }
+    s->v[s->n++] = *node;
+    return true;
+}
+
+static bool
+is_note(const opt_node *node)
+{
+    return node->kind == NODE_OP && node->op[0] < 0x80;
+}
+
+/* 状態を設定する命令なら対象 (REG_*) を返す。値は *value */
+static int
+op_sets(const opt_node *node, int *value)
+{
+    if (node->kind != NODE_OP)
+        return -1;
+    uint8_t op = node->op[0];
+    if (op > OP_OCTAVE && op <= OP_OCTAVE + 8) {
+        *value = op - OP_OCTAVE;
+        return REG_OCTAVE;
+    }
+    if (op == OP_L) {
+        *value = node->op[1];
+        return REG_L;
+    }
+    if (op == OP_LPLUS) {
+        *value = node->op[1];
+        return REG_LP;
+    }
+    return -1;
+}
+
+/* 音符/休符が状態 r を参照するか (休符は音程を持たないのでオクターブは不要) */
+static bool
+op_reads(const opt_node *node, int r)
+{
+    if (!is_note(node))
+        return false;
+    uint8_t op = node->op[0];
+    switch (r) {
+    case REG_OCTAVE:
+        return (op & OP_NOTE_TONE) != 0;
+    case REG_L:
+        return (op & OP_NOTE_LEN) == NOTE_LEN_L;
+    case REG_LP:
+        return (op & OP_NOTE_LEN) == NOTE_LEN_LP;
+    }
+    return false;
+}
+
+/* --- 命令木の構築 -------------------------------------------------------- */
+
+static bool
+fail(opt_ctx *x, const char *msg)
+{
+    if (x->error == NULL)
+        x->error = msg;
+    return false;
+}
+
+/*
+ * ループ本体 (ネスト外ならチャンネル全体) を読み込む
+ *  start はループ本体の先頭位置で、ループ終了命令の飛び先と一致すること
+ */
+static bool
+parse_seq(opt_ctx *x, opt_seq *seq, int depth, size_t start)
+{
+    for (;;) {
+        size_t pos = x->pos;
+        const uint8_t *p = x->data + pos;
+        size_t n = mml_op_len(p, x->len - pos);
+        if (n == 0)
+            return fail(x, "不正な命令があります");
+        x->pos += n;
+
+        opt_node node;
+        memset(&node, 0, sizeof(node));
+        node.kind = NODE_OP;
+        memcpy(node.op, p, n);
+        node.len = (uint8_t)n;
+        node.pos = pos;
+
+        int32_t target;
+        switch (p[0]) {
+        case OP_END:
+            if (depth > 0)
+                return fail(x, "ループが閉じないまま終了しています");
+            return true;
+        case OP_J:
+            if (depth > 0)
+                return fail(x, "ループ内に 'J' (0xFE) があります");
+            node.kind = NODE_J;
+            break;
+        case OP_LOOP:
+            node.kind = NODE_LOOP;
+            node.count = p[1];
+            if (!parse_seq(x, &node.body, depth + 1, x->pos)) {
+                seq_free(&node.body);
+                return false;
+            }
+            /* ':' の飛び先はループ終了命令の直後 */
+            for (size_t i = 0; i < node.body.n; i++) {
+                if (node.body.v[i].kind == NODE_EXIT &&
+                  node.body.v[i].mark != x->pos) {
+                    seq_free(&node.body);
+                    return fail(x, "ループ脱出 (0xF3) の飛び先が不正です");
+                }
+            }
+            break;
+        case OP_LOOP_END8:
+        case OP_LOOP_END16:
+            if (depth == 0)
+                return fail(x, "対応するループ開始のないループ終了があります");
+            (void)mml_op_branch(p, pos, &target);
+            if (target != (int32_t)start)
+                return fail(x, "ループ終了の戻り先がループ先頭ではありません");
+            return true;
+        case OP_LOOP_EXIT:
+            if (depth == 0)
+                return fail(x, "ループ外にループ脱出 (0xF3) があります");
+            (void)mml_op_branch(p, pos, &target);
+            node.kind = NODE_EXIT;
+            node.mark = (size_t)target;
+            break;
+        }
+        if (!seq_push(seq, &node)) {
+            if (node.kind == NODE_LOOP)
+                seq_free(&node.body);
+            return fail(x, "作業領域を確保できませんでした");
+        }
+    }
+}
+
+/* --- 状態の追跡 ---------------------------------------------------------- */
+
+static int
+join1(int a, int b)
+{
+    if (a == ST_NONE)
+        return b;
+    if (b == ST_NONE || a == b)
+        return a;
+    return ST_UNKNOWN;
+}
+
+static opt_state
+st_join(opt_state a, opt_state b)
+{
+    for (int r = 0; r < NREG; r++)
+        a.reg[r] = join1(a.reg[r], b.reg[r]);
+    return a;
+}
+
+static bool
+st_equal(const opt_state *a, const opt_state *b)
+{
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+static opt_state
+st_none(void)
+{
+    opt_state st;
+    for (int r = 0; r < NREG; r++)
+        st.reg[r] = ST_NONE;
+    return st;
+}
+
+/*
+ * 命令列をたどって各命令の直前の状態を記録し、末尾の状態を返す
+ *  ループ先頭はループに入る時点と本体末尾の合流として収束するまで繰り返す
+ *  ':' の時点の状態は *exit_st に、'J' は *jump_st (曲末尾) と合流する
+ */
+static opt_state
+flow_seq(opt_seq *s, opt_state st, opt_state *exit_st,
+    const opt_state *jump_st)
+{
+    for (size_t i = 0; i < s->n; i++) {
+        opt_node *node = &s->v[i];
+        int r, v;
+
+        node->in = st;
+        switch (node->kind) {
+        case NODE_OP:
+            if ((r = op_sets(node, &v)) >= 0)
+                st.reg[r] = v;
+            break;
+        case NODE_LOOP: {
+            opt_state head = st, end, ex;
+            for (;;) {
+                ex = st_none();
+                end = flow_seq(&node->body, head, &ex, NULL);
+                opt_state nh = st_join(st, end);
+                if (st_equal(&nh, &head))
+                    break;
+                head = nh;
+            }
+            /* ':' があれば最終周はそこで抜ける */
+            st = (ex.reg[0] != ST_NONE) ? ex : end;
+            break;
+        }
+        case NODE_EXIT:
+            *exit_st = st_join(*exit_st, st);
+            break;
+        case NODE_J:
+            if (jump_st != NULL)
+                st = st_join(st, *jump_st);
+            break;
+        }
+    }
+    return st;
+}
+
+/* チャンネル全体の状態追跡 ('J' で戻る時の曲末尾の状態も収束させる) */
+static void
+flow_channel(opt_seq *top)
+{
+    opt_state init = {{ DRV_INIT_OCTAVE, DRV_INIT_L, DRV_INIT_LP }};
+    opt_state jump = st_none(), ex = st_none();
+
+    for (;;) {
+        opt_state end = flow_seq(top, init, &ex, &jump);
+        opt_state nj = st_join(jump, end);
+        if (st_equal(&nj, &jump))
+            break;
+        jump = nj;
+    }
+}
+
+/* --- 冗長な状態設定コマンドの削除 ---------------------------------------- */
+
+/*
+ * 値が確定していて同じ値を設定するもの (dead なら
+ * 参照されないまま同じ命令列内で上書きされるもの) を削除
+ *  regs は対象の状態 (REG_* のビット)
+ *  両方を同時に判定すると上書きする側も同じ値の設定と判定されうるので別々に行う
+ */
+static size_t
+drop_redundant(opt_seq *s, bool dead_store, unsigned regs)
+{
+    size_t removed = 0, k = 0;
+
+    for (size_t i = 0; i < s->n; i++) {
+        opt_node *node = &s->v[i];
+        int r, v;
+
+        if (node->kind == NODE_LOOP)
+            removed += drop_redundant(&node->body, dead_store, regs);
+        if ((r = op_sets(node, &v)) >= 0 && (regs & (1u << r)) != 0) {
+            bool dead = !dead_store && node->in.reg[r] == v;
+            for (size_t j = i + 1; dead_store && !dead && j < s->n; j++) {
+                const opt_node *next = &s->v[j];
+                int nv;
+                if (next->kind != NODE_OP || op_reads(next, r))
+                    break;
+                dead = (op_sets(next, &nv) == r);
+            }
+            if (dead) {
+                removed++;
+                continue;
+            }
+        }
+        s->v[k++] = *node;
+    }
+    s->n = k;
+    return removed;
+}
+
+/* 削除すると別の命令が冗長になることがあるので変化が無くなるまで削除 */
+static size_t
+drop_all(opt_seq *top, unsigned regs)
+{
+    size_t total = 0, removed;
+
+    do {
+        flow_channel(top);
+        removed = drop_redundant(top, false, regs);
+        removed += drop_redundant(top, true, regs);
+        total += removed;
+    } while (removed > 0);
+    return total;
+}
+
+/* --- L/L+ 音長の再選択 --------------------------------------------------- */
+
+/* 音符の音長 (不明なら -1) */
+static int
+note_length(const opt_node *node)
+{
+    switch (node->op[0] & OP_NOTE_LEN) {
+    case NOTE_LEN_1BYTE:
+        return node->op[1];
+    case NOTE_LEN_2BYTE:
+        return node->op[1] | (node->op[2] << 8);
+    case NOTE_LEN_L:
+        return node->in.reg[REG_L] >= 0 ? node->in.reg[REG_L] : -1;
+    default:
+        return node->in.reg[REG_LP] >= 0 ? node->in.reg[REG_LP] : -1;
+    }
+}
+
+/* 音長 len の音符を L/L+ が self/other のときに出力する形式で作り直す */
+static void
+encode_note(opt_node *node, int len, int r, int self, int other)
+{
+    uint8_t head = node->op[0] & (OP_NOTE_TIE | OP_NOTE_TONE);
+    uint8_t mself  = (r == REG_L) ? NOTE_LEN_L : NOTE_LEN_LP;
+    uint8_t mother = (r == REG_L) ? NOTE_LEN_LP : NOTE_LEN_L;
+
+    if (len == self) {
+        node->op[0] = head | mself;
+        node->len = 1;
+    } else if (len == other) {
+        node->op[0] = head | mother;
+        node->len = 1;
+    } else if (len <= 255) {
+        node->op[0] = head | NOTE_LEN_1BYTE;
+        node->op[1] = (uint8_t)len;
+        node->len = 2;
+    } else {
+        node->op[0] = head | NOTE_LEN_2BYTE;
+        node->op[1] = (uint8_t)(len & 0xFF);
+        node->op[2] = (uint8_t)(len >> 8);
+        node->len = 3;
+    }
+}
+
+/*
+ * 命令列 s->v[a..b) (ループ等を含まない区間) の L (または L+) の設定を選び直す
+ *  音符毎に「その時点の L の値」を状態とする動的計画法で、
+ *  区間末尾では元と同じ値になる設定コマンドの置き方のうち最小のものを選ぶ
+ *  値が不明な L を参照する音符は元の不明な値のままでしか出力できない
+ */
+static size_t
+reselect_segment(opt_seq *s, size_t a, size_t b, int r)
+{
+    int other_r = (r == REG_L) ? REG_LP : REG_L;
+    uint8_t set_op = (r == REG_L) ? OP_L : OP_LPLUS;
+
+    /* 候補の値 (最後の 1 つは不明な値) */
+    int idx[256], vals[258], nv = 0;
+    memset(idx, -1, sizeof(idx));
+    int entry = s->v[a].in.reg[r];
+    int final = entry, v;
+    size_t nnotes = 0, orig = 0;
+    for (size_t i = a; i < b; i++) {
+        const opt_node *node = &s->v[i];
+        if (op_sets(node, &v) == r) {
+            final = v;
+            orig += node->len;
+        } else if (is_note(node)) {
+            nnotes++;
+            orig += node->len;
+            int len = note_length(node);
+            if (len > 0 && len <= 255 && idx[len] < 0) {
+                idx[len] = nv;
+                vals[nv++] = len;
+            }
+        }
+    }
+    if (nnotes == 0)
+        return 0;
+    if (entry >= 0 && idx[entry] < 0) {
+        idx[entry] = nv;
+        vals[nv++] = entry;
+    }
+    if (final >= 0 && idx[final] < 0) {
+        idx[final] = nv;
+        vals[nv++] = final;
+    }
+    int unk = nv++;
+    vals[unk] = ST_UNKNOWN;
+
+    long *dp = malloc(nv * sizeof(*dp));
+    uint8_t *sw = malloc(nnotes * nv);
+    int *best = malloc(nnotes * sizeof(*best));
+    if (dp == NULL || sw == NULL || best == NULL) {
+        free(dp);
+        free(sw);
+        free(best);
+        return 0;
+    }
+    const long inf = LONG_MAX / 4;
+    for (int k = 0; k < nv; k++)
+        dp[k] = inf;
+    dp[(entry >= 0) ? idx[entry] : unk] = 0;
+
+    size_t j = 0;
+    for (size_t i = a; i < b; i++) {
+        const opt_node *node = &s->v[i];
+        if (!is_note(node))
+            continue;
+        /* この音符の前で設定し直す場合 */
+        int bk = 0;
+        for (int k = 1; k < nv; k++) {
+            if (dp[k] < dp[bk])
+                bk = k;
+        }
+        best[j] = bk;
+        for (int k = 0; k < nv; k++) {
+            sw[j * nv + k] = (k != unk && dp[bk] + 2 < dp[k]);
+            if (sw[j * nv + k])
+                dp[k] = dp[bk] + 2;
+        }
+        /* 音長の形式毎のサイズ */
+        int len = note_length(node);
+        int other = node->in.reg[other_r];
+        bool fixed_self = (node->op[0] & OP_NOTE_LEN) ==
+          ((r == REG_L) ? NOTE_LEN_L : NOTE_LEN_LP) && len < 0;
+        for (int k = 0; k < nv; k++) {
+            long cost;
+            if (fixed_self)
+                cost = (k == unk) ? 1 : inf;
+            else if (len < 0 || len == vals[k] || len == other)
+                cost = 1;
+            else
+                cost = (len <= 255) ? 2 : 3;
+            dp[k] = (dp[k] >= inf) ? inf : dp[k] + cost;
+        }
+        j++;
+    }
+
+    /* 区間末尾で元の値に戻す */
+    int fk = (final >= 0) ? idx[final] : unk;
+    int bk = 0;
+    for (int k = 1; k < nv; k++) {
+        if (dp[k] < dp[bk])
+            bk = k;
+    }
+    bool fix_end = (final >= 0 && dp[bk] + 2 < dp[fk]);
+    long total = fix_end ? dp[bk] + 2 : dp[fk];
+    if (total >= (long)orig) {
+        free(dp);
+        free(sw);
+        free(best);
+        return 0;
+    }
+
+    /* 音符毎の値をたどって区間を作り直す */
+    int *state = malloc(nnotes * sizeof(*state));
+    opt_node *nodes = malloc((b - a + nnotes + 1) * sizeof(*nodes));
+    if (state == NULL || nodes == NULL) {
+        free(state);
+        free(nodes);
+        free(dp);
+        free(sw);
+        free(best);
+        return 0;
+    }
+    int k = fix_end ? bk : fk;
+    for (size_t jj = nnotes; jj-- > 0; ) {
+        state[jj] = k;
+        if (sw[jj * nv + k])
+            k = best[jj];
+    }
+
+    size_t n = 0, renoted = 0;
+    int cur = (entry >= 0) ? idx[entry] : unk;
+    j = 0;
+    for (size_t i = a; i < b; i++) {
+        opt_node node = s->v[i];
+        if (op_sets(&node, &v) == r)
+            continue;
+        if (is_note(&node)) {
+            if (state[j] != cur) {
+                cur = state[j];
+                opt_node set = node;
+                set.op[0] = set_op;
+                set.op[1] = (uint8_t)vals[cur];
+                set.len = 2;
+                nodes[n++] = set;
+            }
+            int len = note_length(&node);
+            if (len >= 0) {
+                uint8_t op0 = node.op[0];
+                encode_note(&node, len, r, vals[cur], node.in.reg[other_r]);
+                if (node.op[0] != op0)
+                    renoted++;
+            }
+            j++;
+        }
+        nodes[n++] = node;
+    }
+    if (fix_end) {
+        opt_node set = s->v[b - 1];
+        set.kind = NODE_OP;
+        set.op[0] = set_op;
+        set.op[1] = (uint8_t)final;
+        set.len = 2;
+        nodes[n++] = set;
+    }
+
+    /* 区間の命令数が変わるので後ろをずらして置き換える */
+    size_t nn = s->n - (b - a) + n;
+    if (nn > s->cap) {
+        opt_node *nvp = realloc(s->v, nn * sizeof(*nvp));
+        if (nvp == NULL) {
+            renoted = 0;
+            goto out;
+        }
+        s->v = nvp;
+        s->cap = nn;
+    }
+    memmove(&s->v[a + n], &s->v[b], (s->n - b) * sizeof(s->v[0]));
+    memcpy(&s->v[a], nodes, n * sizeof(nodes[0]));
+    s->n = nn;
+ out:
+    free(state);
+    free(nodes);
+    free(dp);
+    free(sw);
+    free(best);
+    return renoted;
+}
+
+/* ループ等で区切られた区間毎に L (または L+) を選び直す */
+static size_t
+reselect_seq(opt_seq *s, int r)
+{
+    size_t renoted = 0;
+
+    for (size_t i = 0; i < s->n; ) {
+        if (s->v[i].kind == NODE_LOOP)
+            renoted += reselect_seq(&s->v[i].body, r);
+        if (s->v[i].kind != NODE_OP) {
+            i++;
+            continue;
+        }
+        size_t b = i;
+        while (b < s->n && s->v[b].kind == NODE_OP)
+            b++;
+        size_t n = s->n;
+        renoted += reselect_segment(s, i, b, r);
+        i = b + s->n - n;
+    }
+    return renoted;
+}
+
+/* --- 出力 ---------------------------------------------------------------- */
+
+static void
+put_bytes(opt_buf *b, const uint8_t *p, size_t n)
+{
+    if (b->len + n > b->cap) {
+        size_t ncap = (b->cap == 0) ? 256 : b->cap;
+        while (b->len + n > ncap)
+            ncap *= 2;
+        uint8_t *nbuf = realloc(b->buf, ncap);
+        if (nbuf == NULL) {
+            b->nomem = true;
+            return;
+        }
+        b->buf = nbuf;
+        b->cap = ncap;
+    }
+    memcpy(b->buf + b->len, p, n);
+    b->len += n;
+}
+
+/* 命令列を出力してループのオフセットを計算する */
+static void
+put_seq(opt_buf *b, opt_seq *s)
+{
+    for (size_t i = 0; i < s->n && !b->nomem; i++) {
+        opt_node *node = &s->v[i];
+        uint8_t op[3];
+
+        switch (node->kind) {
+        case NODE_OP:
+            put_bytes(b, node->op, node->len);
+            break;
+        case NODE_J:
+            op[0] = OP_J;
+            put_bytes(b, op, 1);
+            break;
+        case NODE_EXIT:
+            node->mark = b->len;
+            op[0] = OP_LOOP_EXIT;
+            op[1] = op[2] = 0x00;   /* ループ終了後に埋める */
+            put_bytes(b, op, 3);
+            break;
+        case NODE_LOOP: {
+            op[0] = OP_LOOP;
+            op[1] = (uint8_t)node->count;
+            put_bytes(b, op, 2);
+            size_t start = b->len;
+            put_seq(b, &node->body);
+            /* オフセットの計算はコンパイラの ']' と同じ */
+            int32_t offset = (int32_t)start - (int32_t)(b->len + 3);
+            if (offset >= -256 && offset <= -1) {
+                op[0] = OP_LOOP_END8;
+                op[1] = (uint8_t)((offset + 1) & 0xFF);
+                put_bytes(b, op, 2);
+            } else {
+                op[0] = OP_LOOP_END16;
+                op[1] = (uint8_t)(offset & 0xFF);
+                op[2] = (uint8_t)((offset >> 8) & 0xFF);
+                put_bytes(b, op, 3);
+            }
+            if (b->nomem)
+                break;
+            for (size_t j = 0; j < node->body.n; j++) {
+                opt_node *ex = &node->body.v[j];
+                if (ex->kind != NODE_EXIT)
+                    continue;
+                uint16_t off = (uint16_t)(b->len - (ex->mark + 3));
+                b->buf[ex->mark + 1] = (uint8_t)(off & 0xFF);
+                b->buf[ex->mark + 2] = (uint8_t)(off >> 8);
+            }
+            break;
+        }
+        }
+    }
+}
+
+/* --- 繰り返しフレーズの畳み込み ------------------------------------------ */
+
+/* 命令毎の出力バイト列と畳み込みの判定用情報 */
+typedef struct {
+    uint8_t *bytes;
+    size_t   len;
+    int      depth;     /* 含まれるループのネスト段数 */
+    bool     note;      /* 音符/休符を含む */
+    bool     barrier;   /* ':' 'J' はフレーズに含められない */
+} fold_item;
+
+static bool
+fold_item_init(fold_item *it, opt_node *node)
+{
+    opt_buf b = { NULL, 0, 0, false };
+    opt_seq one = { node, 1, 1 };
+
+    put_seq(&b, &one);
+    if (b.nomem) {
+        free(b.buf);
+        return false;
+    }
+    it->bytes = b.buf;
+    it->len = b.len;
+    it->barrier = (node->kind == NODE_EXIT || node->kind == NODE_J);
+    it->note = is_note(node);
+    it->depth = 0;
+    if (node->kind == NODE_LOOP) {
+        /* 本体は出力済みのバイト列から判定する */
+        int depth = 0, maxdepth = 0;
+        for (size_t pos = 0; pos < b.len; ) {
+            uint8_t op = b.buf[pos];
+            if (op < 0x80)
+                it->note = true;
+            else if (op == OP_LOOP && ++depth > maxdepth)
+                maxdepth = depth;
+            else if (op == OP_LOOP_END8 || op == OP_LOOP_END16)
+                depth--;
+            pos += mml_op_len(b.buf + pos, b.len - pos);
+        }
+        it->depth = maxdepth;
+    }
+    return true;
+}
+
+static bool
+fold_equal(const fold_item *x, const fold_item *y)
+{
+    return x->len == y->len && memcmp(x->bytes, y->bytes, x->len) == 0;
+}
+
+/*
+ * 同じ命令列が続く部分をループ ('[' 〜 ']') に置き換える
+ *  depth は s を囲むループのネスト段数で、ネスト 4 段を超えないようにする
+ */
+static size_t
+fold_seq(opt_seq *s, int depth)
+{
+    size_t folded = 0;
+
+    for (size_t i = 0; i < s->n; i++) {
+        if (s->v[i].kind == NODE_LOOP)
+            folded += fold_seq(&s->v[i].body, depth + 1);
+    }
+    if (s->n < 2)
+        return folded;
+
+    fold_item *items = calloc(s->n, sizeof(*items));
+    if (items == NULL)
+        return folded;
+    for (size_t i = 0; i < s->n; i++) {
+        if (!fold_item_init(&items[i], &s->v[i]))
+            goto out;
+    }
+
+    for (size_t i = 0; i + 1 < s->n; i++) {
+        size_t bestp = 0, bestk = 0;
+        long bestsave = 0;
+        for (size_t p = 1; p <= FOLD_MAX_PHRASE && i + 2 * p <= s->n; p++) {
+            const fold_item *it = &items[i + p - 1];
+            if (it->barrier)
+                break;
+            size_t blen = 0;
+            int maxdepth = 0;
+            bool note = false;
+            for (size_t q = i; q < i + p; q++) {
+                blen += items[q].len;
+                note |= items[q].note;
+                if (items[q].depth > maxdepth)
+                    maxdepth = items[q].depth;
+            }
+            if (!note || depth + 1 + maxdepth > MML_MAX_NEST)
+                continue;
+            size_t k = 1;
+            while (k < FOLD_MAX_COUNT && i + (k + 1) * p <= s->n) {
+                size_t q;
+                for (q = 0; q < p; q++) {
+                    if (!fold_equal(&items[i + q], &items[i + k * p + q]))
+                        break;
+                }
+                if (q < p)
+                    break;
+                k++;
+            }
+            if (k < 2)
+                continue;
+            /* '[' 2 バイトとループ終了 2 (または 3) バイトが増える */
+            long over = 2 + ((blen + 3 <= 256) ? 2 : 3);
+            long save = (long)((k - 1) * blen) - over;
+            if (save > bestsave) {
+                bestsave = save;
+                bestp = p;
+                bestk = k;
+            }
+        }
+        if (bestsave <= 0)
+            continue;
+
+        /* i から bestp 命令を本体とするループに置き換え、残りの繰り返しは削除 */
+        opt_node loop;
+        memset(&loop, 0, sizeof(loop));
+        loop.kind = NODE_LOOP;
+        loop.count = (int)bestk;
+        loop.body.v = malloc(bestp * sizeof(opt_node));
+        if (loop.body.v == NULL)
+            break;
+        memcpy(loop.body.v, &s->v[i], bestp * sizeof(opt_node));
+        loop.body.n = loop.body.cap = bestp;
+        size_t end = i + bestk * bestp;
+        for (size_t q = i + bestp; q < end; q++) {
+            if (s->v[q].kind == NODE_LOOP)
+                seq_free(&s->v[q].body);
+        }
+        for (size_t q = i; q < end; q++)
+            free(items[q].bytes);
+        s->v[i] = loop;
+        memmove(&s->v[i + 1], &s->v[end], (s->n - end) * sizeof(s->v[0]));
+        memmove(&items[i + 1], &items[end], (s->n - end) * sizeof(items[0]));
+        s->n -= end - (i + 1);
+        folded++;
+
+        /* 本体の中の繰り返しも畳み込む */
+        folded += fold_seq(&s->v[i].body, depth + 1);
+        if (!fold_item_init(&items[i], &s->v[i])) {
+            items[i].bytes = NULL;
+            break;
+        }
+    }
+ out:
+    for (size_t i = 0; i < s->n; i++)
+        free(items[i].bytes);
+    free(items);
+    return folded;
+}
+
+/* --- チャンネル単位の最適化 ---------------------------------------------- */
+
+static bool
+optimize_channel(opt_ctx *x, size_t start, opt_buf *out)
+{
+    opt_seq top = { NULL, 0, 0 };
+
+    x->pos = start;
+    if (!parse_seq(x, &top, 0, start)) {
+        seq_free(&top);
+        return false;
+    }
+
+    x->res->removed += drop_all(&top, REG_ALL);
+
+    flow_channel(&top);
+    x->res->renoted += reselect_seq(&top, REG_L);
+    flow_channel(&top);
+    x->res->renoted += reselect_seq(&top, REG_LP);
+
+    x->res->folded += fold_seq(&top, 0);
+
+    put_seq(out, &top);
+    uint8_t end = OP_END;
+    put_bytes(out, &end, 1);
+    seq_free(&top);
+    if (out->nomem)
+        return fail(x, "作業領域を確保できませんでした");
+    return true;
+}
+
+/* 命令木に残ったオクターブコマンドの位置に印を付ける */
+static void
+mark_octaves(const opt_seq *s, bool *kept)
+{
+    for (size_t i = 0; i < s->n; i++) {
+        const opt_node *node = &s->v[i];
+        int v;
+
+        if (node->kind == NODE_LOOP)
+            mark_octaves(&node->body, kept);
+        else if (op_sets(node, &v) == REG_OCTAVE)
+            kept[node->pos] = true;
+    }
+}
+
+/*
+ * 1 チャンネル分のデータ data (len バイト、先頭から 0xFF まで) のうち
+ * 削除しても演奏が変わらないオクターブコマンドの位置を昇順に *pos に返す
+ *  (*pos は呼び出し側で free する)
+ *  ループや 'J' で合流する全ての経路で同じ値に確定しているものと、
+ *  参照されないまま上書きされるもの
+ *  失敗時はエラー内容を返す
+ */
+const char *
+mml_redundant_octaves(const uint8_t *data, size_t len, size_t **pos,
+    size_t *npos)
+{
+    opt_ctx x = { data, len, 0, NULL, NULL };
+    opt_seq top = { NULL, 0, 0 };
+    bool *kept = NULL;
+
+    *pos = NULL;
+    *npos = 0;
+    if (!parse_seq(&x, &top, 0, 0))
+        goto out;
+    if (drop_all(&top, 1u << REG_OCTAVE) == 0)
+        goto out;
+    kept = calloc(x.pos, sizeof(*kept));
+    *pos = malloc(x.pos * sizeof(**pos));
+    if (kept == NULL || *pos == NULL) {
+        fail(&x, "作業領域を確保できませんでした");
+        goto out;
+    }
+    mark_octaves(&top, kept);
+    for (size_t q = 0; q < x.pos; q += mml_op_len(data + q, len - q)) {
+        if (data[q] > OP_OCTAVE && data[q] <= OP_OCTAVE + 8 && !kept[q])
+            (*pos)[(*npos)++] = q;
+    }
+ out:
+    if (x.error != NULL) {
+        free(*pos);
+        *pos = NULL;
+        *npos = 0;
+    }
+    free(kept);
+    seq_free(&top);
+    return x.error;
+}
+
+/*
+ * 1 曲分のコンパイル済みイメージ img (ベースアドレス baseaddr) を最適化して
+ * 配置し直したイメージを返す (呼び出し側で free する)
+ *  一致するチャンネルデータは共有する
+ *  失敗時は NULL を返し res->error にエラー内容を設定する
+ */
+uint8_t *
+mml_optimize_image(const uint8_t *img, size_t len, int baseaddr,
+    size_t *outlen, MML_OptResult *res)
+{
+    static const uint16_t ch_offset[PSG_NCH] = {
+        CH1_ADDR_OFFSET, CH2_ADDR_OFFSET, CH3_ADDR_OFFSET
+    };
+    size_t start[PSG_NCH], end[PSG_NCH];
+    opt_buf ch[PSG_NCH];
+    uint8_t *out = NULL;
+
+    memset(res, 0, sizeof(*res));
+    res->error_ch = -1;
+    memset(ch, 0, sizeof(ch));
+
+    int e = mml_image_channels(img, len, baseaddr, 1, 0, start, end);
+    if (e < 0) {
+        res->error_ch = -e - 1;
+        res->error = "チャンネル先頭アドレスかチャンネルのデータが不正です";
+        return NULL;
+    }
+    for (int i = 0; i < PSG_NCH; i++) {
+        opt_ctx x = { img, len, 0, NULL, res };
+        if (!optimize_channel(&x, start[i], &ch[i])) {
+            res->error_ch = i;
+            res->error = x.error;
+            goto out;
+        }
+    }
+
+    /* 一致するチャンネルは共有して配置 */
+    const uint8_t *data[PSG_NCH];
+    size_t chlen[PSG_NCH], offset[PSG_NCH];
+    int host[PSG_NCH];
+    for (int i = 0; i < PSG_NCH; i++) {
+        data[i] = ch[i].buf;
+        chlen[i] = ch[i].len;
+    }
+    mml_share_suffixes(data, chlen, PSG_NCH, host);
+
+    size_t layout = MML_TABLE_LEN(1);
+    for (int i = 0; i < PSG_NCH; i++) {
+        if (host[i] >= 0)
+            continue;
+        offset[i] = layout;
+        layout += chlen[i];
+    }
+    if (baseaddr + layout > 0x10000) {
+        res->error = "最適化結果がアドレス空間に収まりません";
+        goto out;
+    }
+    out = calloc(1, layout);
+    if (out == NULL) {
+        res->error = "出力イメージを確保できませんでした";
+        goto out;
+    }
+    for (int i = 0; i < PSG_NCH; i++) {
+        if (host[i] >= 0) {
+            offset[i] = offset[host[i]] + chlen[host[i]] - chlen[i];
+            continue;
+        }
+        memcpy(out + offset[i], data[i], chlen[i]);
+    }
+    for (int i = 0; i < PSG_NCH; i++) {
+        uint16_t addr = (uint16_t)(baseaddr + offset[i]);
+        out[ch_offset[i]] = (uint8_t)(addr & 0xFF);
+        out[ch_offset[i] + 1] = (uint8_t)(addr >> 8);
+    }
+    *outlen = layout;
+ out:
+    for (int i = 0; i < PSG_NCH; i++)
+        free(ch[i].buf);
+    return out;
+}
@@ -0,0 +1,47 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MML_OPTIMIZE_H
+#define MML_OPTIMIZE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mml_binary.h"
+
+/* コンパイル済みバイナリ最適化の結果 */
+typedef struct {
+    size_t removed;     /* 削除した冗長なオクターブ/L/L+ コマンド数 */
+    size_t renoted;     /* L/L+ の再選択で音長の形式を変えた音符数 */
+    size_t folded;      /* ループにまとめたフレーズ数 */
+    int    error_ch;    /* エラーのあったチャンネル (0〜, 無ければ -1) */
+    const char *error;  /* エラー内容 (成功時は NULL) */
+} MML_OptResult;
+
+uint8_t *mml_optimize_image(const uint8_t *img, size_t len, int baseaddr,
+    size_t *outlen, MML_OptResult *res);
+const char *mml_redundant_octaves(const uint8_t *data, size_t len,
+    size_t **pos, size_t *npos);
+
+#endif /* MML_OPTIMIZE_H */
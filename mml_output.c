@@ -0,0 +1,413 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * コンパイル結果イメージの各種フォーマット出力
+ *  Intel HEX, C 言語配列, Z80 アセンブラ DB ソース, 差分パッチ
+ */
+
+#include "mml_output.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define IHEX_RECLEN	16	/* Intel HEX 1 レコードのデータ長 */
+#define CARRAY_COLS	12	/* C 言語配列 1 行のバイト数 */
+#define ASM_COLS	16	/* 命令に分解できないデータの DB 1 行のバイト数 */
+#define PATCH_HDR_LEN	4	/* 差分パッチ 1 レコードのヘッダ長 */
+#define PATCH_COLS	16	/* 差分パッチ一覧 1 行のバイト数 */
+
+static const char ch_name[PSG_NCH] = { 'D', 'E', 'F' };
+
+/*
+ * チャンネルデータの共有 (レイアウト最適化)
+ *  n 個のチャンネルデータ data[i] (長さ len[i]) について、
+ *  他のチャンネルと一致するか、その末尾部分と一致するものを探し、
+ *  共有先のチャンネル番号を host[i] に返す (共有しない場合は -1)
+ *
+ *  ループのオフセットは全て相対値でチャンネル内で閉じているので、
+ *  末尾が一致すればチャンネル先頭アドレスをそこに向けるだけで同じ演奏になる
+ *  共有先は一致するもののうち最長 (同じ長さなら番号の小さいもの) を選ぶので、
+ *  共有先自身が他のチャンネルを共有していることはない
+ *  data[i] が NULL のチャンネルは対象外
+ */
+void
+mml_share_suffixes(const uint8_t *const *data, const size_t *len, int n,
+    int *host)
+{
+    for (int i = 0; i < n; i++) {
+        host[i] = -1;
+        if (data[i] == NULL)
+            continue;
+        for (int j = 0; j < n; j++) {
+            if (j == i || data[j] == NULL || len[j] < len[i])
+                continue;
+            if (len[j] == len[i] && j > i)
+                continue;       /* 同じ長さなら先の方を残す */
+            if (host[i] >= 0 && (len[j] < len[host[i]] ||
+              (len[j] == len[host[i]] && j > host[i])))
+                continue;
+            if (memcmp(data[j] + len[j] - len[i], data[i], len[i]) == 0)
+                host[i] = j;
+        }
+    }
+}
+
+/* Intel HEX 1 レコード出力 */
+static void
+put_ihex_record(FILE *fp, uint16_t addr, uint8_t type, const uint8_t *data,
+    size_t n)
+{
+    uint8_t sum = (uint8_t)(n + (addr >> 8) + (addr & 0xFF) + type);
+
+    fprintf(fp, ":%02X%04X%02X", (unsigned)n, addr, type);
+    for (size_t i = 0; i < n; i++) {
+        fprintf(fp, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf(fp, "%02X\n", (uint8_t)-sum);
+}
+
+/* Intel HEX 出力; アドレスはベースアドレスからの配置 */
+bool
+mml_write_ihex(FILE *fp, const uint8_t *img, size_t len, int baseaddr)
+{
+    for (size_t pos = 0; pos < len; pos += IHEX_RECLEN) {
+        size_t n = len - pos;
+        if (n > IHEX_RECLEN)
+            n = IHEX_RECLEN;
+        put_ihex_record(fp, (uint16_t)(baseaddr + pos), 0x00, img + pos, n);
+    }
+    put_ihex_record(fp, 0, 0x01, NULL, 0);      /* End Of File レコード */
+    return !ferror(fp);
+}
+
+/* C 言語の配列定義出力 */
+bool
+mml_write_carray(FILE *fp, const uint8_t *img, size_t len, int baseaddr,
+    const char *sym)
+{
+    fprintf(fp, "/* PSG data: base address 0x%04X, %zu bytes */\n",
+      baseaddr, len);
+    fprintf(fp, "const unsigned char %s[%zu] = {\n", sym, len);
+    for (size_t pos = 0; pos < len; pos++) {
+        if (pos % CARRAY_COLS == 0)
+            fputc('\t', fp);
+        fprintf(fp, "0x%02x,", img[pos]);
+        if (pos % CARRAY_COLS == CARRAY_COLS - 1 || pos == len - 1)
+            fputc('\n', fp);
+        else
+            fputc(' ', fp);
+    }
+    fputs("};\n", fp);
+    return !ferror(fp);
+}
+
+/* アセンブラ用 16 進数表記 (先頭が数字になるよう 0 を付ける) */
+static void
+put_asm_hex(FILE *fp, unsigned v, int digits)
+{
+    if (((v >> ((digits - 1) * 4)) & 0xF) >= 0xA)
+        fputc('0', fp);
+    fprintf(fp, "%0*XH", digits, v);
+}
+
+/* 位置 pos に付けるラベル名出力 */
+static void
+put_asm_label(FILE *fp, const char *sym, const int *label, size_t pos)
+{
+    fprintf(fp, "%s_L%d", sym, label[pos]);
+}
+
+/* チャンネル先頭ラベル名出力 (バンクモードでは曲番号付き) */
+static void
+put_asm_chlabel(FILE *fp, const char *sym, int nsongs, int song, int ch)
+{
+    if (nsongs > 0)
+        fprintf(fp, "%s_%d_%c", sym, song, ch_name[ch]);
+    else
+        fprintf(fp, "%s_%c", sym, ch_name[ch]);
+}
+
+/*
+ * Z80 アセンブラ DB ソース出力
+ *  各チャンネル先頭とループの飛び先 (']' の戻り先、':' の脱出先) に
+ *  ラベルを付け、命令単位で 1 行ずつ DB 行を出力する
+ *  nsongs はバンクモードの曲数 (0 なら 1 曲のみの通常のイメージ)
+ */
+bool
+mml_write_asm(FILE *fp, const uint8_t *img, size_t len, int baseaddr,
+    int nsongs, const char *sym)
+{
+    int ntable = (nsongs > 0) ? nsongs : 1;
+    size_t (*start)[PSG_NCH] = calloc(ntable, sizeof(*start));
+    size_t (*end)[PSG_NCH] = calloc(ntable, sizeof(*end));
+    uint8_t *oplen = calloc(len + 1, 1);    /* 命令先頭なら命令長 */
+    int *label = calloc(len + 1, sizeof(int));
+    bool ok = false;
+
+    if (start == NULL || end == NULL || oplen == NULL || label == NULL)
+        goto out;
+
+    bool valid = true;
+    for (int s = 0; s < ntable; s++) {
+        if (mml_image_channels(img, len, baseaddr, ntable, s,
+          start[s], end[s]) != 0)
+            valid = false;
+    }
+
+    /* 命令境界とループの飛び先を求める */
+    for (int s = 0; valid && s < ntable; s++) {
+        for (int i = 0; i < PSG_NCH; i++) {
+            for (size_t pos = start[s][i]; pos < end[s][i];
+              pos += oplen[pos]) {
+                oplen[pos] = (uint8_t)mml_op_len(img + pos, end[s][i] - pos);
+                int32_t target;
+                if (mml_op_branch(img + pos, pos, &target) &&
+                  target >= 0 && target < (int32_t)len)
+                    label[target] = -1;
+            }
+        }
+    }
+    /* ラベル番号はアドレス順に振る */
+    int nlabel = 0;
+    for (size_t pos = 0; pos < len; pos++) {
+        if (label[pos] != 0)
+            label[pos] = ++nlabel;
+    }
+
+    fprintf(fp, "; PSG data: base address 0x%04X, %zu bytes\n", baseaddr, len);
+    fputs("\tORG\t", fp);
+    put_asm_hex(fp, baseaddr, 4);
+    fprintf(fp, "\n%s:\n", sym);
+    if (valid) {
+        for (int s = 0; s < ntable; s++) {
+            fputs("\tDW\t", fp);
+            for (int i = 0; i < PSG_NCH; i++) {
+                if (i > 0)
+                    fputc(',', fp);
+                put_asm_chlabel(fp, sym, nsongs, s, i);
+            }
+            fputc('\n', fp);
+        }
+        fputs("\tDW\t0\n", fp);
+    }
+
+    size_t pos = valid ? MML_TABLE_LEN(ntable) : 0;
+    while (pos < len) {
+        for (int s = 0; valid && s < ntable; s++) {
+            for (int i = 0; i < PSG_NCH; i++) {
+                if (start[s][i] == pos) {
+                    put_asm_chlabel(fp, sym, nsongs, s, i);
+                    fputs(":\n", fp);
+                }
+            }
+        }
+        if (label[pos] != 0) {
+            put_asm_label(fp, sym, label, pos);
+            fputs(":\n", fp);
+        }
+
+        /* 命令単位、命令に分解できない部分は次の命令かラベルまで */
+        size_t n = oplen[pos];
+        if (n == 0) {
+            while (pos + n < len && n < ASM_COLS &&
+              oplen[pos + n] == 0 && (n == 0 || label[pos + n] == 0))
+                n++;
+        }
+        fputs("\tDB\t", fp);
+        for (size_t j = 0; j < n; j++) {
+            if (j > 0)
+                fputc(',', fp);
+            put_asm_hex(fp, img[pos + j], 2);
+        }
+
+        int32_t target;
+        if (oplen[pos] != 0 && mml_op_branch(img + pos, pos, &target) &&
+          target >= 0 && target < (int32_t)len) {
+            fprintf(fp, "\t; %c ", img[pos] == OP_LOOP_EXIT ? ':' : ']');
+            put_asm_label(fp, sym, label, target);
+        } else if (oplen[pos] != 0 && img[pos] == OP_LOOP) {
+            fprintf(fp, "\t; [ %d", img[pos + 1]);
+        }
+        fputc('\n', fp);
+        pos += n;
+    }
+    ok = !ferror(fp);
+
+ out:
+    free(start);
+    free(end);
+    free(oplen);
+    free(label);
+    return ok;
+}
+
+/*
+ * 差分パッチの次の書き換え範囲を探す
+ *  old (長さ oldlen) を img (長さ len) に更新するために書き換える範囲を
+ *  *start 以降から探して [*start, *end) に返す (無ければ false)
+ *  間の一致部分がレコードのヘッダ長以下なら、レコードを分けるより
+ *  続けて書き換える方が小さいのでまとめる
+ *  img が短くなった分は読まれないのでそのままにする
+ */
+bool
+mml_patch_range(const uint8_t *old, size_t oldlen, const uint8_t *img,
+    size_t len, size_t *start, size_t *end)
+{
+    size_t pos = *start;
+
+    while (pos < len && pos < oldlen && old[pos] == img[pos])
+        pos++;
+    if (pos >= len)
+        return false;
+
+    size_t e = pos + 1;
+    size_t same = 0;
+    for (size_t i = pos + 1; i < len && i - pos < 0xFFFF; i++) {
+        if (i < oldlen && old[i] == img[i]) {
+            if (++same > PATCH_HDR_LEN)
+                break;
+        } else {
+            same = 0;
+            e = i + 1;
+        }
+    }
+    *start = pos;
+    *end = e;
+    return true;
+}
+
+/*
+ * 差分パッチ (バイナリ) 作成
+ *  レコード: 長さ (2 バイト), 書き込み先アドレス (2 バイト), データ
+ *  長さ 0 のレコードで終わる (ワードは全てリトルエンディアン)
+ *  メモリを確保できなければ NULL を返す
+ */
+uint8_t *
+mml_make_patch(const uint8_t *old, size_t oldlen, const uint8_t *img,
+    size_t len, int baseaddr, size_t *patchlen)
+{
+    size_t start, end, n = 2;
+
+    for (start = 0; mml_patch_range(old, oldlen, img, len, &start, &end);
+      start = end)
+        n += PATCH_HDR_LEN + (end - start);
+
+    uint8_t *patch = malloc(n);
+    if (patch == NULL)
+        return NULL;
+    uint8_t *p = patch;
+    for (start = 0; mml_patch_range(old, oldlen, img, len, &start, &end);
+      start = end) {
+        size_t addr = baseaddr + start;
+        p[0] = (uint8_t)((end - start) & 0xFF);
+        p[1] = (uint8_t)((end - start) >> 8);
+        p[2] = (uint8_t)(addr & 0xFF);
+        p[3] = (uint8_t)(addr >> 8);
+        memcpy(p + PATCH_HDR_LEN, img + start, end - start);
+        p += PATCH_HDR_LEN + (end - start);
+    }
+    p[0] = 0;
+    p[1] = 0;
+    *patchlen = n;
+    return patch;
+}
+
+/*
+ * 差分パッチ一覧 (テキスト) 出力
+ *  "アドレス: バイト列" 形式で 1 行 16 バイトまで
+ *  (デバッガやモニタのメモリ書き込みコマンドに変換しやすいように)
+ */
+bool
+mml_write_patch_list(FILE *fp, const uint8_t *old, size_t oldlen,
+    const uint8_t *img, size_t len, int baseaddr)
+{
+    size_t start, end;
+
+    for (start = 0; mml_patch_range(old, oldlen, img, len, &start, &end);
+      start = end) {
+        for (size_t pos = start; pos < end; pos++) {
+            if ((pos - start) % PATCH_COLS == 0)
+                fprintf(fp, "%04zX:", baseaddr + pos);
+            fprintf(fp, " %02X", img[pos]);
+            if ((pos - start) % PATCH_COLS == PATCH_COLS - 1 || pos == end - 1)
+                fputc('\n', fp);
+        }
+    }
+    return !ferror(fp);
+}
+
+/* リトルエンディアンのワード出力 (WAV ヘッダ用) */
+static void
+put_le(uint8_t *p, uint32_t v, int n)
+{
+    for (int k = 0; k < n; k++)
+        p[k] = (uint8_t)(v >> (k * 8));
+}
+
+/*
+ * WAV (RIFF) ヘッダ出力
+ *  16bit モノラル PCM で nsamples サンプル分
+ *  (長さが不明な場合は MML_WAV_UNKNOWN を指定すると最大長にする)
+ */
+bool
+mml_write_wav_header(FILE *fp, unsigned rate, uint32_t nsamples)
+{
+    uint8_t hdr[WAV_HDR_LEN];
+    uint32_t datalen = (nsamples == MML_WAV_UNKNOWN) ?
+      MML_WAV_UNKNOWN - WAV_HDR_LEN : nsamples * 2;
+
+    memcpy(hdr, "RIFF", 4);
+    put_le(hdr + 4, datalen + WAV_HDR_LEN - 8, 4);
+    memcpy(hdr + 8, "WAVEfmt ", 8);
+    put_le(hdr + 16, 16, 4);            /* fmt チャンクの長さ */
+    put_le(hdr + 20, 1, 2);             /* PCM */
+    put_le(hdr + 22, 1, 2);             /* モノラル */
+    put_le(hdr + 24, rate, 4);
+    put_le(hdr + 28, rate * 2, 4);      /* 1 秒あたりのバイト数 */
+    put_le(hdr + 32, 2, 2);             /* 1 サンプルのバイト数 */
+    put_le(hdr + 34, 16, 2);            /* 量子化ビット数 */
+    memcpy(hdr + 36, "data", 4);
+    put_le(hdr + 40, datalen, 4);
+    return fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr);
+}
+
+/* 16bit PCM のサンプル列をリトルエンディアンで出力 */
+bool
+mml_write_pcm(FILE *fp, const int16_t *buf, size_t n)
+{
+    uint8_t out[512];
+
+    while (n > 0) {
+        size_t m = (n < sizeof(out) / 2) ? n : sizeof(out) / 2;
+        for (size_t k = 0; k < m; k++)
+            put_le(out + k * 2, (uint16_t)buf[k], 2);
+        if (fwrite(out, 2, m, fp) != m)
+            return false;
+        buf += m;
+        n -= m;
+    }
+    return true;
+}
@@ -0,0 +1,55 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MML_OUTPUT_H
+#define MML_OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "mml_binary.h"
+
+/* WAV 出力 */
+#define WAV_HDR_LEN	44
+#define MML_WAV_UNKNOWN	0xFFFFFFFFU	/* 長さが不明 (ストリーミング時) */
+
+void mml_share_suffixes(const uint8_t *const *data, const size_t *len, int n,
+    int *host);
+bool mml_write_ihex(FILE *fp, const uint8_t *img, size_t len, int baseaddr);
+bool mml_write_carray(FILE *fp, const uint8_t *img, size_t len, int baseaddr,
+    const char *sym);
+bool mml_write_asm(FILE *fp, const uint8_t *img, size_t len, int baseaddr,
+    int nsongs, const char *sym);
+bool mml_patch_range(const uint8_t *old, size_t oldlen, const uint8_t *img,
+    size_t len, size_t *start, size_t *end);
+uint8_t *mml_make_patch(const uint8_t *old, size_t oldlen, const uint8_t *img,
+    size_t len, int baseaddr, size_t *patchlen);
+bool mml_write_patch_list(FILE *fp, const uint8_t *old, size_t oldlen,
+    const uint8_t *img, size_t len, int baseaddr);
+bool mml_write_wav_header(FILE *fp, unsigned rate, uint32_t nsamples);
+bool mml_write_pcm(FILE *fp, const int16_t *buf, size_t n);
+
+#endif /* MML_OUTPUT_H */
@@ -0,0 +1,365 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 音源ドライバの C 言語によるモデル
+ *  コンパイル済みイメージを割り込み単位で解釈して PSG レジスタの状態を求める
+ *  実機のドライバのコードそのものではないので、テンポ、エンベロープ、
+ *  ビブラートなどの細部は実機と一致しない (実機との確認は -m z80 で行う)
+ *  最適化の有無で演奏内容が変わらないことの確認など、
+ *  モデル同士の比較に使う (各コマンドの解釈は README 参照)
+ */
+
+#include "mml_player.h"
+
+#include <string.h>
+
+/* PSG のレジスタ */
+#define PSG_REG_TONE(ch)	((ch) * 2)
+#define PSG_REG_NOISE		6
+#define PSG_REG_MIXER		7
+#define PSG_REG_VOLUME(ch)	(8 + (ch))
+
+#define PSG_MAX_PERIOD		0x0FFF
+#define PSG_MAX_VOLUME		15
+#define PSG_MAX_NOISE		31
+
+/* 音量の初期値 */
+#define INIT_VOLUME		15
+
+/* O1 の C〜B のトーン周期 (PSG クロック / (16 × 周波数)) */
+static const uint16_t tone_period[12] = {
+    3816, 3602, 3400, 3209, 3029, 2859, 2698, 2547, 2404, 2269, 2142, 2022
+};
+
+static int
+clamp(int v, int min, int max)
+{
+    return (v < min) ? min : (v > max) ? max : v;
+}
+
+static bool
+player_error(MML_Player *p, int i, const char *msg)
+{
+    p->error_ch = i;
+    p->error = msg;
+    return false;
+}
+
+void
+mml_player_init(MML_Player *p, const uint8_t *img, size_t len,
+    const size_t start[PSG_NCH])
+{
+    memset(p, 0, sizeof(*p));
+    p->img = img;
+    p->len = len;
+    p->tempo = MML_PLAYER_TEMPO;
+    p->error_ch = -1;
+    for (int i = 0; i < PSG_NCH; i++) {
+        MML_PlayerChannel *ch = &p->ch[i];
+        mml_iter_init(&ch->it, img, len, start[i], 0);
+        ch->note = MML_NOPOS;
+        ch->octave = DRV_INIT_OCTAVE;
+        ch->volume = INIT_VOLUME;
+        ch->mode = 1;
+        ch->vib_dir = 1;
+        /* トーンのみ有効 */
+        p->reg[PSG_REG_MIXER] |= 0x08 << i;
+    }
+}
+
+/* 音符/休符の開始 */
+static bool
+start_note(MML_Player *p, int i, const MML_Event *ev)
+{
+    MML_PlayerChannel *ch = &p->ch[i];
+    int tone = ev->op[0] & OP_NOTE_TONE;
+
+    if (tone > 12)
+        return player_error(p, i, "不正な音符です");
+
+    /* タイでつながった音符は発音し直さない (エンベロープ等も継続) */
+    bool legato = ch->tie && ch->tone != 0 && tone != 0;
+    ch->note = ev->pos;
+    ch->tone = tone;
+    ch->tie = (ev->op[0] & OP_NOTE_TIE) != 0;
+    ch->remain += ev->len << 8;
+    if (tone == 0) {
+        ch->keyon = false;
+        ch->level = 0;
+        return true;
+    }
+    ch->keyon = true;
+    if (legato)
+        return true;
+    ch->level = ch->volume;
+    ch->env_timer = 0;
+    ch->env_step = 0;
+    ch->vib_timer = 0;
+    ch->vib_step = 0;
+    ch->vib_dir = 1;
+    ch->vib_offset = 0;
+    return true;
+}
+
+/* 残り音長がなくなったチャンネルの次の音符/休符までのコマンド処理 */
+static bool
+step_channel(MML_Player *p, int i)
+{
+    MML_PlayerChannel *ch = &p->ch[i];
+    long nops = 0;
+
+    /* ループ、'J' と L/L+ 音長はコマンド列をたどる側で処理済み */
+    while (ch->remain <= 0 && !ch->it.ended) {
+        MML_Event ev;
+
+        if (++nops > MML_PLAYER_MAX_OPS)
+            return player_error(p, i, "1 回の割り込み内で演奏が進みません");
+        if (mml_iter_next(&ch->it, &ev) < 0)
+            return player_error(p, i, ch->it.error);
+
+        const uint8_t *op = ev.op;
+        if (op[0] < OP_OCTAVE) {
+            if (!start_note(p, i, &ev))
+                return false;
+            continue;
+        }
+        switch (op[0] & 0xF0) {
+        case OP_OCTAVE:
+            ch->octave = op[0] - OP_OCTAVE;
+            continue;
+        case OP_VOLUME:
+            ch->volume = op[0] & 0x0F;
+            continue;
+        case OP_VOLUME_DOWN:
+            ch->volume = clamp(ch->volume - (op[0] & 0x0F), 0, PSG_MAX_VOLUME);
+            continue;
+        case OP_VOLUME_UP:
+            ch->volume = clamp(ch->volume + (op[0] & 0x0F), 0, PSG_MAX_VOLUME);
+            continue;
+        }
+
+        switch (op[0]) {
+        case OP_ENVELOPE:
+            ch->env[0] = op[1];
+            if (op[1] != 0)
+                memcpy(&ch->env[1], &op[2], 4);
+            break;
+        case OP_NOISE_FREQ:
+            p->noise = op[1] & PSG_MAX_NOISE;
+            break;
+        case OP_NOISE_REL:
+            p->noise = clamp(p->noise + (int8_t)op[1], 0, PSG_MAX_NOISE);
+            break;
+        case OP_NOISE_MODE1:
+        case OP_NOISE_MODE2:
+        case OP_NOISE_MODE3:
+            ch->mode = op[0] - OP_NOISE_MODE1 + 1;
+            break;
+        case OP_VIBRATO:
+            memcpy(ch->vib, &op[1], 4);
+            ch->vib_on = true;
+            break;
+        case OP_VIBRATO_SW:
+            ch->vib_on = !ch->vib_on;
+            break;
+        case OP_TEMPO:
+            /* T n1,n2: 割り込み 1 回で 96分音符 n1 / (n2 + 1) 個分進む */
+            p->tempo = (uint16_t)((op[1] << 8) / (op[2] + 1));
+            if (p->tempo == 0)
+                p->tempo = 1;
+            break;
+        case OP_Q:
+            ch->q = op[1];
+            break;
+        case OP_DETUNE:
+            ch->detune = (int8_t)op[1];
+            break;
+        case OP_DETUNE_REL:
+            ch->detune += (int8_t)op[1];
+            break;
+        case OP_VIBRATO_DEPTH:
+            ch->vib[3] = op[1];
+            break;
+        case OP_END:
+            ch->note = ev.pos;
+            if (ch->it.ended) {
+                ch->keyon = false;
+                ch->tone = 0;
+                ch->level = 0;
+            }
+            break;
+        default:
+            /* X (0xE9), I (0xF4) は PSG に影響しない */
+            break;
+        }
+    }
+    return true;
+}
+
+/* ゲートタイム、エンベロープ、ビブラートの割り込み毎の処理 */
+static void
+update_channel(MML_PlayerChannel *ch)
+{
+    if (ch->tone == 0)
+        return;
+
+    /* タイでつながらない音符は残り音長が Q 以下で消音 (リリース) */
+    if (ch->keyon && !ch->tie && ch->q > 0 && ch->remain <= ch->q << 8) {
+        ch->keyon = false;
+        ch->env_timer = 0;
+        if (ch->env[0] == 0 || (int8_t)ch->env[4] >= 0)
+            ch->level = 0;
+    }
+
+    if (ch->env[0] == 0) {
+        /* エンベロープなしは音量変更がそのまま反映される */
+        if (ch->keyon)
+            ch->level = ch->volume;
+    } else if ((ch->keyon || ch->level > 0) && ++ch->env_timer >= ch->env[0]) {
+        /* n1 回毎に n2 回まで n3、以降 n4、消音後は n5 ずつ変化 */
+        int delta;
+        ch->env_timer = 0;
+        if (!ch->keyon) {
+            delta = (int8_t)ch->env[4];
+        } else if (ch->env_step < ch->env[1]) {
+            delta = (int8_t)ch->env[2];
+            ch->env_step++;
+        } else {
+            delta = (int8_t)ch->env[3];
+        }
+        ch->level = clamp(ch->level + delta, 0, PSG_MAX_VOLUME);
+    }
+
+    /* n1 回待ってから n2 回毎に n4 ずつ、n3 回毎に向きを変えて周期を変化 */
+    if (ch->keyon && ch->vib_on && ch->vib[2] != 0) {
+        int speed = (ch->vib[1] == 0) ? 1 : ch->vib[1];
+        if (ch->vib_timer < ch->vib[0]) {
+            ch->vib_timer++;
+        } else if ((ch->vib_timer++ - ch->vib[0]) % speed == 0) {
+            ch->vib_offset += ch->vib_dir * (int8_t)ch->vib[3];
+            ch->vib_step++;
+            /* 最初だけ半分で折り返して中心の前後に振る */
+            if ((ch->vib_step + ch->vib[2] / 2) % ch->vib[2] == 0)
+                ch->vib_dir = -ch->vib_dir;
+        }
+    }
+}
+
+static void
+set_reg(MML_Player *p, int r, uint8_t v)
+{
+    if (p->reg[r] != v) {
+        p->reg[r] = v;
+        p->dirty |= 1U << r;
+    }
+}
+
+/*
+ * 割り込み 1 回分の処理
+ *  D, E, F チャンネルの順にコマンドを処理して PSG レジスタの状態を更新する
+ *  不正なデータで演奏を続けられない場合は false を返す
+ */
+bool
+mml_player_tick(MML_Player *p)
+{
+    uint8_t mixer = 0;
+
+    if (p->error != NULL)
+        return false;
+    p->dirty = 0;
+    for (int i = 0; i < PSG_NCH; i++) {
+        MML_PlayerChannel *ch = &p->ch[i];
+        if (!step_channel(p, i))
+            return false;
+        update_channel(ch);
+        if (!ch->it.ended)
+            ch->remain -= p->tempo;
+    }
+
+    for (int i = 0; i < PSG_NCH; i++) {
+        MML_PlayerChannel *ch = &p->ch[i];
+        if (ch->tone != 0) {
+            /* デチューン、ビブラートは周期から減算 (正で音程が上がる) */
+            int period = tone_period[ch->tone - 1] >> (ch->octave - 1);
+            period -= ch->detune;
+            if (ch->keyon)
+                period -= ch->vib_offset;
+            period = clamp(period, 1, PSG_MAX_PERIOD);
+            set_reg(p, PSG_REG_TONE(i), period & 0xFF);
+            set_reg(p, PSG_REG_TONE(i) + 1, period >> 8);
+        }
+        set_reg(p, PSG_REG_VOLUME(i), ch->level);
+        if ((ch->mode & 1) == 0)
+            mixer |= 0x01 << i;
+        if ((ch->mode & 2) == 0)
+            mixer |= 0x08 << i;
+    }
+    set_reg(p, PSG_REG_NOISE, p->noise);
+    set_reg(p, PSG_REG_MIXER, mixer);
+    p->tick++;
+    return true;
+}
+
+/* 全チャンネルが 0xFF で終了した ('J' のあるチャンネルは終了しない) */
+bool
+mml_player_ended(const MML_Player *p)
+{
+    for (int i = 0; i < PSG_NCH; i++) {
+        if (!p->ch[i].it.ended)
+            return false;
+    }
+    return true;
+}
+
+/* 全チャンネルが終了したか、'J' の位置に 1 度戻った */
+bool
+mml_player_done(const MML_Player *p)
+{
+    for (int i = 0; i < PSG_NCH; i++) {
+        if (!p->ch[i].it.ended && p->ch[i].it.loops == 0)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * レジスタに対応するチャンネル (ノイズ周期など共通のものは -1)
+ *  ミキサーは diff で値の変わったビットのチャンネルを返す
+ */
+int
+mml_player_reg_channel(int reg, uint8_t diff)
+{
+    if (reg < PSG_REG_NOISE)
+        return reg / 2;
+    if (reg >= PSG_REG_VOLUME(0) && reg < PSG_REG_VOLUME(PSG_NCH))
+        return reg - PSG_REG_VOLUME(0);
+    if (reg == PSG_REG_MIXER) {
+        for (int i = 0; i < PSG_NCH; i++) {
+            if (diff & (0x09 << i))
+                return i;
+        }
+    }
+    return -1;
+}
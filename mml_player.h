@@ -0,0 +1,95 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MML_PLAYER_H
+#define MML_PLAYER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mml_binary.h"
+#include "mml_iter.h"
+
+/*
+ * ドライバモデルの前提
+ *  割り込み周期、PSG クロック (PC-6001: 3.9936MHz / 2) とテンポ初期値
+ */
+#define MML_PLAYER_HZ		60
+#define MML_PSG_CLOCK		1996800
+#define MML_PLAYER_TEMPO	0x100	/* 割り込み 1 回で 96分音符 1 個分 */
+
+/* 1 回の割り込みでチャンネル毎に処理するコマンド数の上限 (空回り検出用) */
+#define MML_PLAYER_MAX_OPS	65536
+
+/* ドライバモデルのチャンネル状態 */
+typedef struct {
+    MML_Iter it;            /* 演奏位置、ループ残り回数、L/L+ 音長 */
+    size_t   note;          /* 演奏中の音符/休符の位置 (無ければ MML_NOPOS) */
+
+    int      octave;
+    int      volume;
+    int      q;             /* ゲートタイム */
+    int      detune;
+    int      mode;          /* ノイズモード (bit0: トーン, bit1: ノイズ) */
+    uint8_t  env[5];        /* ソフトウェアエンベロープ (env[0] == 0 で OFF) */
+    uint8_t  vib[4];        /* ビブラート */
+    bool     vib_on;
+
+    /* 発音状態 */
+    int      tone;          /* 0: 休符 */
+    bool     tie;           /* 次の音符とタイでつながる */
+    bool     keyon;
+    int32_t  remain;        /* 残り音長 (96分音符単位の 1/256) */
+    int      level;         /* エンベロープ適用後の音量 */
+    int      env_timer;
+    int      env_step;
+    int      vib_timer;
+    int      vib_step;
+    int      vib_dir;
+    int      vib_offset;
+} MML_PlayerChannel;
+
+/* ドライバモデルの演奏状態 */
+typedef struct {
+    const uint8_t *img;
+    size_t   len;
+    MML_PlayerChannel ch[PSG_NCH];
+    uint16_t tempo;         /* 割り込み 1 回で進む音長 (96分音符単位の 1/256) */
+    int      noise;
+    uint8_t  reg[PSG_NREGS];
+    uint16_t dirty;         /* 直前の割り込みで値が変わったレジスタ */
+    unsigned long tick;
+    int      error_ch;
+    const char *error;
+} MML_Player;
+
+void mml_player_init(MML_Player *p, const uint8_t *img, size_t len,
+    const size_t start[PSG_NCH]);
+bool mml_player_tick(MML_Player *p);
+bool mml_player_done(const MML_Player *p);
+bool mml_player_ended(const MML_Player *p);
+int mml_player_reg_channel(int reg, uint8_t diff);
+
+#endif /* MML_PLAYER_H */
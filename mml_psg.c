@@ -0,0 +1,409 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * PSG (AY-3-8910) の音声合成
+ *  トーン、ノイズの発振器はチップと同じクロック / 16 の周期で進める
+ *  出力のサンプリング周波数へは以下のいずれかで変換する
+ *  - 帯域制限ステップ: 出力レベルが変わる時点だけを求め、その時刻 (サンプルの
+ *    端数まで) に帯域制限した段差を置く。折り返し雑音が出ず、処理量は変化の
+ *    回数に比例する (出力は MML_PSG_TAPS / 2 - 1 サンプル遅れる)
+ *  - オーバーサンプリング: 発振器を 1 周期毎に進めて出力 1 サンプル分の平均を取る
+ *  (ドライバが使用しないハードウェアエンベロープは再現しない)
+ */
+
+#include "mml_psg.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#define PSG_REG_NOISE		6
+#define PSG_REG_MIXER		7
+#define PSG_REG_VOLUME(ch)	(8 + (ch))
+
+/* 音量 0〜15 の出力レベル (3 チャンネルの合計が 16bit に収まる値) */
+static const int16_t psg_level[16] = {
+        0,   150,   224,   318,   462,   675,   925,  1495,
+     1847,  2891,  3852,  4914,  6230,  7507,  9264, 10922
+};
+
+/*
+ * 帯域制限ステップの係数
+ *  変化点のサンプル内の位置を BLEP_PHASES 段階に分けて、それぞれ
+ *  Blackman 窓をかけた sinc 関数 (遮断周波数はサンプリング周波数の BLEP_CUTOFF 倍)
+ *  の値を合計が 1 << BLEP_SHIFT になるよう整数化しておく
+ *  (積算した出力が変化後のレベルに正確に一致する)
+ */
+#define BLEP_PHASES	32
+#define BLEP_SHIFT	15
+#define BLEP_CUTOFF	0.45
+#define BLEP_PI		3.14159265358979323846
+
+static int32_t blep_kernel[BLEP_PHASES + 1][MML_PSG_TAPS];
+static bool blep_ready;
+
+static void
+blep_init(void)
+{
+    if (blep_ready)
+        return;
+    for (int p = 0; p <= BLEP_PHASES; p++) {
+        double h[MML_PSG_TAPS], sum = 0;
+        int32_t total = 0;
+        int peak = 0;
+        for (int k = 0; k < MML_PSG_TAPS; k++) {
+            /* 変化点からの距離 (サンプル数) */
+            double x = k - (MML_PSG_TAPS / 2 - 1) - (double)p / BLEP_PHASES;
+            double a = 2 * BLEP_PI * BLEP_CUTOFF * x;
+            double w = 2 * BLEP_PI * (x + MML_PSG_TAPS / 2) / MML_PSG_TAPS;
+            h[k] = (x == 0 ? 1 : sin(a) / a) *
+              (0.42 - 0.5 * cos(w) + 0.08 * cos(2 * w));
+            sum += h[k];
+        }
+        for (int k = 0; k < MML_PSG_TAPS; k++) {
+            blep_kernel[p][k] = (int32_t)lround(h[k] / sum * (1 << BLEP_SHIFT));
+            total += blep_kernel[p][k];
+            if (h[k] > h[peak])
+                peak = k;
+        }
+        blep_kernel[p][peak] += (1 << BLEP_SHIFT) - total;
+    }
+    blep_ready = true;
+}
+
+void
+mml_psg_init(MML_Psg *psg, unsigned long clock, unsigned rate, int synth)
+{
+    memset(psg, 0, sizeof(*psg));
+    psg->clock = clock;
+    psg->rate = rate;
+    psg->synth = synth;
+    psg->lfsr = 1;
+    psg->reg[PSG_REG_MIXER] = 0x3F;
+    psg->chmask = (1U << PSG_NCH) - 1;
+    if (synth == MML_PSG_BLEP)
+        blep_init();
+}
+
+void
+mml_psg_write(MML_Psg *psg, int reg, uint8_t value)
+{
+    psg->reg[reg & (PSG_NREGS - 1)] = value;
+}
+
+/* トーンの出力が反転するまでの周期数 */
+static unsigned
+tone_steps(const MML_Psg *psg, int i)
+{
+    unsigned tp = psg->reg[i * 2] | ((psg->reg[i * 2 + 1] & 0x0F) << 8);
+
+    if (tp == 0)
+        tp = 1;
+    return (psg->tone_count[i] + 1 >= tp) ? 1 : tp - psg->tone_count[i];
+}
+
+/* ノイズの LFSR が進むまでの周期数 (ノイズ周期の 2 倍毎) */
+static unsigned
+noise_steps(const MML_Psg *psg)
+{
+    unsigned np = (psg->reg[PSG_REG_NOISE] & 0x1F) * 2;
+
+    if (np == 0)
+        np = 2;
+    return (psg->noise_count + 1 >= np) ? 1 : np - psg->noise_count;
+}
+
+/* 発振器をクロック / 16 の n 周期分進める */
+static void
+psg_advance(MML_Psg *psg, unsigned n)
+{
+    unsigned s = noise_steps(psg);
+
+    if (n >= s) {
+        /* 最初に s 周期、以降はノイズ周期の 2 倍毎に 17bit の LFSR を進める */
+        unsigned np = (psg->reg[PSG_REG_NOISE] & 0x1F) * 2;
+        if (np == 0)
+            np = 2;
+        for (unsigned k = (n - s) / np + 1; k > 0; k--) {
+            uint32_t bit = (psg->lfsr ^ (psg->lfsr >> 3)) & 1;
+            psg->lfsr = (psg->lfsr >> 1) | (bit << 16);
+        }
+        psg->noise_count = (n - s) % np;
+        psg->noise_out = psg->lfsr & 1;
+    } else {
+        psg->noise_count += n;
+    }
+    for (int i = 0; i < PSG_NCH; i++) {
+        s = tone_steps(psg, i);
+        if (n >= s) {
+            unsigned tp = psg->reg[i * 2] | ((psg->reg[i * 2 + 1] & 0x0F) << 8);
+            if (tp == 0)
+                tp = 1;
+            psg->tone_out[i] ^= ((n - s) / tp + 1) & 1;
+            psg->tone_count[i] = (n - s) % tp;
+        } else {
+            psg->tone_count[i] += n;
+        }
+    }
+}
+
+/* 出力レベルの合計 */
+static int
+psg_output(const MML_Psg *psg)
+{
+    const uint8_t *reg = psg->reg;
+    int out = 0;
+
+    for (int i = 0; i < PSG_NCH; i++) {
+        if ((psg->chmask & (1U << i)) == 0)
+            continue;
+        /* ミキサーで無効にした発振器は常に 1 として扱う */
+        int tone = psg->tone_out[i] | ((reg[PSG_REG_MIXER] >> i) & 1);
+        int noise = psg->noise_out | ((reg[PSG_REG_MIXER] >> (i + 3)) & 1);
+        if (tone & noise)
+            out += psg_level[reg[PSG_REG_VOLUME(i)] & 0x0F];
+    }
+    return out;
+}
+
+/* オーバーサンプリングによる n サンプル分の出力 */
+static void
+oversample_render(MML_Psg *psg, int16_t *buf, size_t n)
+{
+    unsigned long step = psg->clock / 16;
+
+    for (size_t k = 0; k < n; k++) {
+        long sum = 0;
+        int nsteps = 0;
+        psg->acc += step;
+        while (psg->acc >= psg->rate) {
+            psg->acc -= psg->rate;
+            psg_advance(psg, 1);
+            sum += psg_output(psg);
+            nsteps++;
+        }
+        /* 発振器より高いサンプリング周波数では直前の値を保持 */
+        if (nsteps > 0)
+            psg->last = (int16_t)(sum / nsteps);
+        buf[k] = psg->last;
+    }
+}
+
+/*
+ * 時刻 t (サンプル数のクロック / 16 倍) に出力レベル level への段差を置く
+ *  時刻を整数で扱うので、同じ状態から合成すれば常に同じ出力になる
+ */
+static void
+blep_step(MML_Psg *psg, unsigned long long t, int level)
+{
+    int d = level - psg->level;
+
+    if (d == 0)
+        return;
+    psg->level = level;
+
+    unsigned long div = psg->clock / 16;
+    size_t idx = (size_t)(t / div);
+    const int32_t *kernel =
+      blep_kernel[(t % div * BLEP_PHASES + div / 2) / div];
+    int64_t *dp = &psg->delta[idx];
+    for (int k = 0; k < MML_PSG_TAPS; k++)
+        dp[k] += (int64_t)d * kernel[k];
+}
+
+/* n サンプル分で進める周期数 (時刻 next + j * rate が n サンプル未満の j の数) */
+static unsigned
+blep_steps(const MML_Psg *psg, size_t n)
+{
+    unsigned long long end = (unsigned long long)n * (psg->clock / 16);
+
+    if (psg->next >= end)
+        return 0;
+    return (unsigned)((end - psg->next + psg->rate - 1) / psg->rate);
+}
+
+/* 時刻を n サンプル分進めてバッファ先頭からの時刻にする */
+static void
+blep_advance_time(MML_Psg *psg, unsigned steps, size_t n)
+{
+    psg->next = (unsigned long)(psg->next +
+      (unsigned long long)steps * psg->rate -
+      (unsigned long long)n * (psg->clock / 16));
+}
+
+/*
+ * 帯域制限ステップによる n (MML_PSG_BLOCK 以下) サンプル分の出力
+ *  出力は 1 << BLEP_SHIFT 倍の固定小数点で、変化点の時刻はバッファ先頭からの
+ *  発振器の周期数だけから求めるので、チャンネル毎に合成した出力の合計は
+ *  全チャンネルまとめて合成した出力と一致する
+ */
+static void
+blep_render(MML_Psg *psg, int32_t *out, size_t n)
+{
+    unsigned steps = blep_steps(psg, n);
+    unsigned j = 0;
+
+    /* レジスタの変更はバッファの先頭で反映 */
+    blep_step(psg, 0, psg_output(psg));
+
+    /*
+     * 出力に影響する発振器のうち次に変化するものまでまとめて進める
+     *  (ミキサーで無効か音量 0 のチャンネルや合成しないチャンネルの
+     *  発振器は影響しない)
+     */
+    for (;;) {
+        const uint8_t *reg = psg->reg;
+        unsigned m = UINT_MAX;
+        for (int i = 0; i < PSG_NCH; i++) {
+            if ((psg->chmask & (1U << i)) == 0 ||
+              (reg[PSG_REG_VOLUME(i)] & 0x0F) == 0)
+                continue;
+            if ((reg[PSG_REG_MIXER] & (0x01 << i)) == 0) {
+                unsigned s = tone_steps(psg, i);
+                if (s < m)
+                    m = s;
+            }
+            if ((reg[PSG_REG_MIXER] & (0x08 << i)) == 0) {
+                unsigned s = noise_steps(psg);
+                if (s < m)
+                    m = s;
+            }
+        }
+        if (m > steps - j)
+            break;
+        psg_advance(psg, m);
+        j += m;
+        blep_step(psg,
+          psg->next + (unsigned long long)(j - 1) * psg->rate,
+          psg_output(psg));
+    }
+    /* バッファの終わりまでの変化しない分 */
+    if (steps > j)
+        psg_advance(psg, steps - j);
+    blep_advance_time(psg, steps, n);
+
+    for (size_t k = 0; k < n; k++) {
+        psg->integ += psg->delta[k];
+        out[k] = (int32_t)psg->integ;
+    }
+    memmove(psg->delta, psg->delta + n, MML_PSG_TAPS * sizeof(psg->delta[0]));
+    memset(psg->delta + MML_PSG_TAPS, 0, n * sizeof(psg->delta[0]));
+}
+
+/* n サンプル分 (モノラル) の出力 */
+void
+mml_psg_render(MML_Psg *psg, int16_t *buf, size_t n)
+{
+    int32_t fixed[MML_PSG_BLOCK];
+    const int32_t *in[1] = { fixed };
+
+    if (psg->synth == MML_PSG_OVERSAMPLE) {
+        oversample_render(psg, buf, n);
+        return;
+    }
+    while (n > 0) {
+        size_t m = (n < MML_PSG_BLOCK) ? n : MML_PSG_BLOCK;
+        blep_render(psg, fixed, m);
+        mml_psg_mix(buf, in, 1, m);
+        buf += m;
+        n -= m;
+    }
+}
+
+/*
+ * 帯域制限ステップで n サンプル分を固定小数点のまま出力
+ *  チャンネル毎に合成した出力を mml_psg_mix() でまとめる
+ */
+void
+mml_psg_render_fixed(MML_Psg *psg, int32_t *buf, size_t n)
+{
+    while (n > 0) {
+        size_t m = (n < MML_PSG_BLOCK) ? n : MML_PSG_BLOCK;
+        blep_render(psg, buf, m);
+        buf += m;
+        n -= m;
+    }
+}
+
+/* mml_psg_render_fixed() の nin 個の出力を合計して 16bit に丸める */
+void
+mml_psg_mix(int16_t *buf, const int32_t *const in[], int nin, size_t n)
+{
+    for (size_t k = 0; k < n; k++) {
+        int64_t v = 1 << (BLEP_SHIFT - 1);
+        for (int i = 0; i < nin; i++)
+            v += in[i][k];
+        v >>= BLEP_SHIFT;
+        buf[k] = (int16_t)(v > INT16_MAX ? INT16_MAX :
+          v < INT16_MIN ? INT16_MIN : v);
+    }
+}
+
+/*
+ * n サンプル分の合成を省略して、発振器と時刻だけを mml_psg_render() と
+ * 同じだけ進める
+ *  出力段の状態 (直前の出力、帯域制限ステップの積算) は変えない
+ */
+void
+mml_psg_skip(MML_Psg *psg, size_t n)
+{
+    if (psg->synth == MML_PSG_OVERSAMPLE) {
+        unsigned long long acc = psg->acc +
+          (unsigned long long)n * (psg->clock / 16);
+        psg_advance(psg, (unsigned)(acc / psg->rate));
+        psg->acc = (unsigned long)(acc % psg->rate);
+        return;
+    }
+    while (n > 0) {
+        size_t m = (n < MML_PSG_BLOCK) ? n : MML_PSG_BLOCK;
+        unsigned steps = blep_steps(psg, m);
+        psg_advance(psg, steps);
+        blep_advance_time(psg, steps, m);
+        n -= m;
+    }
+}
+
+/*
+ * 今のレジスタの値で出力に影響する発振器
+ *  (ミキサーで有効で音量が 0 でない、合成するチャンネルのトーンとノイズ)
+ */
+unsigned
+mml_psg_uses(const MML_Psg *psg)
+{
+    const uint8_t *reg = psg->reg;
+    unsigned uses = 0;
+
+    for (int i = 0; i < PSG_NCH; i++) {
+        if ((psg->chmask & (1U << i)) == 0 ||
+          (reg[PSG_REG_VOLUME(i)] & 0x0F) == 0)
+            continue;
+        if ((reg[PSG_REG_MIXER] & (0x01 << i)) == 0)
+            uses |= 1U << i;
+        if ((reg[PSG_REG_MIXER] & (0x08 << i)) == 0)
+            uses |= MML_PSG_USES_NOISE;
+    }
+    return uses;
+}
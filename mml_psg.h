@@ -0,0 +1,78 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MML_PSG_H
+#define MML_PSG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mml_binary.h"
+
+/* 音声合成の方式 */
+#define MML_PSG_BLEP		0	/* 帯域制限ステップ (変化点だけ処理) */
+#define MML_PSG_OVERSAMPLE	1	/* クロック / 16 毎に処理して平均 */
+
+/* 帯域制限ステップのタップ数と 1 回に合成するサンプル数 */
+#define MML_PSG_TAPS		16
+#define MML_PSG_BLOCK		1024
+
+/* PSG (AY-3-8910) の音声合成の状態 */
+typedef struct {
+    unsigned long clock;    /* PSG クロック (Hz) */
+    unsigned rate;          /* 出力サンプリング周波数 (Hz) */
+    int      synth;         /* MML_PSG_BLEP / MML_PSG_OVERSAMPLE */
+    unsigned chmask;        /* 合成するチャンネル (ビット毎) */
+    uint8_t  reg[PSG_NREGS];
+
+    /* トーン、ノイズの発振器 (クロック / 16 毎に進む) */
+    unsigned tone_count[PSG_NCH];
+    int      tone_out[PSG_NCH];
+    unsigned noise_count;
+    int      noise_out;
+    uint32_t lfsr;
+    unsigned long acc;      /* 出力 1 サンプル分の発振器の進み (端数) */
+    int16_t  last;          /* 直前の出力 */
+
+    /* 帯域制限ステップ */
+    unsigned long next;     /* 次に発振器が進む時刻 (バッファ先頭からの
+                               サンプル数のクロック / 16 倍) */
+    int      level;         /* 発振器の出力レベルの合計 */
+    int64_t  integ;         /* 出力 (変化量の積算) */
+    int64_t  delta[MML_PSG_BLOCK + MML_PSG_TAPS];   /* サンプル毎の変化量 */
+} MML_Psg;
+
+void mml_psg_init(MML_Psg *psg, unsigned long clock, unsigned rate,
+    int synth);
+void mml_psg_write(MML_Psg *psg, int reg, uint8_t value);
+void mml_psg_render(MML_Psg *psg, int16_t *buf, size_t n);
+void mml_psg_render_fixed(MML_Psg *psg, int32_t *buf, size_t n);
+void mml_psg_mix(int16_t *buf, const int32_t *const in[], int nin, size_t n);
+void mml_psg_skip(MML_Psg *psg, size_t n);
+
+/* mml_psg_uses() の値: ビット 0〜2 は各チャンネルのトーン */
+#define MML_PSG_USES_NOISE	(1U << PSG_NCH)
+unsigned mml_psg_uses(const MML_Psg *psg);
+
+#endif /* MML_PSG_H */
@@ -0,0 +1,850 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * ドライバモデルと PSG の音声合成によるレンダリング
+ *  音声を出力せずにドライバモデルだけを最後まで進めて一定間隔で状態を保存しておき、
+ *  任意の位置からのレンダリングは直前の保存状態から開始位置まで
+ *  ドライバモデルだけを進めてから始める
+ *  ループで同じ状態から繰り返す区間は、PCM キャッシュを使えば保存しておいた
+ *  PCM をコピーして合成を省略できる
+ *  チャンネル毎にスレッドを分けて合成することもできる
+ */
+
+#include "mml_render.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+/*
+ * シーク用のドライバモデルの状態を作る
+ *  全チャンネルが終了するか 'J' に 1 度戻るまで (最大 maxticks 回) 演奏する
+ *  mark (NULL 可) はイメージ上の位置毎の印で、印の付いた音符/休符を
+ *  最初に演奏し始めた割り込み番号を found に返す (無ければ MML_NOTICK)
+ */
+const char *
+mml_snapshots_build(MML_Snapshots *s, const uint8_t *img, size_t len,
+    const size_t start[PSG_NCH], unsigned long maxticks, const uint8_t *mark,
+    unsigned long *found)
+{
+    MML_Player p;
+    size_t cap = 0;
+
+    memset(s, 0, sizeof(*s));
+    if (found != NULL)
+        *found = MML_NOTICK;
+    mml_player_init(&p, img, len, start);
+    while (!mml_player_done(&p) && p.tick < maxticks) {
+        size_t note[PSG_NCH];
+
+        if (p.tick % MML_SNAPSHOT_INTERVAL == 0) {
+            if (s->nsnap >= cap) {
+                size_t ncap = (cap == 0) ? 16 : cap * 2;
+                MML_Player *ns = realloc(s->snap, ncap * sizeof(*ns));
+                if (ns == NULL) {
+                    mml_snapshots_free(s);
+                    return "ドライバモデルの状態を保存できませんでした";
+                }
+                s->snap = ns;
+                cap = ncap;
+            }
+            s->snap[s->nsnap++] = p;
+        }
+        for (int i = 0; i < PSG_NCH; i++)
+            note[i] = p.ch[i].note;
+        if (!mml_player_tick(&p)) {
+            mml_snapshots_free(s);
+            return p.error;
+        }
+        if (mark == NULL || *found != MML_NOTICK)
+            continue;
+        for (int i = 0; i < PSG_NCH; i++) {
+            size_t pos = p.ch[i].note;
+            if (pos != note[i] && pos != MML_NOPOS && mark[pos]) {
+                *found = p.tick - 1;
+                break;
+            }
+        }
+    }
+    s->nticks = p.tick;
+    return NULL;
+}
+
+void
+mml_snapshots_free(MML_Snapshots *s)
+{
+    free(s->snap);
+    s->snap = NULL;
+    s->nsnap = 0;
+}
+
+/* PSG の合成の状態のうち発振器以外 (出力段と発振器が次に進む時刻) */
+typedef struct {
+    unsigned long next;
+    unsigned long acc;
+    int      level;
+    int16_t  last;
+    int64_t  integ;
+    int64_t  delta[MML_PSG_TAPS];
+} MemoOutput;
+
+/* PSG の発振器の状態 */
+typedef struct {
+    unsigned tone_count[PSG_NCH];
+    int      tone_out[PSG_NCH];
+    unsigned noise_count;
+    int      noise_out;
+    uint32_t lfsr;
+} MemoOsc;
+
+/*
+ * PCM キャッシュの区切りの状態
+ *  ドライバの状態 (割り込み番号、'J' に戻った回数、ループ残り回数などを除く) と
+ *  PSG レジスタ、割り込みの開始位置のサンプルの端数 (割り込み毎のサンプル数)、
+ *  PSG の発振器以外の合成の状態
+ *  ループ残り回数は繰り返し毎に変わるので含めず、コピーする前にドライバモデルで
+ *  区間を演奏して PSG レジスタの変化が一致することを確かめる
+ *  発振器の位相は区間で出力に影響するものだけが一致すればよいので別に比べる
+ */
+typedef struct {
+    MML_PlayerChannel ch[PSG_NCH];
+    uint16_t tempo;
+    int      noise;
+    uint8_t  reg[PSG_NREGS];
+    unsigned long phase;
+    MemoOutput output;
+} MemoKey;
+
+/* PCM キャッシュの区間 (区切りから次の区切りまで) */
+struct MML_MemoEntry {
+    MML_MemoEntry *hnext;       /* 同じハッシュ表の位置の次の区間 */
+    MML_MemoEntry *prev;        /* LRU */
+    MML_MemoEntry *next;
+    uint32_t hash;
+    MemoKey  key;               /* 区間の始まりの状態 */
+    unsigned long nticks;
+    size_t   nsamples;
+    int16_t *pcm;
+    uint8_t (*reg)[PSG_NREGS];  /* 割り込み毎の PSG レジスタ */
+    MemoOsc  osc;               /* 区間の始まりの発振器の状態 */
+    unsigned uses;              /* 区間で出力に影響した発振器 */
+    MemoOutput output;          /* 区間の終わりの発振器以外の合成の状態 */
+};
+
+#define MEMO_BUCKETS	1024
+
+/* 割り込み番号 tick の開始時点のサンプル位置 */
+unsigned long
+mml_render_sample(unsigned long tick, unsigned rate)
+{
+    return (unsigned long)((unsigned long long)tick * rate / MML_PLAYER_HZ);
+}
+
+static size_t
+tick_samples(const MML_Renderer *r, unsigned long tick)
+{
+    return mml_render_sample(tick + 1, r->psg.rate) -
+      mml_render_sample(tick, r->psg.rate);
+}
+
+void
+mml_render_init(MML_Renderer *r, const uint8_t *img, size_t len,
+    const size_t start[PSG_NCH], unsigned rate, int synth)
+{
+    r->memo = NULL;
+    mml_player_init(&r->player, img, len, start);
+    mml_psg_init(&r->psg, MML_PSG_CLOCK, rate, synth);
+    for (int k = 0; k < PSG_NREGS; k++)
+        mml_psg_write(&r->psg, k, r->player.reg[k]);
+}
+
+/* ループの先頭か 'J' に戻った回数の合計 (変わった割り込みが区切り) */
+static unsigned long
+memo_marks(const MML_Player *p)
+{
+    unsigned long n = 0;
+
+    for (int i = 0; i < PSG_NCH; i++)
+        n += p->ch[i].it.repeats + p->ch[i].it.loops;
+    return n;
+}
+
+static void
+memo_output_save(MemoOutput *o, const MML_Psg *psg)
+{
+    o->next = psg->next;
+    o->acc = psg->acc;
+    o->level = psg->level;
+    o->last = psg->last;
+    o->integ = psg->integ;
+    memcpy(o->delta, psg->delta, sizeof(o->delta));
+}
+
+static void
+memo_output_restore(MML_Psg *psg, const MemoOutput *o)
+{
+    psg->next = o->next;
+    psg->acc = o->acc;
+    psg->level = o->level;
+    psg->last = o->last;
+    psg->integ = o->integ;
+    memcpy(psg->delta, o->delta, sizeof(o->delta));
+}
+
+static void
+memo_osc_save(MemoOsc *o, const MML_Psg *psg)
+{
+    memset(o, 0, sizeof(*o));
+    memcpy(o->tone_count, psg->tone_count, sizeof(o->tone_count));
+    memcpy(o->tone_out, psg->tone_out, sizeof(o->tone_out));
+    o->noise_count = psg->noise_count;
+    o->noise_out = psg->noise_out;
+    o->lfsr = psg->lfsr;
+}
+
+/* 区間で出力に影響する発振器の位相が今の状態と一致するか */
+static bool
+memo_osc_match(const MML_MemoEntry *e, const MML_Psg *psg)
+{
+    for (int i = 0; i < PSG_NCH; i++) {
+        if ((e->uses & (1U << i)) != 0 &&
+          (e->osc.tone_count[i] != psg->tone_count[i] ||
+          e->osc.tone_out[i] != psg->tone_out[i]))
+            return false;
+    }
+    return (e->uses & MML_PSG_USES_NOISE) == 0 ||
+      (e->osc.noise_count == psg->noise_count &&
+      e->osc.noise_out == psg->noise_out && e->osc.lfsr == psg->lfsr);
+}
+
+static void
+memo_key(MemoKey *k, const MML_Renderer *r)
+{
+    const MML_Player *p = &r->player;
+
+    memset(k, 0, sizeof(*k));
+    memcpy(k->ch, p->ch, sizeof(k->ch));
+    for (int i = 0; i < PSG_NCH; i++) {
+        MML_Iter *it = &k->ch[i].it;
+        it->time = 0;
+        it->nnotes = 0;
+        memset(it->head, 0, sizeof(it->head));
+        memset(it->count, 0, sizeof(it->count));
+        it->repeats = 0;
+        it->loops = 0;
+    }
+    k->tempo = p->tempo;
+    k->noise = p->noise;
+    memcpy(k->reg, p->reg, PSG_NREGS);
+    k->phase = (unsigned long)((unsigned long long)p->tick * r->psg.rate %
+      MML_PLAYER_HZ);
+    memo_output_save(&k->output, &r->psg);
+}
+
+/* FNV-1a */
+static uint32_t
+memo_hash(const MemoKey *k)
+{
+    const uint8_t *b = (const uint8_t *)k;
+    uint32_t h = 2166136261U;
+
+    for (size_t n = 0; n < sizeof(*k); n++)
+        h = (h ^ b[n]) * 16777619U;
+    return h;
+}
+
+static size_t
+memo_entry_size(const MML_MemoEntry *e)
+{
+    return sizeof(*e) + e->nsamples * sizeof(e->pcm[0]) +
+      e->nticks * sizeof(e->reg[0]);
+}
+
+static void
+memo_free_entry(MML_MemoEntry *e)
+{
+    if (e != NULL) {
+        free(e->pcm);
+        free(e->reg);
+        free(e);
+    }
+}
+
+static void
+lru_unlink(MML_Memo *m, MML_MemoEntry *e)
+{
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        m->head = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        m->tail = e->prev;
+}
+
+static void
+lru_push(MML_Memo *m, MML_MemoEntry *e)
+{
+    e->prev = NULL;
+    e->next = m->head;
+    if (m->head != NULL)
+        m->head->prev = e;
+    else
+        m->tail = e;
+    m->head = e;
+}
+
+/* 上限を超えた分を最後に使ったのが古い区間から捨てる */
+static void
+memo_evict(MML_Memo *m)
+{
+    while (m->size > m->limit && m->tail != NULL) {
+        MML_MemoEntry *e = m->tail;
+        MML_MemoEntry **pp = &m->table[e->hash % m->nbuckets];
+        while (*pp != e)
+            pp = &(*pp)->hnext;
+        *pp = e->hnext;
+        lru_unlink(m, e);
+        m->size -= memo_entry_size(e);
+        memo_free_entry(e);
+    }
+}
+
+/*
+ * 区間をドライバモデルで演奏して PSG レジスタの変化が一致するか確かめる
+ *  一致すれば区間の終わりのドライバの状態を end に返す
+ */
+static bool
+memo_check(const MML_Renderer *r, const MML_MemoEntry *e, MML_Player *end)
+{
+    *end = r->player;
+    for (unsigned long t = 0; t < e->nticks; t++) {
+        if (!mml_player_tick(end) || memcmp(end->reg, e->reg[t], PSG_NREGS))
+            return false;
+    }
+    return true;
+}
+
+static MML_MemoEntry *
+memo_find(MML_Renderer *r, const MemoKey *k, uint32_t hash)
+{
+    MML_Memo *m = r->memo;
+
+    for (MML_MemoEntry *e = m->table[hash % m->nbuckets]; e != NULL;
+      e = e->hnext) {
+        if (e->hash == hash && memcmp(&e->key, k, sizeof(*k)) == 0 &&
+          memo_osc_match(e, &r->psg) && memo_check(r, e, &m->play_end)) {
+            lru_unlink(m, e);
+            lru_push(m, e);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* 記録中の区間を終えてキャッシュに入れる */
+static void
+memo_finish(MML_Renderer *r)
+{
+    MML_Memo *m = r->memo;
+    MML_MemoEntry *e = m->rec;
+
+    m->rec = NULL;
+    memo_output_save(&e->output, &r->psg);
+    e->hnext = m->table[e->hash % m->nbuckets];
+    m->table[e->hash % m->nbuckets] = e;
+    lru_push(m, e);
+    m->size += memo_entry_size(e);
+    memo_evict(m);
+}
+
+/*
+ * 区切りでの処理
+ *  記録中の区間をキャッシュに入れ、今の状態から始まる区間があればコピーを始め、
+ *  無ければ記録を始める
+ */
+static void
+memo_mark(MML_Renderer *r)
+{
+    MML_Memo *m = r->memo;
+    MemoKey key;
+    MML_MemoEntry *e;
+
+    memo_key(&key, r);
+    uint32_t hash = memo_hash(&key);
+    if (m->rec != NULL)
+        memo_finish(r);
+    if ((e = memo_find(r, &key, hash)) != NULL) {
+        m->play = e;
+        m->play_pos = 0;
+        m->play_ticks = 0;
+        m->hits++;
+        return;
+    }
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+        return;
+    e->hash = hash;
+    e->key = key;
+    memo_osc_save(&e->osc, &r->psg);
+    m->rec = e;
+    m->rec_cap = 0;
+}
+
+/*
+ * 記録中の区間に割り込み 1 回分の PCM と PSG レジスタを追加
+ *  (上限の 1/4 を超える区間は記録をやめる)
+ */
+static void
+memo_record(MML_Renderer *r, const int16_t *buf, size_t n)
+{
+    MML_Memo *m = r->memo;
+    MML_MemoEntry *e = m->rec;
+
+    if (e->nsamples + n > m->rec_cap) {
+        size_t ncap = (m->rec_cap == 0) ? 4096 : m->rec_cap * 2;
+        int16_t *np = NULL;
+        while (ncap < e->nsamples + n)
+            ncap *= 2;
+        if (ncap * sizeof(*np) <= m->limit / 4)
+            np = realloc(e->pcm, ncap * sizeof(*np));
+        if (np == NULL) {
+            memo_free_entry(e);
+            m->rec = NULL;
+            return;
+        }
+        e->pcm = np;
+        m->rec_cap = ncap;
+    }
+    /* レジスタは PCM の 1/MML_RENDER_MAX_SAMPLES 程度なので同じ割合で確保 */
+    if (e->nticks % 256 == 0) {
+        uint8_t (*nr)[PSG_NREGS] = realloc(e->reg,
+          (e->nticks + 256) * sizeof(*nr));
+        if (nr == NULL) {
+            memo_free_entry(e);
+            m->rec = NULL;
+            return;
+        }
+        e->reg = nr;
+    }
+    memcpy(e->pcm + e->nsamples, buf, n * sizeof(*buf));
+    memcpy(e->reg[e->nticks], r->player.reg, PSG_NREGS);
+    e->uses |= mml_psg_uses(&r->psg);
+    e->nsamples += n;
+    e->nticks++;
+}
+
+/*
+ * コピーした区間の終わりの状態に移る
+ *  発振器は区間の PSG レジスタの変化のとおりに合成を省略して進め、
+ *  出力段は保存しておいた区間の終わりの状態にする
+ */
+static void
+memo_restore(MML_Renderer *r)
+{
+    MML_Memo *m = r->memo;
+    const MML_MemoEntry *e = m->play;
+    unsigned long tick = r->player.tick - e->nticks;
+
+    for (unsigned long t = 0; t < e->nticks; t++) {
+        for (int k = 0; k < PSG_NREGS; k++)
+            mml_psg_write(&r->psg, k, e->reg[t][k]);
+        mml_psg_skip(&r->psg, tick_samples(r, tick + t));
+    }
+    memo_output_restore(&r->psg, &e->output);
+    r->player = m->play_end;
+    m->play = NULL;
+    m->marks = memo_marks(&r->player);
+    memo_mark(r);
+}
+
+/* 記録やコピーの途中の区間を捨てて今の状態から始める */
+static void
+memo_reset(MML_Renderer *r)
+{
+    MML_Memo *m = r->memo;
+
+    memo_free_entry(m->rec);
+    m->rec = NULL;
+    m->play = NULL;
+    m->marks = memo_marks(&r->player);
+}
+
+/*
+ * PCM キャッシュを使う (limit は保存する PCM などの合計の上限バイト数)
+ *  ループで同じ状態から繰り返す区間は合成せずに保存した PCM をコピーする
+ */
+bool
+mml_render_memo(MML_Renderer *r, size_t limit)
+{
+    MML_Memo *m = calloc(1, sizeof(*m));
+
+    if (m == NULL)
+        return false;
+    m->nbuckets = MEMO_BUCKETS;
+    m->table = calloc(m->nbuckets, sizeof(m->table[0]));
+    if (m->table == NULL) {
+        free(m);
+        return false;
+    }
+    m->limit = limit;
+    r->memo = m;
+    memo_reset(r);
+    return true;
+}
+
+void
+mml_render_free(MML_Renderer *r)
+{
+    MML_Memo *m = r->memo;
+
+    if (m == NULL)
+        return;
+    while (m->head != NULL) {
+        MML_MemoEntry *e = m->head;
+        m->head = e->next;
+        memo_free_entry(e);
+    }
+    memo_free_entry(m->rec);
+    free(m->table);
+    free(m);
+    r->memo = NULL;
+}
+
+/*
+ * 割り込み番号 tick の位置に移動
+ *  直前の保存状態から tick までは音声を出力せずにドライバモデルだけを進め、
+ *  その時点のレジスタの値を PSG に設定する
+ */
+const char *
+mml_render_seek(MML_Renderer *r, const MML_Snapshots *s, unsigned long tick)
+{
+    MML_Player *p = &r->player;
+    size_t k = tick / MML_SNAPSHOT_INTERVAL;
+
+    if (k < s->nsnap)
+        *p = s->snap[k];
+    else if (s->nsnap > 0)
+        *p = s->snap[s->nsnap - 1];
+    while (p->tick < tick) {
+        if (!mml_player_tick(p))
+            return p->error;
+    }
+    for (int n = 0; n < PSG_NREGS; n++)
+        mml_psg_write(&r->psg, n, p->reg[n]);
+    if (r->memo != NULL)
+        memo_reset(r);
+    return NULL;
+}
+
+static size_t
+render_tick(MML_Renderer *r, int16_t *buf)
+{
+    MML_Player *p = &r->player;
+    unsigned long tick = p->tick;
+
+    if (!mml_player_tick(p))
+        return 0;
+    for (int n = 0; n < PSG_NREGS; n++) {
+        if (p->dirty & (1U << n))
+            mml_psg_write(&r->psg, n, p->reg[n]);
+    }
+    size_t n = tick_samples(r, tick);
+    mml_psg_render(&r->psg, buf, n);
+    return n;
+}
+
+/*
+ * 割り込み 1 回分のレンダリング
+ *  buf には MML_RENDER_MAX_SAMPLES() 分の領域が必要
+ *  サンプル数を返す (演奏を続けられない場合は 0 で r->player.error にエラー内容)
+ */
+size_t
+mml_render_tick(MML_Renderer *r, int16_t *buf)
+{
+    MML_Memo *m = r->memo;
+    size_t n;
+
+    if (m == NULL)
+        return render_tick(r, buf);
+
+    /* コピー中の区間の分は PSG の合成を省略 (ドライバモデルは確認時に演奏済み) */
+    if (m->play != NULL) {
+        n = tick_samples(r, r->player.tick);
+        memcpy(buf, m->play->pcm + m->play_pos, n * sizeof(*buf));
+        m->play_pos += n;
+        m->copied++;
+        r->player.tick++;
+        if (++m->play_ticks == m->play->nticks)
+            memo_restore(r);
+        return n;
+    }
+
+    if ((n = render_tick(r, buf)) == 0)
+        return 0;
+    if (m->rec != NULL)
+        memo_record(r, buf, n);
+    unsigned long marks = memo_marks(&r->player);
+    if (marks != m->marks) {
+        m->marks = marks;
+        memo_mark(r);
+    }
+    return n;
+}
+
+/*
+ * チャンネル毎のスレッドによるレンダリング
+ *  ドライバモデルのスレッドが割り込み毎の PSG レジスタの値をチャンネル毎の
+ *  スレッドへ送り、各スレッドは自分のチャンネルだけを帯域制限ステップで
+ *  固定小数点のまま合成して、呼び出し元のスレッドがそれを合計して出力する
+ *  ノイズ周期やミキサーなど共有のレジスタは全スレッドに同じ値を送り、
+ *  ノイズの LFSR は各スレッドが同じ手順で進めるので、出力はスレッドを
+ *  使わない場合と一致する
+ *  スレッド間は単一の書き手と読み手のリングバッファでロックを使わずに受け渡す
+ */
+
+/* リングバッファの要素数 (2 のべき乗) */
+#define MT_FRAMES	64
+#define MT_SAMPLES	32768
+
+typedef struct {
+    uint8_t *buf;
+    size_t   size;          /* 要素のバイト数 */
+    size_t   mask;          /* 要素数 - 1 */
+    atomic_size_t head;     /* 書き込んだ要素数 */
+    atomic_size_t tail;     /* 読み出した要素数 */
+} Ring;
+
+/* 割り込み 1 回分の PSG レジスタ (nsamples が 0 なら終了) */
+typedef struct {
+    uint8_t  reg[PSG_NREGS];
+    uint32_t nsamples;
+} MtFrame;
+
+typedef struct MtRender MtRender;
+
+typedef struct {
+    MtRender *mt;
+    MML_Psg  psg;           /* このチャンネルだけを合成する PSG */
+    Ring     frames;        /* ドライバモデル → チャンネル */
+    Ring     pcm;           /* チャンネル → ミキサー */
+} MtChannel;
+
+struct MtRender {
+    MML_Renderer *r;
+    unsigned long nticks;
+    MtChannel ch[PSG_NCH];
+    Ring     count;         /* 割り込み毎のサンプル数 (ドライバモデル → ミキサー) */
+    atomic_bool abort;
+    const char *error;
+};
+
+static bool
+ring_init(Ring *q, size_t size, size_t n)
+{
+    q->buf = malloc(size * n);
+    q->size = size;
+    q->mask = n - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return q->buf != NULL;
+}
+
+/* n 要素を書き込む (空くまで待つ、中断されたら false) */
+static bool
+ring_put(Ring *q, const void *src, size_t n, atomic_bool *abort)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    while (head - atomic_load_explicit(&q->tail, memory_order_acquire) >
+      q->mask + 1 - n) {
+        if (atomic_load_explicit(abort, memory_order_relaxed))
+            return false;
+        sched_yield();
+    }
+    size_t k = head & q->mask;
+    size_t m = (n < q->mask + 1 - k) ? n : q->mask + 1 - k;
+    memcpy(q->buf + k * q->size, src, m * q->size);
+    memcpy(q->buf, (const uint8_t *)src + m * q->size, (n - m) * q->size);
+    atomic_store_explicit(&q->head, head + n, memory_order_release);
+    return true;
+}
+
+/* n 要素を読み出す (揃うまで待つ、中断されたら false) */
+static bool
+ring_get(Ring *q, void *dst, size_t n, atomic_bool *abort)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    while (atomic_load_explicit(&q->head, memory_order_acquire) - tail < n) {
+        if (atomic_load_explicit(abort, memory_order_relaxed))
+            return false;
+        sched_yield();
+    }
+    size_t k = tail & q->mask;
+    size_t m = (n < q->mask + 1 - k) ? n : q->mask + 1 - k;
+    memcpy(dst, q->buf + k * q->size, m * q->size);
+    memcpy((uint8_t *)dst + m * q->size, q->buf, (n - m) * q->size);
+    atomic_store_explicit(&q->tail, tail + n, memory_order_release);
+    return true;
+}
+
+/* ドライバモデルを進めて各チャンネルとミキサーへ送る */
+static void *
+mt_player(void *arg)
+{
+    MtRender *mt = arg;
+    MML_Player *p = &mt->r->player;
+    MtFrame f;
+
+    for (unsigned long t = 0; t < mt->nticks && !mml_player_ended(p); t++) {
+        unsigned long tick = p->tick;
+        if (!mml_player_tick(p)) {
+            mt->error = p->error;
+            break;
+        }
+        memcpy(f.reg, p->reg, sizeof(f.reg));
+        f.nsamples = (uint32_t)tick_samples(mt->r, tick);
+        for (int i = 0; i < PSG_NCH; i++) {
+            if (!ring_put(&mt->ch[i].frames, &f, 1, &mt->abort))
+                return NULL;
+        }
+        if (!ring_put(&mt->count, &f.nsamples, 1, &mt->abort))
+            return NULL;
+    }
+    f.nsamples = 0;
+    for (int i = 0; i < PSG_NCH; i++) {
+        if (!ring_put(&mt->ch[i].frames, &f, 1, &mt->abort))
+            return NULL;
+    }
+    ring_put(&mt->count, &f.nsamples, 1, &mt->abort);
+    return NULL;
+}
+
+/* 1 チャンネル分の合成 */
+static void *
+mt_channel(void *arg)
+{
+    MtChannel *c = arg;
+    int32_t buf[MML_PSG_BLOCK];
+    MtFrame f;
+
+    while (ring_get(&c->frames, &f, 1, &c->mt->abort) && f.nsamples > 0) {
+        for (int n = 0; n < PSG_NREGS; n++)
+            mml_psg_write(&c->psg, n, f.reg[n]);
+        for (size_t n = f.nsamples; n > 0; ) {
+            size_t m = (n < MML_PSG_BLOCK) ? n : MML_PSG_BLOCK;
+            mml_psg_render_fixed(&c->psg, buf, m);
+            if (!ring_put(&c->pcm, buf, m, &c->mt->abort))
+                return NULL;
+            n -= m;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * 割り込み nticks 回分 (全チャンネルが終了すればそこまで) を
+ * チャンネル毎のスレッドでレンダリング
+ *  帯域制限ステップの合成だけに対応し、PCM キャッシュは使わない
+ *  合成したサンプルは呼び出し元のスレッドで output に渡す (false を返すと中断)
+ *  終了後の r は続けてレンダリングできない
+ *  ドライバモデルのエラーはエラー内容を返す
+ */
+const char *
+mml_render_threads(MML_Renderer *r, unsigned long nticks,
+    MML_RenderOutput output, void *arg)
+{
+    MtRender *mt = calloc(1, sizeof(*mt));
+    pthread_t th[PSG_NCH + 1];
+    int nth = 0;
+    const char *e = NULL;
+    int16_t *out = malloc(MML_RENDER_MAX_SAMPLES(r->psg.rate) * sizeof(*out));
+    int32_t *mix[PSG_NCH] = { NULL };
+    bool ok = (mt != NULL && out != NULL && ring_init(&mt->count,
+      sizeof(uint32_t), MT_FRAMES));
+
+    for (int i = 0; ok && i < PSG_NCH; i++) {
+        MtChannel *c = &mt->ch[i];
+        c->mt = mt;
+        c->psg = r->psg;
+        c->psg.chmask = 1U << i;
+        mix[i] = malloc(MML_RENDER_MAX_SAMPLES(r->psg.rate) * sizeof(*mix[i]));
+        ok = (mix[i] != NULL &&
+          ring_init(&c->frames, sizeof(MtFrame), MT_FRAMES) &&
+          ring_init(&c->pcm, sizeof(int32_t), MT_SAMPLES));
+    }
+    if (!ok) {
+        e = "レンダリング用バッファを確保できませんでした";
+        goto out;
+    }
+    mt->r = r;
+    mt->nticks = nticks;
+    atomic_init(&mt->abort, false);
+
+    for (int i = 0; i < PSG_NCH; i++) {
+        if (pthread_create(&th[nth], NULL, mt_channel, &mt->ch[i]) != 0)
+            break;
+        nth++;
+    }
+    if (nth < PSG_NCH ||
+      pthread_create(&th[nth], NULL, mt_player, mt) != 0) {
+        atomic_store(&mt->abort, true);
+        e = "スレッドを作成できませんでした";
+    } else {
+        nth++;
+        /* ミキサー: 各チャンネルの割り込み 1 回分を合計して出力 */
+        uint32_t n;
+        while (ring_get(&mt->count, &n, 1, &mt->abort) && n > 0) {
+            for (int i = 0; i < PSG_NCH; i++)
+                ring_get(&mt->ch[i].pcm, mix[i], n, &mt->abort);
+            mml_psg_mix(out, (const int32_t *const *)mix, PSG_NCH, n);
+            if (!output(arg, out, n)) {
+                atomic_store(&mt->abort, true);
+                break;
+            }
+        }
+    }
+    while (nth > 0)
+        pthread_join(th[--nth], NULL);
+    if (e == NULL)
+        e = mt->error;
+
+out:
+    if (mt != NULL) {
+        free(mt->count.buf);
+        for (int i = 0; i < PSG_NCH; i++) {
+            free(mt->ch[i].frames.buf);
+            free(mt->ch[i].pcm.buf);
+        }
+    }
+    for (int i = 0; i < PSG_NCH; i++)
+        free(mix[i]);
+    free(out);
+    free(mt);
+    return e;
+}
@@ -0,0 +1,102 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MML_RENDER_H
+#define MML_RENDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mml_binary.h"
+#include "mml_player.h"
+#include "mml_psg.h"
+
+/* シーク用にドライバモデルの状態を保存する間隔 (割り込み回数) */
+#define MML_SNAPSHOT_INTERVAL	600
+
+/* 割り込み 1 回分の最大サンプル数 */
+#define MML_RENDER_MAX_SAMPLES(rate)	((rate) / MML_PLAYER_HZ + 1)
+
+#define MML_NOTICK	(~0UL)
+
+/* シーク用のドライバモデルの状態 */
+typedef struct {
+    MML_Player *snap;       /* MML_SNAPSHOT_INTERVAL 回毎の状態 */
+    size_t   nsnap;
+    unsigned long nticks;   /* 演奏終了までの割り込み回数 */
+} MML_Snapshots;
+
+/*
+ * ループの繰り返し単位の PCM キャッシュ
+ *  いずれかのチャンネルがループの先頭か 'J' に戻った割り込みを区切りとして、
+ *  区切りでのドライバと PSG レジスタの状態毎に次の区切りまでの PCM を保存する
+ */
+typedef struct MML_MemoEntry MML_MemoEntry;
+
+typedef struct {
+    MML_MemoEntry **table;  /* 区切りの状態のハッシュ表 */
+    size_t   nbuckets;
+    MML_MemoEntry *head;    /* 最近使った順 (LRU) の先頭 */
+    MML_MemoEntry *tail;
+    size_t   size;          /* 保存している PCM などの合計バイト数 */
+    size_t   limit;
+    MML_MemoEntry *rec;     /* 記録中の区間 */
+    size_t   rec_cap;
+    MML_MemoEntry *play;    /* コピー中の区間 */
+    size_t   play_pos;
+    unsigned long play_ticks;
+    MML_Player play_end;    /* コピー中の区間の終わりのドライバの状態 */
+    unsigned long marks;    /* ループの先頭と 'J' に戻った回数の合計 */
+    unsigned long hits;     /* コピーした区間数 */
+    unsigned long copied;   /* コピーした割り込み回数 */
+} MML_Memo;
+
+/* レンダリングの状態 */
+typedef struct {
+    MML_Player player;
+    MML_Psg  psg;
+    MML_Memo *memo;         /* PCM キャッシュ (使わなければ NULL) */
+} MML_Renderer;
+
+/* レンダリングしたサンプルを受け取る関数 (false を返すと中断) */
+typedef bool (*MML_RenderOutput)(void *arg, const int16_t *buf, size_t n);
+
+const char *mml_snapshots_build(MML_Snapshots *s, const uint8_t *img,
+    size_t len, const size_t start[PSG_NCH], unsigned long maxticks,
+    const uint8_t *mark, unsigned long *found);
+void mml_snapshots_free(MML_Snapshots *s);
+
+unsigned long mml_render_sample(unsigned long tick, unsigned rate);
+void mml_render_init(MML_Renderer *r, const uint8_t *img, size_t len,
+    const size_t start[PSG_NCH], unsigned rate, int synth);
+bool mml_render_memo(MML_Renderer *r, size_t limit);
+void mml_render_free(MML_Renderer *r);
+const char *mml_render_seek(MML_Renderer *r, const MML_Snapshots *s,
+    unsigned long tick);
+size_t mml_render_tick(MML_Renderer *r, int16_t *buf);
+const char *mml_render_threads(MML_Renderer *r, unsigned long nticks,
+    MML_RenderOutput output, void *arg);
+
+#endif /* MML_RENDER_H */
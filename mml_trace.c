@@ -0,0 +1,420 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * PSG レジスタ書き込みトレース
+ *  ドライバモデルで演奏した時の PSG レジスタへの書き込みを
+ *  割り込み番号の差分付きで記録する
+ *  一定間隔で全レジスタとドライバの状態をチェックポイントとして記録し、
+ *  ファイル末尾の索引から任意の時刻の直前のチェックポイントに移動できる
+ */
+
+#include "mml_trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* 可変長整数 (7bit単位, LSB first) */
+static void
+put_varint(FILE *fp, unsigned long v)
+{
+    while (v >= 0x80) {
+        putc((int)(v & 0x7F) | 0x80, fp);
+        v >>= 7;
+    }
+    putc((int)v, fp);
+}
+
+/* 符号付き (zigzag 変換して可変長整数) */
+static void
+put_svarint(FILE *fp, long v)
+{
+    put_varint(fp, (v < 0) ? ~((unsigned long)v << 1) : (unsigned long)v << 1);
+}
+
+static bool
+get_varint(FILE *fp, unsigned long *v)
+{
+    int c, shift = 0;
+
+    *v = 0;
+    do {
+        if ((c = getc(fp)) == EOF || shift > 63)
+            return false;
+        *v |= (unsigned long)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return true;
+}
+
+static bool
+get_svarint(FILE *fp, long *v)
+{
+    unsigned long u;
+
+    if (!get_varint(fp, &u))
+        return false;
+    *v = (long)(u >> 1) ^ -(long)(u & 1);
+    return true;
+}
+
+/* 位置 (MML_NOPOS は 0, それ以外は +1) */
+static void
+put_pos(FILE *fp, size_t pos)
+{
+    put_varint(fp, (pos == MML_NOPOS) ? 0 : pos + 1);
+}
+
+/* チェックポイント: 割り込み番号、全レジスタ、ドライバの状態 */
+static void
+put_checkpoint(FILE *fp, const MML_Player *p)
+{
+    putc(TRACE_CHECKPOINT, fp);
+    put_varint(fp, p->tick);
+    fwrite(p->reg, 1, PSG_NREGS, fp);
+    put_varint(fp, p->tempo);
+    put_varint(fp, p->noise);
+    for (int i = 0; i < PSG_NCH; i++) {
+        const MML_PlayerChannel *ch = &p->ch[i];
+        put_varint(fp, ch->it.pos);
+        put_pos(fp, ch->note);
+        put_pos(fp, ch->it.jump);
+        put_varint(fp, ch->it.nest);
+        fwrite(ch->it.count, 1, ch->it.nest, fp);
+        put_varint(fp, ch->octave);
+        put_varint(fp, ch->it.l);
+        put_varint(fp, ch->it.lp);
+        put_varint(fp, ch->volume);
+        put_varint(fp, ch->q);
+        put_svarint(fp, ch->detune);
+        put_varint(fp, ch->mode);
+        fwrite(ch->env, 1, sizeof(ch->env), fp);
+        fwrite(ch->vib, 1, sizeof(ch->vib), fp);
+        putc(ch->vib_on | (ch->tie << 1) | (ch->keyon << 2) |
+          (ch->it.ended << 3), fp);
+        put_varint(fp, ch->tone);
+        put_svarint(fp, ch->remain);
+        put_varint(fp, ch->level);
+        put_varint(fp, ch->env_timer);
+        put_varint(fp, ch->env_step);
+        put_varint(fp, ch->vib_timer);
+        put_varint(fp, ch->vib_step);
+        put_svarint(fp, ch->vib_dir);
+        put_svarint(fp, ch->vib_offset);
+        put_varint(fp, ch->it.loops);
+    }
+}
+
+/*
+ * ドライバモデルで演奏したトレースを出力
+ *  全チャンネルが終了するか 'J' に 1 度戻るまで (最大 maxticks 回) 演奏する
+ *  演奏を続けられないデータの場合はエラー内容を返す
+ */
+const char *
+mml_trace_write(FILE *fp, const uint8_t *img, size_t len,
+    const size_t start[PSG_NCH], unsigned long maxticks,
+    unsigned long *nticks)
+{
+    MML_Player p;
+    MML_TraceIndex *index = NULL;
+    size_t nindex = 0, cap = 0;
+    unsigned long cur = 0;
+
+    fputs(MML_TRACE_MAGIC, fp);
+    putc(MML_TRACE_VERSION, fp);
+    put_varint(fp, MML_PLAYER_HZ);
+    put_varint(fp, MML_PSG_CLOCK);
+    put_varint(fp, MML_TRACE_INTERVAL);
+
+    mml_player_init(&p, img, len, start);
+    while (!mml_player_done(&p) && p.tick < maxticks) {
+        if (p.tick % MML_TRACE_INTERVAL == 0) {
+            if (nindex >= cap) {
+                size_t ncap = (cap == 0) ? 16 : cap * 2;
+                MML_TraceIndex *ni = realloc(index, ncap * sizeof(*ni));
+                if (ni == NULL) {
+                    free(index);
+                    return "索引を確保できませんでした";
+                }
+                index = ni;
+                cap = ncap;
+            }
+            index[nindex].tick = p.tick;
+            index[nindex].offset = ftell(fp);
+            nindex++;
+            put_checkpoint(fp, &p);
+            cur = p.tick;
+        }
+        if (!mml_player_tick(&p)) {
+            free(index);
+            return p.error;
+        }
+        if (p.dirty == 0)
+            continue;
+
+        /* 書き込みのあった割り込みまで進めてからレジスタ番号順に記録 */
+        unsigned long t = p.tick - 1;
+        if (t - cur > TRACE_WAIT_MAX) {
+            putc(TRACE_WAITN, fp);
+            put_varint(fp, t - cur);
+        } else if (t > cur) {
+            putc(TRACE_WAIT + (int)(t - cur) - 1, fp);
+        }
+        cur = t;
+        for (int r = 0; r < PSG_NREGS; r++) {
+            if (p.dirty & (1U << r)) {
+                putc(TRACE_WRITE + r, fp);
+                putc(p.reg[r], fp);
+            }
+        }
+    }
+    putc(TRACE_END, fp);
+
+    /*
+     * 索引: 全体の割り込み回数、チェックポイント毎の割り込み番号と位置の差分
+     *  ファイル末尾に索引の位置 4 バイト
+     */
+    long pos = ftell(fp);
+    unsigned long tick = 0;
+    long offset = 0;
+    put_varint(fp, p.tick);
+    put_varint(fp, nindex);
+    for (size_t k = 0; k < nindex; k++) {
+        put_varint(fp, index[k].tick - tick);
+        put_varint(fp, (unsigned long)(index[k].offset - offset));
+        tick = index[k].tick;
+        offset = index[k].offset;
+    }
+    for (int k = 0; k < 4; k++)
+        putc((int)(pos >> (k * 8)) & 0xFF, fp);
+    free(index);
+    *nticks = p.tick;
+    return NULL;
+}
+
+/*
+ * チェックポイントの読み込み (TRACE_CHECKPOINT の次から)
+ *  p が NULL でなければドライバの状態を復元する
+ */
+static bool
+get_checkpoint(MML_Trace *t, MML_Player *p)
+{
+    FILE *fp = t->fp;
+    MML_Player tmp;
+    unsigned long v[12];
+    long s[4];
+
+    if (p == NULL) {
+        memset(&tmp, 0, sizeof(tmp));
+        p = &tmp;
+    }
+    if (!get_varint(fp, &t->tick) ||
+      fread(t->reg, 1, PSG_NREGS, fp) != PSG_NREGS ||
+      !get_varint(fp, &v[0]) || !get_varint(fp, &v[1]))
+        return false;
+    t->sub = -1;
+    p->tick = t->tick;
+    memcpy(p->reg, t->reg, PSG_NREGS);
+    p->dirty = 0;
+    p->tempo = (uint16_t)v[0];
+    p->noise = (int)v[1];
+    p->error = NULL;
+    p->error_ch = -1;
+    for (int i = 0; i < PSG_NCH; i++) {
+        MML_PlayerChannel *ch = &p->ch[i];
+        int flags;
+        if (!get_varint(fp, &v[0]) || !get_varint(fp, &v[1]) ||
+          !get_varint(fp, &v[2]) || !get_varint(fp, &v[3]) ||
+          v[3] > MML_MAX_NEST ||
+          fread(ch->it.count, 1, v[3], fp) != v[3])
+            return false;
+        ch->it.pos = v[0];
+        ch->note = (v[1] == 0) ? MML_NOPOS : v[1] - 1;
+        ch->it.jump = (v[2] == 0) ? MML_NOPOS : v[2] - 1;
+        ch->it.nest = (int)v[3];
+        if (!get_varint(fp, &v[0]) || v[0] < 1 || v[0] > 8 ||
+          !get_varint(fp, &v[1]) || !get_varint(fp, &v[2]) ||
+          !get_varint(fp, &v[3]) || !get_varint(fp, &v[4]) ||
+          !get_svarint(fp, &s[0]) || !get_varint(fp, &v[5]) ||
+          fread(ch->env, 1, sizeof(ch->env), fp) != sizeof(ch->env) ||
+          fread(ch->vib, 1, sizeof(ch->vib), fp) != sizeof(ch->vib) ||
+          (flags = getc(fp)) == EOF)
+            return false;
+        ch->octave = (int)v[0];
+        ch->it.l = (int)v[1];
+        ch->it.lp = (int)v[2];
+        ch->volume = (int)v[3];
+        ch->q = (int)v[4];
+        ch->detune = (int)s[0];
+        ch->mode = (int)v[5];
+        ch->vib_on = (flags & 1) != 0;
+        ch->tie = (flags & 2) != 0;
+        ch->keyon = (flags & 4) != 0;
+        ch->it.ended = (flags & 8) != 0;
+        if (!get_varint(fp, &v[0]) || v[0] > 12 ||
+          !get_svarint(fp, &s[0]) || !get_varint(fp, &v[1]) ||
+          !get_varint(fp, &v[2]) || !get_varint(fp, &v[3]) ||
+          !get_varint(fp, &v[4]) || !get_varint(fp, &v[5]) ||
+          !get_svarint(fp, &s[1]) || !get_svarint(fp, &s[2]) ||
+          !get_varint(fp, &v[6]))
+            return false;
+        ch->tone = (int)v[0];
+        ch->remain = (int32_t)s[0];
+        ch->level = (int)v[1];
+        ch->env_timer = (int)v[2];
+        ch->env_step = (int)v[3];
+        ch->vib_timer = (int)v[4];
+        ch->vib_step = (int)v[5];
+        ch->vib_dir = (int)s[1];
+        ch->vib_offset = (int)s[2];
+        ch->it.loops = v[6];
+    }
+    return true;
+}
+
+/* トレースファイルのヘッダと索引を読み込んで先頭に移動 */
+const char *
+mml_trace_open(MML_Trace *t, FILE *fp)
+{
+    char magic[sizeof(MML_TRACE_MAGIC) - 1];
+    uint8_t tail[4];
+    unsigned long v[3];
+
+    memset(t, 0, sizeof(*t));
+    t->fp = fp;
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+      memcmp(magic, MML_TRACE_MAGIC, sizeof(magic)) != 0)
+        return "トレースファイルではありません";
+    if (getc(fp) != MML_TRACE_VERSION)
+        return "対応していないバージョンのトレースファイルです";
+    if (!get_varint(fp, &v[0]) || !get_varint(fp, &v[1]) ||
+      !get_varint(fp, &v[2]) || v[0] == 0 || v[2] == 0)
+        return "トレースファイルのヘッダが不正です";
+    t->hz = (unsigned)v[0];
+    t->clock = v[1];
+    t->interval = (unsigned)v[2];
+
+    if (fseek(fp, -(long)sizeof(tail), SEEK_END) != 0 ||
+      fread(tail, 1, sizeof(tail), fp) != sizeof(tail))
+        return "トレースファイルの索引を読み込めません";
+    long pos = tail[0] | (tail[1] << 8) | (tail[2] << 16) |
+      ((long)tail[3] << 24);
+    if (fseek(fp, pos, SEEK_SET) != 0 || !get_varint(fp, &t->nticks) ||
+      !get_varint(fp, &v[0]) || v[0] == 0 || v[0] > (unsigned long)pos)
+        return "トレースファイルの索引が不正です";
+    t->index = calloc(v[0], sizeof(*t->index));
+    if (t->index == NULL)
+        return "索引を確保できませんでした";
+    t->nindex = v[0];
+    unsigned long tick = 0;
+    long offset = 0;
+    for (size_t k = 0; k < t->nindex; k++) {
+        if (!get_varint(fp, &v[1]) || !get_varint(fp, &v[2]))
+            return "トレースファイルの索引が不正です";
+        tick += v[1];
+        offset += (long)v[2];
+        t->index[k].tick = tick;
+        t->index[k].offset = offset;
+    }
+    return mml_trace_seek(t, 0, NULL);
+}
+
+/*
+ * tick 以前で最後のチェックポイントに移動してレジスタの値を復元する
+ *  p が NULL でなければ (mml_player_init() 済みの) ドライバの状態も復元する
+ *  (コマンド列をたどる状態のうち、音長の合計など読み飛ばし用のものは除く)
+ *  その後 mml_trace_next() で tick までの書き込みを読み飛ばす
+ */
+const char *
+mml_trace_seek(MML_Trace *t, unsigned long tick, MML_Player *p)
+{
+    size_t lo = 0, hi = t->nindex;
+
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (t->index[mid].tick <= tick)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (fseek(t->fp, t->index[lo].offset, SEEK_SET) != 0 ||
+      getc(t->fp) != TRACE_CHECKPOINT || !get_checkpoint(t, p))
+        return "トレースファイルのチェックポイントが不正です";
+    return NULL;
+}
+
+/*
+ * 次のレジスタ書き込みを読み込む
+ *  t->tick, t->sub がその書き込みの時刻、t->reg が書き込み後の値になる
+ *  書き込みなら 1, 終端なら 0, 不正なデータなら -1 を返す
+ */
+int
+mml_trace_next(MML_Trace *t, uint8_t *reg, uint8_t *value)
+{
+    FILE *fp = t->fp;
+    unsigned long n;
+    int c, v;
+
+    for (;;) {
+        if ((c = getc(fp)) == EOF)
+            return -1;
+        if (c < TRACE_WAIT) {
+            if ((v = getc(fp)) == EOF)
+                return -1;
+            *reg = (uint8_t)c;
+            *value = (uint8_t)v;
+            t->reg[c] = (uint8_t)v;
+            t->sub++;
+            return 1;
+        }
+        if (c < TRACE_WAITN) {
+            t->tick += c - TRACE_WAIT + 1;
+            t->sub = -1;
+            continue;
+        }
+        switch (c) {
+        case TRACE_WAITN:
+            if (!get_varint(fp, &n))
+                return -1;
+            t->tick += n;
+            t->sub = -1;
+            break;
+        case TRACE_CHECKPOINT:
+            if (!get_checkpoint(t, NULL))
+                return -1;
+            break;
+        case TRACE_END:
+            return 0;
+        default:
+            return -1;
+        }
+    }
+}
+
+void
+mml_trace_close(MML_Trace *t)
+{
+    free(t->index);
+    t->index = NULL;
+}
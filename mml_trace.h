@@ -0,0 +1,79 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MML_TRACE_H
+#define MML_TRACE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mml_binary.h"
+#include "mml_player.h"
+
+/* PSG レジスタ書き込みトレースファイル (フォーマットは README 参照) */
+#define MML_TRACE_MAGIC		"P6TR"
+#define MML_TRACE_VERSION	1
+#define MML_TRACE_INTERVAL	600	/* チェックポイント間隔 (割り込み回数) */
+
+/* トレースのレコード種別 */
+#define TRACE_WRITE	0x00	/* 0x00-0x0F: レジスタ書き込み (値 1 バイトが続く) */
+#define TRACE_WAIT	0x10	/* 0x10-0x7F: 1〜112 割り込み進む */
+#define TRACE_WAIT_MAX	(0x80 - TRACE_WAIT)
+#define TRACE_WAITN	0x80	/* 可変長整数の割り込み数進む */
+#define TRACE_CHECKPOINT 0x81	/* チェックポイント (全レジスタとドライバ状態) */
+#define TRACE_END	0xFF
+
+/* チェックポイントの索引 (1件分) */
+typedef struct {
+    unsigned long tick;
+    long          offset;   /* ファイル先頭からの位置 */
+} MML_TraceIndex;
+
+/* トレースファイルの読み込み状態 */
+typedef struct {
+    FILE    *fp;
+    unsigned hz;
+    unsigned long clock;
+    unsigned interval;
+    unsigned long nticks;   /* 全体の割り込み回数 */
+    MML_TraceIndex *index;
+    size_t   nindex;
+
+    /* 直前に読み込んだ書き込みの時刻とその時点のレジスタの値 */
+    unsigned long tick;
+    int      sub;           /* 割り込み内の書き込み順 (サブ tick, 0〜) */
+    uint8_t  reg[PSG_NREGS];
+} MML_Trace;
+
+const char *mml_trace_write(FILE *fp, const uint8_t *img, size_t len,
+    const size_t start[PSG_NCH], unsigned long maxticks,
+    unsigned long *nticks);
+const char *mml_trace_open(MML_Trace *t, FILE *fp);
+const char *mml_trace_seek(MML_Trace *t, unsigned long tick, MML_Player *p);
+int mml_trace_next(MML_Trace *t, uint8_t *reg, uint8_t *value);
+void mml_trace_close(MML_Trace *t);
+
+#endif /* MML_TRACE_H */
@@ -0,0 +1,276 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * VGM ファイル出力
+ *  ドライバモデルで演奏した時の PSG (AY-3-8910) レジスタへの書き込みを
+ *  44.1kHz のサンプル数の待ちコマンド付きで出力する
+ *  繰り返し位置は、ドライバの状態 (割り込み番号と統計用のカウンタは除く) が
+ *  以前と同じになる最初の位置を Brent の方法で求める
+ *  ('J' のあるチャンネルの繰り返しの周期がそろう位置になる)
+ *  繰り返し位置とファイルの長さを先に求めてからヘッダとデータを順に書くので、
+ *  曲の長さに関係なく使用メモリは一定で、シークできない出力先にも書ける
+ */
+
+#include "mml_vgm.h"
+
+#include <string.h>
+
+/* VGM のコマンド */
+#define VGM_AY8910	0xA0	/* レジスタ番号, 値 */
+#define VGM_WAIT	0x61	/* 16bit のサンプル数待つ */
+#define VGM_WAIT_60HZ	0x62	/* 735 サンプル待つ */
+#define VGM_WAIT_50HZ	0x63	/* 882 サンプル待つ */
+#define VGM_END		0x66
+#define VGM_WAIT_SHORT	0x70	/* 0x70-0x7F: 1〜16 サンプル待つ */
+
+/* 出力するレジスタ (I/O ポートの 14, 15 は除く) */
+#define VGM_NREGS	14
+
+/* VGM データの出力状態 */
+typedef struct {
+    FILE    *fp;            /* NULL ならバイト数を数えるだけ */
+    size_t   size;          /* 出力したバイト数 */
+    unsigned long wait;     /* まだ出力していない待ちサンプル数 */
+} Vgm;
+
+static void
+vgm_put(Vgm *v, const uint8_t *b, size_t n)
+{
+    if (v->fp != NULL)
+        fwrite(b, 1, n, v->fp);
+    v->size += n;
+}
+
+static void
+put_le32(uint8_t *p, uint32_t v)
+{
+    for (int k = 0; k < 4; k++)
+        p[k] = (uint8_t)(v >> (k * 8));
+}
+
+/* 溜めた待ち時間を出力 */
+static void
+vgm_flush_wait(Vgm *v)
+{
+    while (v->wait > 0) {
+        uint8_t b[3];
+        unsigned long n = (v->wait > 0xFFFF) ? 0xFFFF : v->wait;
+        if (n == 735) {
+            b[0] = VGM_WAIT_60HZ;
+            vgm_put(v, b, 1);
+        } else if (n == 882) {
+            b[0] = VGM_WAIT_50HZ;
+            vgm_put(v, b, 1);
+        } else if (n <= 16) {
+            b[0] = VGM_WAIT_SHORT + (uint8_t)(n - 1);
+            vgm_put(v, b, 1);
+        } else {
+            b[0] = VGM_WAIT;
+            b[1] = (uint8_t)n;
+            b[2] = (uint8_t)(n >> 8);
+            vgm_put(v, b, 3);
+        }
+        v->wait -= n;
+    }
+}
+
+/* 割り込み番号 tick の開始時点のサンプル位置 */
+static unsigned long
+vgm_sample(unsigned long tick)
+{
+    return (unsigned long)((unsigned long long)tick * MML_VGM_RATE /
+      MML_PLAYER_HZ);
+}
+
+/* 繰り返しの判定に使う状態 (割り込み番号と統計用のカウンタを除く) */
+static void
+vgm_state(MML_Player *k, const MML_Player *p)
+{
+    *k = *p;
+    k->tick = 0;
+    k->dirty = 0;
+    for (int i = 0; i < PSG_NCH; i++) {
+        MML_Iter *it = &k->ch[i].it;
+        it->time = 0;
+        it->nnotes = 0;
+        memset(it->head, 0, sizeof(it->head));
+        it->repeats = 0;
+        it->loops = 0;
+    }
+}
+
+static bool
+vgm_same(const MML_Player *a, const MML_Player *b)
+{
+    MML_Player ka, kb;
+
+    vgm_state(&ka, a);
+    vgm_state(&kb, b);
+    return memcmp(&ka, &kb, sizeof(ka)) == 0;
+}
+
+/*
+ * 繰り返し位置と出力する長さを求める
+ *  全チャンネルが終了すればそこまで、maxticks 回までに繰り返しが
+ *  見つからなければ maxticks 回で打ち切る
+ */
+static const char *
+vgm_find_loop(const uint8_t *img, size_t len, const size_t start[PSG_NCH],
+    unsigned long maxticks, MML_VgmInfo *info)
+{
+    MML_Player tortoise, hare;
+    unsigned long power = 1, lam = 1;
+
+    /* 周期: 2 のべき乗毎に基準を置き直して同じ状態に戻るまでの回数を数える */
+    mml_player_init(&hare, img, len, start);
+    tortoise = hare;
+    if (!mml_player_tick(&hare))
+        return hare.error;
+    for (;;) {
+        if (mml_player_ended(&hare)) {
+            info->nticks = hare.tick;
+            return NULL;
+        }
+        if (vgm_same(&tortoise, &hare))
+            break;
+        if (hare.tick >= maxticks) {
+            info->nticks = maxticks;
+            info->limited = true;
+            return NULL;
+        }
+        if (power == lam) {
+            tortoise = hare;
+            power *= 2;
+            lam = 0;
+        }
+        if (!mml_player_tick(&hare))
+            return hare.error;
+        lam++;
+    }
+
+    /* 開始位置: 周期だけ離して同時に進め、初めて同じ状態になる位置 */
+    mml_player_init(&tortoise, img, len, start);
+    hare = tortoise;
+    for (unsigned long k = 0; k < lam; k++) {
+        if (!mml_player_tick(&hare))
+            return hare.error;
+    }
+    while (!vgm_same(&tortoise, &hare)) {
+        if (!mml_player_tick(&tortoise))
+            return tortoise.error;
+        if (!mml_player_tick(&hare))
+            return hare.error;
+    }
+    info->intro = tortoise.tick;
+    info->loop = lam;
+    info->nticks = info->intro + lam;
+    return NULL;
+}
+
+/*
+ * VGM データ部の出力
+ *  先頭と繰り返し位置では全レジスタ、それ以外は値の変わったレジスタを書き込む
+ *  繰り返し位置のデータ部先頭からのバイト数を loop_pos に返す
+ */
+static const char *
+vgm_data(Vgm *v, const uint8_t *img, size_t len, const size_t start[PSG_NCH],
+    const MML_VgmInfo *info, size_t *loop_pos)
+{
+    MML_Player p;
+    uint8_t b[3];
+
+    mml_player_init(&p, img, len, start);
+    for (unsigned long t = 0; t < info->nticks; t++) {
+        if (!mml_player_tick(&p))
+            return p.error;
+        unsigned dirty = p.dirty;
+        if (t == 0 || (info->loop > 0 && t == info->intro)) {
+            vgm_flush_wait(v);
+            if (info->loop > 0 && t == info->intro)
+                *loop_pos = v->size;
+            dirty = (1U << VGM_NREGS) - 1;
+        }
+        for (int r = 0; r < VGM_NREGS; r++) {
+            if ((dirty & (1U << r)) == 0)
+                continue;
+            vgm_flush_wait(v);
+            b[0] = VGM_AY8910;
+            b[1] = (uint8_t)r;
+            b[2] = p.reg[r];
+            vgm_put(v, b, 3);
+        }
+        v->wait += vgm_sample(t + 1) - vgm_sample(t);
+    }
+    vgm_flush_wait(v);
+    b[0] = VGM_END;
+    vgm_put(v, b, 1);
+    return NULL;
+}
+
+/*
+ * VGM ファイルの出力
+ *  全チャンネルが終了するか繰り返しの 1 回目の終わりまで
+ *  (最大 maxticks 回) 演奏した分を出力する
+ */
+const char *
+mml_vgm_write(FILE *fp, const uint8_t *img, size_t len,
+    const size_t start[PSG_NCH], unsigned long maxticks, MML_VgmInfo *info)
+{
+    Vgm v = { NULL, 0, 0 };
+    size_t loop_pos = 0;
+    uint8_t hdr[MML_VGM_HDR_LEN];
+    const char *e;
+
+    memset(info, 0, sizeof(*info));
+    if ((e = vgm_find_loop(img, len, start, maxticks, info)) != NULL)
+        return e;
+
+    /* データ部のバイト数と繰り返し位置を数えてからヘッダを作る */
+    if ((e = vgm_data(&v, img, len, start, info, &loop_pos)) != NULL)
+        return e;
+    info->size = MML_VGM_HDR_LEN + v.size;
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, "Vgm ", 4);
+    put_le32(hdr + 0x04, (uint32_t)(info->size - 0x04));   /* EOF 位置 */
+    put_le32(hdr + 0x08, MML_VGM_VERSION);
+    put_le32(hdr + 0x18, (uint32_t)vgm_sample(info->nticks));
+    if (info->loop > 0) {
+        put_le32(hdr + 0x1C, (uint32_t)(MML_VGM_HDR_LEN + loop_pos - 0x1C));
+        put_le32(hdr + 0x20, (uint32_t)(vgm_sample(info->nticks) -
+          vgm_sample(info->intro)));
+    }
+    put_le32(hdr + 0x24, MML_PLAYER_HZ);
+    put_le32(hdr + 0x34, MML_VGM_HDR_LEN - 0x34);           /* データ位置 */
+    put_le32(hdr + 0x74, MML_PSG_CLOCK);
+    hdr[0x78] = 0x00;                                       /* AY8910 */
+    hdr[0x79] = 0x01;                                       /* 標準の出力 */
+    fwrite(hdr, 1, sizeof(hdr), fp);
+
+    v.fp = fp;
+    v.size = 0;
+    v.wait = 0;
+    return vgm_data(&v, img, len, start, info, &loop_pos);
+}
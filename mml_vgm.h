@@ -0,0 +1,53 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MML_VGM_H
+#define MML_VGM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mml_binary.h"
+#include "mml_player.h"
+
+/* VGM ファイル (フォーマットは README 参照) */
+#define MML_VGM_VERSION		0x151
+#define MML_VGM_RATE		44100	/* 待ち時間のサンプリング周波数 */
+#define MML_VGM_HDR_LEN		0x80
+
+/* VGM の出力結果 */
+typedef struct {
+    unsigned long nticks;   /* 出力した割り込み回数 (繰り返し 1 回分を含む) */
+    unsigned long intro;    /* 繰り返し開始までの割り込み回数 */
+    unsigned long loop;     /* 繰り返しの割り込み回数 (繰り返さなければ 0) */
+    bool     limited;       /* maxticks で打ち切った */
+    size_t   size;          /* ファイルのバイト数 */
+} MML_VgmInfo;
+
+const char *mml_vgm_write(FILE *fp, const uint8_t *img, size_t len,
+    const size_t start[PSG_NCH], unsigned long maxticks, MML_VgmInfo *info);
+
+#endif /* MML_VGM_H */
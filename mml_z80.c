@@ -0,0 +1,155 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 実機の音源ドライバの Z80 コードによる演奏
+ *  ユーザが用意したドライバとコンパイル済みイメージをメモリに配置し、
+ *  ドライバのサブルーチンや割り込み処理を呼び出して
+ *  PSG レジスタへの書き込みをサイクル単位の時刻付きで記録する
+ *  ドライバの C 言語による再現ではなく実機のコードそのものなので、
+ *  最適化などの結果を検証する際の基準になる
+ */
+
+#include "mml_z80.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* 呼び出したルーチンからの戻り先 (PC-6001 では ROM なのでドライバは使わない) */
+#define Z80_RETURN_ADDR	0x0000
+
+static uint8_t
+psg_in(void *ctx, uint16_t port)
+{
+    MML_Z80Driver *d = ctx;
+
+    if ((port & 0xFF) == P6_PSG_READ)
+        return d->psg[d->psg_addr];
+    return 0xFF;
+}
+
+static void
+psg_out(void *ctx, uint16_t port, uint8_t value)
+{
+    MML_Z80Driver *d = ctx;
+
+    switch (port & 0xFF) {
+    case P6_PSG_ADDR:
+        d->psg_addr = value & (PSG_NREGS - 1);
+        break;
+    case P6_PSG_WRITE:
+        d->psg[d->psg_addr] = value;
+        if (d->nwrites >= d->writes_cap) {
+            size_t ncap = (d->writes_cap == 0) ? 64 : d->writes_cap * 2;
+            MML_PsgWrite *nw = realloc(d->writes, ncap * sizeof(*nw));
+            if (nw == NULL) {
+                d->nomem = true;
+                return;
+            }
+            d->writes = nw;
+            d->writes_cap = ncap;
+        }
+        d->writes[d->nwrites].cycle = (uint32_t)(d->cpu.cycles - d->start);
+        d->writes[d->nwrites].reg = d->psg_addr;
+        d->writes[d->nwrites].value = value;
+        d->nwrites++;
+        break;
+    }
+}
+
+/* 初期化 (sp は呼び出し時のスタックポインタ) */
+void
+mml_z80_init(MML_Z80Driver *d, uint16_t sp)
+{
+    memset(d->mem, 0, sizeof(d->mem));
+    memset(d->psg, 0, sizeof(d->psg));
+    d->psg_addr = 0;
+    d->writes = NULL;
+    d->nwrites = 0;
+    d->writes_cap = 0;
+    d->nomem = false;
+
+    z80_reset(&d->cpu);
+    d->cpu.mem = d->mem;
+    d->cpu.ctx = d;
+    d->cpu.in = psg_in;
+    d->cpu.out = psg_out;
+    d->cpu.sp = sp;
+    d->cpu.trap = Z80_RETURN_ADDR;
+}
+
+/* メモリへの配置 (64KB を超える場合はエラーメッセージを返す) */
+const char *
+mml_z80_load(MML_Z80Driver *d, const uint8_t *data, size_t len, int addr)
+{
+    if (addr < 0 || addr + len > sizeof(d->mem))
+        return "64KB のアドレス空間に収まりません";
+    memcpy(d->mem + addr, data, len);
+    return NULL;
+}
+
+/*
+ * ルーチン呼び出し
+ *  HL に hl を設定して addr を呼び出し、戻ってくるまで実行する
+ *  (割り込み処理は RETI などで戻るのでサブルーチンと同じ扱いでよい)
+ *  PSG レジスタ書き込みは d->writes に記録し、実行サイクル数を *cycles に返す
+ *  上限のサイクル数以内に戻らなければエラーメッセージを返す
+ */
+const char *
+mml_z80_call(MML_Z80Driver *d, uint16_t addr, uint16_t hl, uint32_t *cycles)
+{
+    Z80 *z = &d->cpu;
+    uint16_t sp = z->sp;
+
+    d->nwrites = 0;
+    d->start = z->cycles;
+    z->reg[Z80_REG_H] = (uint8_t)(hl >> 8);
+    z->reg[Z80_REG_L] = (uint8_t)hl;
+    z->sp -= 2;
+    z->mem[z->sp] = Z80_RETURN_ADDR & 0xFF;
+    z->mem[(uint16_t)(z->sp + 1)] = Z80_RETURN_ADDR >> 8;
+    z->pc = addr;
+    z->halted = false;
+
+    z80_run(z, d->start + MML_Z80_MAX_CYCLES);
+    *cycles = (uint32_t)(z->cycles - d->start);
+    if (d->nomem)
+        return "PSG 書き込み記録用のメモリを確保できませんでした";
+    if (z->halted)
+        return "HALT 命令で停止しました";
+    if (z->pc != Z80_RETURN_ADDR)
+        return "上限のサイクル数以内に戻りません (演奏が進まないデータの可能性があります)";
+    if (z->sp != sp)
+        return "スタックポインタが呼び出し前と一致しません";
+    return NULL;
+}
+
+void
+mml_z80_free(MML_Z80Driver *d)
+{
+    free(d->writes);
+    d->writes = NULL;
+    d->nwrites = 0;
+    d->writes_cap = 0;
+}
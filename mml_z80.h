@@ -0,0 +1,72 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MML_Z80_H
+#define MML_Z80_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "z80.h"
+#include "mml_binary.h"
+
+/* PC-6001 の PSG (AY-3-8910) の I/O ポート */
+#define P6_PSG_ADDR	0xA0	/* レジスタ番号の設定 */
+#define P6_PSG_WRITE	0xA1	/* データ書き込み */
+#define P6_PSG_READ	0xA2	/* データ読み出し */
+
+/* 1 回の呼び出しで実行するサイクル数の上限 (4MHz で約 1 秒) */
+#define MML_Z80_MAX_CYCLES	4000000
+
+/* PSG レジスタ書き込み (1件分) */
+typedef struct {
+    uint32_t cycle;         /* 呼び出し開始からのサイクル数 */
+    uint8_t  reg;
+    uint8_t  value;
+} MML_PsgWrite;
+
+/* 実機の音源ドライバを実行する Z80 の環境 */
+typedef struct {
+    Z80      cpu;
+    uint8_t  mem[0x10000];
+    uint8_t  psg_addr;
+    uint8_t  psg[PSG_NREGS];
+    uint64_t start;         /* 呼び出し開始時のサイクル数 */
+
+    /* 呼び出し中の PSG レジスタ書き込み */
+    MML_PsgWrite *writes;
+    size_t   nwrites;
+    size_t   writes_cap;
+    bool     nomem;
+} MML_Z80Driver;
+
+void mml_z80_init(MML_Z80Driver *d, uint16_t sp);
+const char *mml_z80_load(MML_Z80Driver *d, const uint8_t *data, size_t len,
+    int addr);
+const char *mml_z80_call(MML_Z80Driver *d, uint16_t addr, uint16_t hl,
+    uint32_t *cycles);
+void mml_z80_free(MML_Z80Driver *d);
+
+#endif /* MML_Z80_H */
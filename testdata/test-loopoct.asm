@@ -0,0 +1,59 @@
+; PSG data: base address 0x0000, 75 bytes
+	ORG	0000H
+test_loopoct:
+	DW	test_loopoct_D,test_loopoct_E,test_loopoct_F
+	DW	0
+test_loopoct_D:
+	DB	0F8H,18H,03H
+	DB	9AH
+	DB	0F0H,03H	; [ 3
+test_loopoct_L1:
+	DB	83H
+	DB	28H,24H
+	DB	84H
+	DB	0CH
+	DB	23H,24H
+	DB	0F1H,0F7H	; ] test_loopoct_L1
+	DB	0AH
+	DB	0F0H,02H	; [ 2
+test_loopoct_L2:
+	DB	00H
+	DB	82H
+	DB	0F1H,0FCH	; ] test_loopoct_L2
+	DB	01H
+	DB	0FFH
+test_loopoct_E:
+	DB	0F8H,18H,03H
+	DB	9AH
+	DB	0F0H,02H	; [ 2
+test_loopoct_L3:
+	DB	85H
+	DB	01H
+	DB	0F0H,02H	; [ 2
+test_loopoct_L4:
+	DB	03H
+	DB	0F1H,0FDH	; ] test_loopoct_L4
+	DB	99H
+	DB	05H
+	DB	0F1H,0F5H	; ] test_loopoct_L3
+	DB	01H
+	DB	0FFH
+test_loopoct_F:
+	DB	0F8H,18H,03H
+	DB	98H
+	DB	0F0H,02H	; [ 2
+test_loopoct_L5:
+	DB	0F0H,02H	; [ 2
+test_loopoct_L6:
+	DB	0F0H,02H	; [ 2
+test_loopoct_L7:
+	DB	0F0H,02H	; [ 2
+test_loopoct_L8:
+	DB	85H
+	DB	01H
+	DB	0F1H,0FCH	; ] test_loopoct_L8
+	DB	0F1H,0F8H	; ] test_loopoct_L7
+	DB	0F1H,0F4H	; ] test_loopoct_L6
+	DB	0F1H,0F0H	; ] test_loopoct_L5
+	DB	01H
+	DB	0FFH
@@ -0,0 +1,44 @@
+; ------------------------------------------------------------
+; test-z80drv.asm - -m z80 の動作確認用の最小限のドライバ
+;   p6psgmmlc -m z80 -D 0x8000,0x8000,0x8010 test-z80drv.bin song.bin
+;   (test-z80drv.bin はこのソースをアセンブルしたもの)
+; ------------------------------------------------------------
+PSGADR	EQU	0A0H
+PSGDAT	EQU	0A1H
+
+	ORG	8000H
+
+; 初期化: HL = 曲データの先頭
+INIT:	LD	(SONG),HL		; 8000  22 2E 80
+	XOR	A			; 8003  AF
+	LD	(COUNT),A		; 8004  32 30 80
+	LD	A,7			; 8007  3E 07
+	OUT	(PSGADR),A		; 8009  D3 A0
+	LD	A,38H			; 800B  3E 38  トーン A-C のみ
+	OUT	(PSGDAT),A		; 800D  D3 A1
+	RET				; 800F  C9
+
+; 割り込み処理: 呼び出し回数をチャンネル A の音量に、
+;               チャンネル D の先頭のオペコードをレジスタ 0 に書く
+PLAY:	LD	HL,COUNT		; 8010  21 30 80
+	INC	(HL)			; 8013  34
+	LD	A,8			; 8014  3E 08
+	OUT	(PSGADR),A		; 8016  D3 A0
+	LD	A,(HL)			; 8018  7E
+	AND	0FH			; 8019  E6 0F
+	OUT	(PSGDAT),A		; 801B  D3 A1
+	LD	HL,(SONG)		; 801D  2A 2E 80
+	LD	E,(HL)			; 8020  5E
+	INC	HL			; 8021  23
+	LD	D,(HL)			; 8022  56
+	LD	A,(DE)			; 8023  1A
+	LD	B,A			; 8024  47
+	XOR	A			; 8025  AF
+	OUT	(PSGADR),A		; 8026  D3 A0
+	LD	A,B			; 8028  78
+	OUT	(PSGDAT),A		; 8029  D3 A1
+	EI				; 802B  FB
+	RETI				; 802C  ED 4D
+
+SONG:	DW	0			; 802E
+COUNT:	DB	0			; 8030
@@ -0,0 +1,1099 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Z80 CPU コア
+ *  命令デコードは x/y/z (および p/q) のビットフィールドで分類し、
+ *  分類毎の処理にディスパッチする
+ *  GCC/Clang では計算型 goto で各処理の末尾から次の命令へ直接飛ぶ
+ *  (Z80_NO_COMPUTED_GOTO を定義すると switch 文による処理になる)
+ */
+
+#include "z80.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && !defined(Z80_NO_COMPUTED_GOTO)
+#define Z80_COMPUTED_GOTO
+#endif
+
+/* フラグ */
+#define FS	0x80
+#define FZ	0x40
+#define FY	0x20
+#define FH	0x10
+#define FX	0x08
+#define FP	0x04	/* P/V */
+#define FN	0x02
+#define FC	0x01
+
+#define A	(z->reg[Z80_REG_A])
+#define F	(z->reg[Z80_REG_F])
+
+#define RD(addr)	(z->mem[(uint16_t)(addr)])
+#define WR(addr, v)	(z->mem[(uint16_t)(addr)] = (uint8_t)(v))
+
+/* 命令の分類 */
+#define Z80_OPCLASSES(X) \
+    X(NOP) X(EX_AF) X(DJNZ) X(JR) X(JR_CC) \
+    X(LD_RP_NN) X(ADD_HL_RP) X(LD_IND_A) X(LD_A_IND) \
+    X(LD_NN_HL) X(LD_HL_NN) X(LD_NN_A) X(LD_A_NN) X(INC_RP) X(DEC_RP) \
+    X(INC_R) X(DEC_R) X(INC_M) X(DEC_M) X(LD_R_N) X(LD_M_N) \
+    X(RLCA) X(RRCA) X(RLA) X(RRA) X(DAA) X(CPL) X(SCF) X(CCF) \
+    X(LD_R_R) X(LD_R_M) X(LD_M_R) X(HALT) X(ALU_R) X(ALU_M) \
+    X(RET_CC) X(POP) X(RET) X(EXX) X(JP_HL) X(LD_SP_HL) X(JP_CC) X(JP) \
+    X(CB) X(OUT_N_A) X(IN_A_N) X(EX_SP_HL) X(EX_DE_HL) X(DI) X(EI) \
+    X(CALL_CC) X(PUSH) X(CALL) X(DD) X(ED) X(FD) X(ALU_N) X(RST)
+
+#define OPCLASS_ENUM(name)	OPC_##name,
+enum { Z80_OPCLASSES(OPCLASS_ENUM) OPC_NUM };
+
+/* 条件分岐の成立時に加算されるものを除いた命令毎のサイクル数 */
+static const uint8_t cyc_main[256] = {
+/*       0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F */
+/* 0 */  4,10, 7, 6, 4, 4, 7, 4, 4,11, 7, 6, 4, 4, 7, 4,
+/* 1 */  8,10, 7, 6, 4, 4, 7, 4,12,11, 7, 6, 4, 4, 7, 4,
+/* 2 */  7,10,16, 6, 4, 4, 7, 4, 7,11,16, 6, 4, 4, 7, 4,
+/* 3 */  7,10,13, 6,11,11,10, 4, 7,11,13, 6, 4, 4, 7, 4,
+/* 4 */  4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+/* 5 */  4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+/* 6 */  4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+/* 7 */  7, 7, 7, 7, 7, 7, 4, 7, 4, 4, 4, 4, 4, 4, 7, 4,
+/* 8 */  4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+/* 9 */  4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+/* A */  4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+/* B */  4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+/* C */  5,10,10,10,10,11, 7,11, 5,10,10, 0,10,17, 7,11,
+/* D */  5,10,10,11,10,11, 7,11, 5, 4,10,11,10, 0, 7,11,
+/* E */  5,10,10,19,10,11, 7,11, 5, 4,10, 4,10, 0, 7,11,
+/* F */  5,10,10, 4,10,11, 7,11, 5, 6,10, 4,10, 0, 7,11,
+};
+
+static uint8_t opclass[256];
+static uint8_t sz53[256];       /* S, Z, 未定義フラグ (bit5, bit3) */
+static uint8_t sz53p[256];      /* 上記とパリティ */
+static bool tables_ready;
+
+/* 条件 NZ, Z, NC, C, PO, PE, P, M の判定フラグ */
+static const uint8_t cc_flag[4] = { FZ, FC, FP, FS };
+
+static void
+init_tables(void)
+{
+    for (int i = 0; i < 256; i++) {
+        int parity = 0;
+        for (int b = 0; b < 8; b++)
+            parity ^= (i >> b) & 1;
+        sz53[i] = (i & (FS | FY | FX)) | (i == 0 ? FZ : 0);
+        sz53p[i] = sz53[i] | (parity ? 0 : FP);
+
+        int x = i >> 6, y = (i >> 3) & 7, zz = i & 7, p = y >> 1, q = y & 1;
+        uint8_t c = OPC_NOP;
+        switch (x) {
+        case 0:
+            switch (zz) {
+            case 0:
+                c = (y == 0) ? OPC_NOP : (y == 1) ? OPC_EX_AF :
+                  (y == 2) ? OPC_DJNZ : (y == 3) ? OPC_JR : OPC_JR_CC;
+                break;
+            case 1:
+                c = q ? OPC_ADD_HL_RP : OPC_LD_RP_NN;
+                break;
+            case 2: {
+                static const uint8_t ld[8] = {
+                    OPC_LD_IND_A, OPC_LD_A_IND, OPC_LD_IND_A, OPC_LD_A_IND,
+                    OPC_LD_NN_HL, OPC_LD_HL_NN, OPC_LD_NN_A, OPC_LD_A_NN
+                };
+                c = ld[y];
+                break;
+            }
+            case 3:
+                c = q ? OPC_DEC_RP : OPC_INC_RP;
+                break;
+            case 4:
+                c = (y == 6) ? OPC_INC_M : OPC_INC_R;
+                break;
+            case 5:
+                c = (y == 6) ? OPC_DEC_M : OPC_DEC_R;
+                break;
+            case 6:
+                c = (y == 6) ? OPC_LD_M_N : OPC_LD_R_N;
+                break;
+            case 7: {
+                static const uint8_t misc[8] = {
+                    OPC_RLCA, OPC_RRCA, OPC_RLA, OPC_RRA,
+                    OPC_DAA, OPC_CPL, OPC_SCF, OPC_CCF
+                };
+                c = misc[y];
+                break;
+            }
+            }
+            (void)p;
+            break;
+        case 1:
+            c = (i == 0x76) ? OPC_HALT : (zz == 6) ? OPC_LD_R_M :
+              (y == 6) ? OPC_LD_M_R : OPC_LD_R_R;
+            break;
+        case 2:
+            c = (zz == 6) ? OPC_ALU_M : OPC_ALU_R;
+            break;
+        case 3:
+            switch (zz) {
+            case 0:
+                c = OPC_RET_CC;
+                break;
+            case 1: {
+                static const uint8_t pop[4] = {
+                    OPC_RET, OPC_EXX, OPC_JP_HL, OPC_LD_SP_HL
+                };
+                c = q ? pop[p] : OPC_POP;
+                break;
+            }
+            case 2:
+                c = OPC_JP_CC;
+                break;
+            case 3: {
+                static const uint8_t misc[8] = {
+                    OPC_JP, OPC_CB, OPC_OUT_N_A, OPC_IN_A_N,
+                    OPC_EX_SP_HL, OPC_EX_DE_HL, OPC_DI, OPC_EI
+                };
+                c = misc[y];
+                break;
+            }
+            case 4:
+                c = OPC_CALL_CC;
+                break;
+            case 5: {
+                static const uint8_t call[4] = {
+                    OPC_CALL, OPC_DD, OPC_ED, OPC_FD
+                };
+                c = q ? call[p] : OPC_PUSH;
+                break;
+            }
+            case 6:
+                c = OPC_ALU_N;
+                break;
+            case 7:
+                c = OPC_RST;
+                break;
+            }
+            break;
+        }
+        opclass[i] = c;
+    }
+    tables_ready = true;
+}
+
+/* --- レジスタ・メモリアクセス ------------------------------------------- */
+
+static inline uint16_t
+get_pair(const Z80 *z, int r)
+{
+    return (uint16_t)(z->reg[r] << 8 | z->reg[r + 1]);
+}
+
+static inline void
+set_pair(Z80 *z, int r, uint16_t v)
+{
+    z->reg[r] = (uint8_t)(v >> 8);
+    z->reg[r + 1] = (uint8_t)v;
+}
+
+#define BC	get_pair(z, Z80_REG_B)
+#define DE	get_pair(z, Z80_REG_D)
+#define HL	get_pair(z, Z80_REG_H)
+
+/* 16ビットレジスタ指定 (p = 0:BC 1:DE 2:HL 3:SP) */
+static inline uint16_t
+get_rp(const Z80 *z, int p)
+{
+    return (p == 3) ? z->sp : get_pair(z, p * 2);
+}
+
+static inline void
+set_rp(Z80 *z, int p, uint16_t v)
+{
+    if (p == 3)
+        z->sp = v;
+    else
+        set_pair(z, p * 2, v);
+}
+
+static inline uint16_t
+rd16(const Z80 *z, uint16_t addr)
+{
+    return (uint16_t)(RD(addr) | RD(addr + 1) << 8);
+}
+
+static inline void
+wr16(Z80 *z, uint16_t addr, uint16_t v)
+{
+    WR(addr, v & 0xFF);
+    WR(addr + 1, v >> 8);
+}
+
+/* 命令の第1バイト (M1 サイクル) の読み出し */
+static inline uint8_t
+fetch_op(Z80 *z)
+{
+    z->r = (z->r & 0x80) | ((z->r + 1) & 0x7F);
+    return z->mem[z->pc++];
+}
+
+static inline uint8_t
+fetch(Z80 *z)
+{
+    return z->mem[z->pc++];
+}
+
+static inline uint16_t
+fetch16(Z80 *z)
+{
+    uint16_t v = rd16(z, z->pc);
+    z->pc += 2;
+    return v;
+}
+
+static inline void
+push(Z80 *z, uint16_t v)
+{
+    z->sp -= 2;
+    wr16(z, z->sp, v);
+}
+
+static inline uint16_t
+pop(Z80 *z)
+{
+    uint16_t v = rd16(z, z->sp);
+    z->sp += 2;
+    return v;
+}
+
+static inline bool
+cond(const Z80 *z, int y)
+{
+    return ((F & cc_flag[y >> 1]) != 0) == (y & 1);
+}
+
+static inline uint8_t
+port_in(Z80 *z, uint16_t port)
+{
+    return (z->in != NULL) ? z->in(z->ctx, port) : 0xFF;
+}
+
+static inline void
+port_out(Z80 *z, uint16_t port, uint8_t v)
+{
+    if (z->out != NULL)
+        z->out(z->ctx, port, v);
+}
+
+/* --- 演算 --------------------------------------------------------------- */
+
+/* 8ビット算術論理演算 (y = 0:ADD 1:ADC 2:SUB 3:SBC 4:AND 5:XOR 6:OR 7:CP) */
+static inline void
+alu(Z80 *z, int y, uint8_t v)
+{
+    unsigned a = A, r;
+
+    switch (y) {
+    case 0:
+    case 1:
+        r = a + v + ((y == 1) ? (F & FC) : 0);
+        A = (uint8_t)r;
+        F = sz53[r & 0xFF] | ((a ^ v ^ r) & FH) |
+          (((a ^ ~v) & (a ^ r) & 0x80) >> 5) | (r >> 8);
+        break;
+    case 2:
+    case 3:
+    case 7:
+        r = a - v - ((y == 3) ? (F & FC) : 0);
+        F = ((y == 7) ? ((sz53[r & 0xFF] & ~(FY | FX)) | (v & (FY | FX))) :
+          sz53[r & 0xFF]) | ((a ^ v ^ r) & FH) |
+          (((a ^ v) & (a ^ r) & 0x80) >> 5) | FN | ((r >> 8) & FC);
+        if (y != 7)
+            A = (uint8_t)r;
+        break;
+    case 4:
+        A &= v;
+        F = sz53p[A] | FH;
+        break;
+    case 5:
+        A ^= v;
+        F = sz53p[A];
+        break;
+    case 6:
+        A |= v;
+        F = sz53p[A];
+        break;
+    }
+}
+
+static inline uint8_t
+inc8(Z80 *z, uint8_t v)
+{
+    uint8_t r = v + 1;
+    F = (F & FC) | sz53[r] | ((r & 0x0F) == 0 ? FH : 0) |
+      (r == 0x80 ? FP : 0);
+    return r;
+}
+
+static inline uint8_t
+dec8(Z80 *z, uint8_t v)
+{
+    uint8_t r = v - 1;
+    F = (F & FC) | FN | sz53[r] | ((v & 0x0F) == 0 ? FH : 0) |
+      (r == 0x7F ? FP : 0);
+    return r;
+}
+
+static inline uint16_t
+add16(Z80 *z, uint16_t a, uint16_t v)
+{
+    uint32_t r = (uint32_t)a + v;
+    F = (F & (FS | FZ | FP)) | ((r >> 8) & (FY | FX)) |
+      (((a ^ v ^ r) >> 8) & FH) | (r >> 16);
+    return (uint16_t)r;
+}
+
+/* CB 系のローテート・シフト (y = 0:RLC 1:RRC 2:RL 3:RR 4:SLA 5:SRA 6:SLL 7:SRL) */
+static inline uint8_t
+shift8(Z80 *z, int y, uint8_t v)
+{
+    uint8_t r, c;
+
+    switch (y) {
+    case 0: c = v >> 7; r = (uint8_t)(v << 1 | c); break;
+    case 1: c = v & 1;  r = (uint8_t)(v >> 1 | c << 7); break;
+    case 2: c = v >> 7; r = (uint8_t)(v << 1 | (F & FC)); break;
+    case 3: c = v & 1;  r = (uint8_t)(v >> 1 | (F & FC) << 7); break;
+    case 4: c = v >> 7; r = (uint8_t)(v << 1); break;
+    case 5: c = v & 1;  r = (uint8_t)(v >> 1 | (v & 0x80)); break;
+    case 6: c = v >> 7; r = (uint8_t)(v << 1 | 1); break;
+    default: c = v & 1; r = v >> 1; break;
+    }
+    F = sz53p[r] | c;
+    return r;
+}
+
+/* BIT 命令 (xy は未定義フラグ bit5, bit3 の元になる値) */
+static inline void
+bit8(Z80 *z, int y, uint8_t v, uint8_t xy)
+{
+    uint8_t r = v & (1 << y);
+    F = (F & FC) | FH | (r & FS) | (r == 0 ? (FZ | FP) : 0) |
+      (xy & (FY | FX));
+}
+
+/* --- プリフィクス付き命令 ----------------------------------------------- */
+
+/* CB プリフィクス */
+static void
+exec_cb(Z80 *z)
+{
+    uint8_t op = fetch_op(z);
+    int x = op >> 6, y = (op >> 3) & 7, r = op & 7;
+    uint16_t hl = HL;
+    uint8_t v = (r == 6) ? RD(hl) : z->reg[r];
+
+    switch (x) {
+    case 0:
+        v = shift8(z, y, v);
+        break;
+    case 1:
+        bit8(z, y, v, (r == 6) ? (uint8_t)(hl >> 8) : v);
+        z->cycles += (r == 6) ? 12 : 8;
+        return;
+    case 2:
+        v &= ~(1 << y);
+        break;
+    case 3:
+        v |= 1 << y;
+        break;
+    }
+    if (r == 6) {
+        WR(hl, v);
+        z->cycles += 15;
+    } else {
+        z->reg[r] = v;
+        z->cycles += 8;
+    }
+}
+
+/* DD CB / FD CB プリフィクス (インデックス修飾付きのビット操作) */
+static void
+exec_xycb(Z80 *z, uint16_t xy)
+{
+    uint16_t addr = xy + (int8_t)fetch(z);
+    uint8_t op = fetch(z);
+    int x = op >> 6, y = (op >> 3) & 7, r = op & 7;
+    uint8_t v = RD(addr);
+
+    switch (x) {
+    case 0:
+        v = shift8(z, y, v);
+        break;
+    case 1:
+        bit8(z, y, v, (uint8_t)(addr >> 8));
+        z->cycles += 20;
+        return;
+    case 2:
+        v &= ~(1 << y);
+        break;
+    case 3:
+        v |= 1 << y;
+        break;
+    }
+    WR(addr, v);
+    if (r != 6)
+        z->reg[r] = v;  /* 未定義命令: 結果をレジスタにも入れる */
+    z->cycles += 23;
+}
+
+/* IXH/IXL (IYH/IYL) に置き換えた 8ビットレジスタ */
+static inline uint8_t
+get_xyr(const Z80 *z, const uint16_t *xy, int r)
+{
+    return (r == Z80_REG_H) ? (uint8_t)(*xy >> 8) :
+      (r == Z80_REG_L) ? (uint8_t)*xy : z->reg[r];
+}
+
+static inline void
+set_xyr(Z80 *z, uint16_t *xy, int r, uint8_t v)
+{
+    if (r == Z80_REG_H)
+        *xy = (uint16_t)((*xy & 0x00FF) | v << 8);
+    else if (r == Z80_REG_L)
+        *xy = (uint16_t)((*xy & 0xFF00) | v);
+    else
+        z->reg[r] = v;
+}
+
+/*
+ * DD / FD プリフィクス
+ *  HL を IX/IY に置き換える命令を実行する
+ *  置き換え対象でない命令なら false を返し、呼び出し側で通常の命令として実行する
+ */
+static bool
+exec_xy(Z80 *z, uint16_t *xy, uint8_t op)
+{
+    int y = (op >> 3) & 7, r = op & 7, p = y >> 1;
+    uint16_t addr;
+
+    switch (op) {
+    case 0x09: case 0x19: case 0x29: case 0x39:
+        *xy = add16(z, *xy, (p == 2) ? *xy : get_rp(z, p));
+        z->cycles += 15;
+        return true;
+    case 0x21:
+        *xy = fetch16(z);
+        z->cycles += 14;
+        return true;
+    case 0x22:
+        wr16(z, fetch16(z), *xy);
+        z->cycles += 20;
+        return true;
+    case 0x2A:
+        *xy = rd16(z, fetch16(z));
+        z->cycles += 20;
+        return true;
+    case 0x23:
+        (*xy)++;
+        z->cycles += 10;
+        return true;
+    case 0x2B:
+        (*xy)--;
+        z->cycles += 10;
+        return true;
+    case 0x24: case 0x2C:
+        set_xyr(z, xy, y, inc8(z, get_xyr(z, xy, y)));
+        z->cycles += 8;
+        return true;
+    case 0x25: case 0x2D:
+        set_xyr(z, xy, y, dec8(z, get_xyr(z, xy, y)));
+        z->cycles += 8;
+        return true;
+    case 0x26: case 0x2E:
+        set_xyr(z, xy, y, fetch(z));
+        z->cycles += 11;
+        return true;
+    case 0x34:
+        addr = *xy + (int8_t)fetch(z);
+        WR(addr, inc8(z, RD(addr)));
+        z->cycles += 23;
+        return true;
+    case 0x35:
+        addr = *xy + (int8_t)fetch(z);
+        WR(addr, dec8(z, RD(addr)));
+        z->cycles += 23;
+        return true;
+    case 0x36:
+        addr = *xy + (int8_t)fetch(z);
+        WR(addr, fetch(z));
+        z->cycles += 19;
+        return true;
+    case 0xCB:
+        exec_xycb(z, *xy);
+        return true;
+    case 0xE1:
+        *xy = pop(z);
+        z->cycles += 14;
+        return true;
+    case 0xE3: {
+        uint16_t v = rd16(z, z->sp);
+        wr16(z, z->sp, *xy);
+        *xy = v;
+        z->cycles += 23;
+        return true;
+    }
+    case 0xE5:
+        push(z, *xy);
+        z->cycles += 15;
+        return true;
+    case 0xE9:
+        z->pc = *xy;
+        z->cycles += 8;
+        return true;
+    case 0xF9:
+        z->sp = *xy;
+        z->cycles += 10;
+        return true;
+    }
+
+    if (op >= 0x40 && op < 0x80 && op != 0x76) {
+        if (r == 6) {           /* LD r,(IX+d) */
+            z->reg[y] = RD(*xy + (int8_t)fetch(z));
+            z->cycles += 19;
+        } else if (y == 6) {    /* LD (IX+d),r */
+            WR(*xy + (int8_t)fetch(z), z->reg[r]);
+            z->cycles += 19;
+        } else if (y == Z80_REG_H || y == Z80_REG_L || r == Z80_REG_H || r == Z80_REG_L) {
+            set_xyr(z, xy, y, get_xyr(z, xy, r));
+            z->cycles += 8;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    if (op >= 0x80 && op < 0xC0) {
+        if (r == 6) {
+            alu(z, y, RD(*xy + (int8_t)fetch(z)));
+            z->cycles += 19;
+        } else if (r == Z80_REG_H || r == Z80_REG_L) {
+            alu(z, y, get_xyr(z, xy, r));
+            z->cycles += 8;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+/* ED プリフィクス */
+static void
+exec_ed(Z80 *z)
+{
+    uint8_t op = fetch_op(z);
+    int x = op >> 6, y = (op >> 3) & 7, zz = op & 7, p = y >> 1, q = y & 1;
+    uint8_t v;
+
+    if (x == 1) {
+        switch (zz) {
+        case 0:                 /* IN r,(C) */
+            v = port_in(z, BC);
+            if (y != 6)
+                z->reg[y] = v;
+            F = (F & FC) | sz53p[v];
+            z->cycles += 12;
+            return;
+        case 1:                 /* OUT (C),r */
+            port_out(z, BC, (y == 6) ? 0 : z->reg[y]);
+            z->cycles += 12;
+            return;
+        case 2: {               /* SBC HL,rp / ADC HL,rp */
+            uint32_t hl = HL, rr = get_rp(z, p), r;
+            if (q == 0) {
+                r = hl - rr - (F & FC);
+                F = FN | (((hl ^ rr) & (hl ^ r) & 0x8000) >> 13);
+            } else {
+                r = hl + rr + (F & FC);
+                F = ((hl ^ ~rr) & (hl ^ r) & 0x8000) >> 13;
+            }
+            F |= ((r >> 8) & (FS | FY | FX)) | ((r & 0xFFFF) ? 0 : FZ) |
+              (((hl ^ rr ^ r) >> 8) & FH) | ((r >> 16) & FC);
+            set_pair(z, Z80_REG_H, (uint16_t)r);
+            z->cycles += 15;
+            return;
+        }
+        case 3:                 /* LD (nn),rp / LD rp,(nn) */
+            if (q == 0)
+                wr16(z, fetch16(z), get_rp(z, p));
+            else
+                set_rp(z, p, rd16(z, fetch16(z)));
+            z->cycles += 20;
+            return;
+        case 4:                 /* NEG */
+            v = A;
+            A = 0;
+            alu(z, 2, v);
+            z->cycles += 8;
+            return;
+        case 5:                 /* RETN / RETI */
+            z->pc = pop(z);
+            z->iff1 = z->iff2;
+            z->cycles += 14;
+            return;
+        case 6:                 /* IM n */
+            z->im = (y & 3) == 0 ? 0 : (y & 3) - 1;
+            z->cycles += 8;
+            return;
+        case 7:
+            switch (y) {
+            case 0: z->i = A; break;
+            case 1: z->r = A; break;
+            case 2:
+            case 3:
+                A = (y == 2) ? z->i : z->r;
+                F = (F & FC) | sz53[A] | (z->iff2 ? FP : 0);
+                break;
+            case 4:             /* RRD */
+            case 5: {           /* RLD */
+                uint16_t hl = HL;
+                uint8_t m = RD(hl);
+                if (y == 4) {
+                    WR(hl, (A << 4) | (m >> 4));
+                    A = (A & 0xF0) | (m & 0x0F);
+                } else {
+                    WR(hl, (m << 4) | (A & 0x0F));
+                    A = (A & 0xF0) | (m >> 4);
+                }
+                F = (F & FC) | sz53p[A];
+                z->cycles += 18;
+                return;
+            }
+            default:
+                break;
+            }
+            z->cycles += (y < 4) ? 9 : 8;
+            return;
+        }
+    }
+
+    if (x == 2 && zz <= 3 && y >= 4) {
+        /* ブロック転送・サーチ・入出力 (y = 4:I 5:D 6:IR 7:DR) */
+        int dir = (y & 1) ? -1 : 1;
+        bool repeat = y >= 6, again = false;
+        uint16_t hl = HL;
+        uint8_t k;
+        switch (zz) {
+        case 0: {               /* LDI / LDD */
+            uint16_t de = DE, bc = BC - 1;
+            v = RD(hl);
+            WR(de, v);
+            set_pair(z, Z80_REG_H, hl + dir);
+            set_pair(z, Z80_REG_D, de + dir);
+            set_pair(z, Z80_REG_B, bc);
+            k = v + A;
+            F = (F & (FS | FZ | FC)) | (bc ? FP : 0) | (k & FX) |
+              ((k & 0x02) << 4);
+            again = bc != 0;
+            break;
+        }
+        case 1: {               /* CPI / CPD */
+            uint16_t bc = BC - 1;
+            v = RD(hl);
+            uint8_t r = A - v, h = (A ^ v ^ r) & FH;
+            set_pair(z, Z80_REG_H, hl + dir);
+            set_pair(z, Z80_REG_B, bc);
+            k = r - (h ? 1 : 0);
+            F = (F & FC) | FN | (r & FS) | (r ? 0 : FZ) | h | (bc ? FP : 0) |
+              (k & FX) | ((k & 0x02) << 4);
+            again = bc != 0 && r != 0;
+            break;
+        }
+        case 2:                 /* INI / IND */
+        case 3: {               /* OUTI / OUTD */
+            unsigned t;
+            if (zz == 2) {
+                v = port_in(z, BC);
+                WR(hl, v);
+                z->reg[Z80_REG_B]--;
+                t = v + (uint8_t)(z->reg[Z80_REG_C] + dir);
+            } else {
+                v = RD(hl);
+                z->reg[Z80_REG_B]--;
+                port_out(z, BC, v);
+                t = v + (uint8_t)(hl + dir);
+            }
+            set_pair(z, Z80_REG_H, hl + dir);
+            F = sz53[z->reg[Z80_REG_B]] | ((v & 0x80) ? FN : 0) |
+              (t > 0xFF ? (FH | FC) : 0) |
+              (sz53p[(t & 7) ^ z->reg[Z80_REG_B]] & FP);
+            again = z->reg[Z80_REG_B] != 0;
+            break;
+        }
+        }
+        if (repeat && again) {
+            z->pc -= 2;
+            z->cycles += 21;
+        } else {
+            z->cycles += 16;
+        }
+        return;
+    }
+
+    z->cycles += 8;             /* 未定義の ED 命令は何もしない */
+}
+
+/* --- 公開API ------------------------------------------------------------- */
+
+/* リセット (レジスタを初期化; メモリと I/O の設定は変更しない) */
+void
+z80_reset(Z80 *z)
+{
+    if (!tables_ready)
+        init_tables();
+    memset(z->reg, 0xFF, sizeof(z->reg));
+    memset(z->alt, 0xFF, sizeof(z->alt));
+    z->ix = z->iy = 0xFFFF;
+    z->sp = 0xFFFF;
+    z->pc = 0;
+    z->i = z->r = 0;
+    z->iff1 = z->iff2 = false;
+    z->im = 0;
+    z->halted = false;
+    z->trap = -1;
+    z->cycles = 0;
+}
+
+/*
+ * 命令実行
+ *  サイクル数が limit に達するか、HALT 命令を実行するか、
+ *  trap の番地に来るまで実行する
+ *  (割り込みは扱わないので、呼び出し側で PC と SP を設定して呼び出す)
+ */
+void
+z80_run(Z80 *z, uint64_t limit)
+{
+    uint8_t op;
+    int y, p;
+    uint16_t addr;
+
+#ifdef Z80_COMPUTED_GOTO
+#define OPCLASS_LABEL(name)	[OPC_##name] = &&op_##name,
+    static const void *const label[OPC_NUM] = {
+        Z80_OPCLASSES(OPCLASS_LABEL)
+    };
+#define OP(name)	op_##name
+#define NEXT \
+    do { \
+        if (z->cycles >= limit || z->halted || z->pc == z->trap) \
+            return; \
+        op = fetch_op(z); \
+        z->cycles += cyc_main[op]; \
+        goto *label[opclass[op]]; \
+    } while (0)
+#define DISPATCH	goto *label[opclass[op]]
+#else
+#define OP(name)	case OPC_##name
+#define NEXT		goto next
+#define DISPATCH	goto dispatch
+#endif
+
+#ifdef Z80_COMPUTED_GOTO
+    NEXT;
+#else
+ next:
+    if (z->cycles >= limit || z->halted || z->pc == z->trap)
+        return;
+    op = fetch_op(z);
+    z->cycles += cyc_main[op];
+ dispatch:
+    switch (opclass[op]) {
+#endif
+    OP(NOP):
+        NEXT;
+    OP(EX_AF): {
+        uint8_t a = A, f = F;
+        A = z->alt[Z80_REG_A];
+        F = z->alt[Z80_REG_F];
+        z->alt[Z80_REG_A] = a;
+        z->alt[Z80_REG_F] = f;
+        NEXT;
+    }
+    OP(DJNZ): {
+        int8_t d = (int8_t)fetch(z);
+        if (--z->reg[Z80_REG_B] != 0) {
+            z->pc += d;
+            z->cycles += 5;
+        }
+        NEXT;
+    }
+    OP(JR): {
+        int8_t d = (int8_t)fetch(z);
+        z->pc += d;
+        NEXT;
+    }
+    OP(JR_CC): {
+        int8_t d = (int8_t)fetch(z);
+        if (cond(z, ((op >> 3) & 7) - 4)) {
+            z->pc += d;
+            z->cycles += 5;
+        }
+        NEXT;
+    }
+    OP(LD_RP_NN):
+        set_rp(z, op >> 4, fetch16(z));
+        NEXT;
+    OP(ADD_HL_RP):
+        set_pair(z, Z80_REG_H, add16(z, HL, get_rp(z, op >> 4)));
+        NEXT;
+    OP(LD_IND_A):
+        WR(get_pair(z, (op >> 3) & 2), A);
+        NEXT;
+    OP(LD_A_IND):
+        A = RD(get_pair(z, (op >> 3) & 2));
+        NEXT;
+    OP(LD_NN_HL):
+        wr16(z, fetch16(z), HL);
+        NEXT;
+    OP(LD_HL_NN):
+        set_pair(z, Z80_REG_H, rd16(z, fetch16(z)));
+        NEXT;
+    OP(LD_NN_A):
+        WR(fetch16(z), A);
+        NEXT;
+    OP(LD_A_NN):
+        A = RD(fetch16(z));
+        NEXT;
+    OP(INC_RP):
+        p = op >> 4;
+        set_rp(z, p, get_rp(z, p) + 1);
+        NEXT;
+    OP(DEC_RP):
+        p = op >> 4;
+        set_rp(z, p, get_rp(z, p) - 1);
+        NEXT;
+    OP(INC_R):
+        y = (op >> 3) & 7;
+        z->reg[y] = inc8(z, z->reg[y]);
+        NEXT;
+    OP(DEC_R):
+        y = (op >> 3) & 7;
+        z->reg[y] = dec8(z, z->reg[y]);
+        NEXT;
+    OP(INC_M):
+        addr = HL;
+        WR(addr, inc8(z, RD(addr)));
+        NEXT;
+    OP(DEC_M):
+        addr = HL;
+        WR(addr, dec8(z, RD(addr)));
+        NEXT;
+    OP(LD_R_N):
+        z->reg[(op >> 3) & 7] = fetch(z);
+        NEXT;
+    OP(LD_M_N):
+        WR(HL, fetch(z));
+        NEXT;
+    OP(RLCA):
+        A = (uint8_t)(A << 1 | A >> 7);
+        F = (F & (FS | FZ | FP)) | (A & (FY | FX | FC));
+        NEXT;
+    OP(RRCA): {
+        uint8_t c = A & 1;
+        A = (uint8_t)(A >> 1 | c << 7);
+        F = (F & (FS | FZ | FP)) | (A & (FY | FX)) | c;
+        NEXT;
+    }
+    OP(RLA): {
+        uint8_t c = A >> 7;
+        A = (uint8_t)(A << 1 | (F & FC));
+        F = (F & (FS | FZ | FP)) | (A & (FY | FX)) | c;
+        NEXT;
+    }
+    OP(RRA): {
+        uint8_t c = A & 1;
+        A = (uint8_t)(A >> 1 | (F & FC) << 7);
+        F = (F & (FS | FZ | FP)) | (A & (FY | FX)) | c;
+        NEXT;
+    }
+    OP(DAA): {
+        uint8_t a = A, corr = 0, c = F & FC, h;
+        if ((F & FH) || (a & 0x0F) > 9)
+            corr |= 0x06;
+        if (c || a > 0x99) {
+            corr |= 0x60;
+            c = FC;
+        }
+        if (F & FN) {
+            h = ((F & FH) && (a & 0x0F) < 6) ? FH : 0;
+            A = a - corr;
+        } else {
+            h = ((a & 0x0F) > 9) ? FH : 0;
+            A = a + corr;
+        }
+        F = sz53p[A] | h | (F & FN) | c;
+        NEXT;
+    }
+    OP(CPL):
+        A = ~A;
+        F = (F & (FS | FZ | FP | FC)) | FH | FN | (A & (FY | FX));
+        NEXT;
+    OP(SCF):
+        F = (F & (FS | FZ | FP)) | (A & (FY | FX)) | FC;
+        NEXT;
+    OP(CCF):
+        F = (F & (FS | FZ | FP)) | ((F & FC) ? FH : 0) | (A & (FY | FX)) |
+          ((F & FC) ^ FC);
+        NEXT;
+    OP(LD_R_R):
+        z->reg[(op >> 3) & 7] = z->reg[op & 7];
+        NEXT;
+    OP(LD_R_M):
+        z->reg[(op >> 3) & 7] = RD(HL);
+        NEXT;
+    OP(LD_M_R):
+        WR(HL, z->reg[op & 7]);
+        NEXT;
+    OP(HALT):
+        z->halted = true;
+        NEXT;
+    OP(ALU_R):
+        alu(z, (op >> 3) & 7, z->reg[op & 7]);
+        NEXT;
+    OP(ALU_M):
+        alu(z, (op >> 3) & 7, RD(HL));
+        NEXT;
+    OP(RET_CC):
+        if (cond(z, (op >> 3) & 7)) {
+            z->pc = pop(z);
+            z->cycles += 6;
+        }
+        NEXT;
+    OP(POP): {
+        uint16_t v = pop(z);
+        p = (op >> 4) & 3;
+        if (p == 3) {
+            A = (uint8_t)(v >> 8);
+            F = (uint8_t)v;
+        } else {
+            set_pair(z, p * 2, v);
+        }
+        NEXT;
+    }
+    OP(RET):
+        z->pc = pop(z);
+        NEXT;
+    OP(EXX): {
+        uint8_t t[6];
+        memcpy(t, z->reg, 6);
+        memcpy(z->reg, z->alt, 6);
+        memcpy(z->alt, t, 6);
+        NEXT;
+    }
+    OP(JP_HL):
+        z->pc = HL;
+        NEXT;
+    OP(LD_SP_HL):
+        z->sp = HL;
+        NEXT;
+    OP(JP_CC):
+        addr = fetch16(z);
+        if (cond(z, (op >> 3) & 7))
+            z->pc = addr;
+        NEXT;
+    OP(JP):
+        z->pc = fetch16(z);
+        NEXT;
+    OP(CB):
+        exec_cb(z);
+        NEXT;
+    OP(OUT_N_A):
+        port_out(z, (uint16_t)(A << 8 | fetch(z)), A);
+        NEXT;
+    OP(IN_A_N):
+        A = port_in(z, (uint16_t)(A << 8 | fetch(z)));
+        NEXT;
+    OP(EX_SP_HL): {
+        uint16_t v = rd16(z, z->sp);
+        wr16(z, z->sp, HL);
+        set_pair(z, Z80_REG_H, v);
+        NEXT;
+    }
+    OP(EX_DE_HL): {
+        uint16_t v = DE;
+        set_pair(z, Z80_REG_D, HL);
+        set_pair(z, Z80_REG_H, v);
+        NEXT;
+    }
+    OP(DI):
+        z->iff1 = z->iff2 = false;
+        NEXT;
+    OP(EI):
+        z->iff1 = z->iff2 = true;
+        NEXT;
+    OP(CALL_CC):
+        addr = fetch16(z);
+        if (cond(z, (op >> 3) & 7)) {
+            push(z, z->pc);
+            z->pc = addr;
+            z->cycles += 7;
+        }
+        NEXT;
+    OP(PUSH):
+        p = (op >> 4) & 3;
+        push(z, (p == 3) ? (uint16_t)(A << 8 | F) : get_pair(z, p * 2));
+        NEXT;
+    OP(CALL):
+        addr = fetch16(z);
+        push(z, z->pc);
+        z->pc = addr;
+        NEXT;
+    OP(DD):
+    OP(FD): {
+        uint16_t *xy = (op == 0xDD) ? &z->ix : &z->iy;
+        op = fetch_op(z);
+        if (exec_xy(z, xy, op))
+            NEXT;
+        /* HL を使わない命令はプリフィクスの分だけ遅い通常の命令 */
+        z->cycles += 4 + cyc_main[op];
+        DISPATCH;
+    }
+    OP(ED):
+        exec_ed(z);
+        NEXT;
+    OP(ALU_N):
+        alu(z, (op >> 3) & 7, fetch(z));
+        NEXT;
+    OP(RST):
+        push(z, z->pc);
+        z->pc = op & 0x38;
+        NEXT;
+#ifndef Z80_COMPUTED_GOTO
+    }
+    goto next;
+#endif
+}
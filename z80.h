@@ -0,0 +1,74 @@
+/*-
+ * Copyright (c) 2025 Izumi Tsutsui.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef Z80_H
+#define Z80_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Z80 CPU コア
+ *  音源ドライバの実機コードをそのまま実行して PSG の書き込みと
+ *  処理サイクル数を得るためのもので、命令毎のサイクル数まで再現する
+ *  (メモリ待ちや割り込み応答などの機種依存部分は扱わない)
+ */
+
+/* 8ビットレジスタの並び (命令のレジスタ指定と同じ順, 6 は (HL) の代わりに F) */
+#define Z80_REG_B	0
+#define Z80_REG_C	1
+#define Z80_REG_D	2
+#define Z80_REG_E	3
+#define Z80_REG_H	4
+#define Z80_REG_L	5
+#define Z80_REG_F	6
+#define Z80_REG_A	7
+
+typedef struct Z80 {
+    uint8_t  reg[8];
+    uint8_t  alt[8];        /* 裏レジスタ */
+    uint16_t ix;
+    uint16_t iy;
+    uint16_t sp;
+    uint16_t pc;
+    uint8_t  i;
+    uint8_t  r;
+    bool     iff1;
+    bool     iff2;
+    uint8_t  im;
+    bool     halted;        /* HALT 命令で停止中 */
+    int32_t  trap;          /* この番地に来たら停止 (-1 なら無効) */
+
+    uint64_t cycles;        /* 実行したサイクル (T ステート) 数 */
+
+    uint8_t *mem;           /* 64KB のメモリ (呼び出し側で確保) */
+    void    *ctx;           /* I/O コールバック用 */
+    uint8_t (*in)(void *ctx, uint16_t port);
+    void    (*out)(void *ctx, uint16_t port, uint8_t value);
+} Z80;
+
+void z80_reset(Z80 *z);
+void z80_run(Z80 *z, uint64_t limit);
+
+#endif /* Z80_H */